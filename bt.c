@@ -8,22 +8,31 @@ static char *G_bt_words[] = {
     "add",
     "autolist",
     "autotree",
+    "batch",
     "bye",
+    "cache",
     "del",
     "display",
     "find",
+    "get",
     "help",
     "hush",
     "id",
     "ins",
     "list",
+    "load",
     "noid",
     "notrc",
+    "put",
     "quit",
+    "range",
     "rem",
+    "save",
     "search",
     "show",
     "stop",
+    "stress",
+    "sync",
     "trc",
     NULL};
 
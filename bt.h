@@ -6,25 +6,34 @@
 #define BT_ADD	  0
 #define BT_AUTOLIST	  1
 #define BT_AUTOTREE	  2
-#define BT_BYE	  3
-#define BT_DEL	  4
-#define BT_DISPLAY	  5
-#define BT_FIND	  6
-#define BT_HELP	  7
-#define BT_HUSH	  8
-#define BT_ID	  9
-#define BT_INS	 10
-#define BT_LIST	 11
-#define BT_NOID	 12
-#define BT_NOTRC	 13
-#define BT_QUIT	 14
-#define BT_REM	 15
-#define BT_SEARCH	 16
-#define BT_SHOW	 17
-#define BT_STOP	 18
-#define BT_TRC	 19
+#define BT_BATCH	  3
+#define BT_BYE	  4
+#define BT_CACHE	  5
+#define BT_DEL	  6
+#define BT_DISPLAY	  7
+#define BT_FIND	  8
+#define BT_GET	  9
+#define BT_HELP	 10
+#define BT_HUSH	 11
+#define BT_ID	 12
+#define BT_INS	 13
+#define BT_LIST	 14
+#define BT_LOAD	 15
+#define BT_NOID	 16
+#define BT_NOTRC	 17
+#define BT_PUT	 18
+#define BT_QUIT	 19
+#define BT_RANGE	 20
+#define BT_REM	 21
+#define BT_SAVE	 22
+#define BT_SEARCH	 23
+#define BT_SHOW	 24
+#define BT_STOP	 25
+#define BT_STRESS	 26
+#define BT_SYNC	 27
+#define BT_TRC	 28
 
-#define BT_COUNT	20
+#define BT_COUNT	29
 
 extern int   bt_search(char *w);
 extern char *bt_keyword(int code);
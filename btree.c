@@ -3,6 +3,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "btree.h"
@@ -11,20 +13,24 @@
 
 #define LINE_LEN          2048
 #define KEY_MAXLEN         250
-#define OPTIONS      "xeunqp:dk:" 
+#define STRESS_SCAN         16   // Keys read by a scan in STRESS
+#define OPTIONS      "xeuinclomqap:b:f:dk:t:s:w:g:j:y:r:S:" 
 
 #define SHOW_NOTHING         0
 #define SHOW_TREE            1
 #define SHOW_LIST            2
 
-static char G_extended = 0;
-static char G_id = 1;
 static char G_echo = 0;
 static char G_prompt = 1;
 
+// Length-prefixed copy of a key typed by the user (-t bytes)
+static uint16_t G_keybuf[(LINE_LEN + 1) / sizeof(uint16_t) + 2];
+
 static char *read_key(FILE *input) {
-    char  buffer[KEY_MAXLEN +1];
-    char *p;
+    // Returns the next line without surrounding spaces,
+    // valid until the next call (the tree copies keys)
+    static char  buffer[KEY_MAXLEN +1];
+    char        *p;
     int   len;
 
     if (fgets(buffer, KEY_MAXLEN + 1, input) != NULL) {
@@ -38,121 +44,390 @@ static char *read_key(FILE *input) {
       }
       if (len) {
         p[len] = '\0';
-        return strdup(p); 
+        return p;
       }
     }
     return NULL;
 }
 
-static void  list(NODE_T *n) {
+static char *cli_key(BTREE_T *t, char *key) {
+    // The library expects length-prefixed keys when they
+    // are bytes, everything else is passed as text
+    if (key && (btree_keytype(t) == BTREE_BYTES)) {
+      return key_frombytes((char *)G_keybuf, key, strlen(key));
+    }
+    return key;
+}
+
+// What btree_load() reads keys from
+typedef struct bulk_src_t {
+          FILE    *fp;
+          BTREE_T *t;
+         } BULK_SRC_T;
+
+static char *bulk_key(void *ctx, void **valptr) {
+    // One key per line as with -p, no value
+    BULK_SRC_T  *src = (BULK_SRC_T *)ctx;
+
+    *valptr = NULL;
+    return cli_key(src->t, read_key(src->fp));
+}
+
+static void  list(BTREE_T *t, NODE_T *n) {
     short i;
+    char  buf[KEY_TEXTLEN];
 
     if (n) {
       for (i = 0; i <= n->keycnt; i++) {
-        if (n->k[i].key) {
-          if (btree_numeric()) {
-            printf(" %d", *((int*)(n->k[i].key)));
-          } else {
-            printf(" %s", n->k[i].key);
+        // B+tree separators are copies of keys in leaves
+        if (i && (_is_leaf(n) || !btree_plus(t))) {
+          printf(" %s", key_text(t, key_at(t, n, i), buf));
+        }
+        list(t, n->k[i].bigger);
+      }
+    }
+}
+
+static void  range(BTREE_T *t, char *args) {
+    // RANGE <lo> <hi> [<limit>]: the keys between lo
+    // and hi (both included), at most limit of them
+    CURSOR_T  c;
+    KEYBUF_T  val;
+    char     *lo;
+    char     *hi;
+    char     *k;
+    long      limit = -1;
+    long      cnt = 0;
+    char      buf[KEY_TEXTLEN];
+
+    lo = strtok(args, " \t");
+    hi = strtok(NULL, " \t");
+    if ((k = strtok(NULL, " \t")) != NULL) {
+      limit = strtol(k, NULL, 10);
+    }
+    if ((lo == NULL) || (hi == NULL)) {
+      printf("Usage: range <lo> <hi> [<limit>]\n");
+      return;
+    }
+    if (btree_seek(t, cli_key(t, lo), &c) == 0) {
+      // lo isn't needed any longer, hi may take its buffer
+      if ((hi = key_parse(t, cli_key(t, hi), &val)) == NULL) {
+        printf("Invalid key\n");
+        cursor_close(&c);
+        return;
+      }
+      while (((limit < 0) || (cnt < limit))
+             && !cursor_end(&c)
+             && (btree_keycmp(t, cursor_key(&c), hi) <= 0)) {
+        printf(" %s", key_text(t, cursor_key(&c), buf));
+        cnt++;
+        (void)cursor_next(&c);
+      }
+      cursor_close(&c);
+    }
+    putchar('\n');
+}
+
+static void  batch(BTREE_T *t, char *filename) {
+    // BATCH <filename>: one key per line, preceded by '-' to
+    // remove it, by '+' or nothing to insert it. Consecutive
+    // lines with the same sign, that must be sorted, are
+    // applied together
+    FILE  *fp;
+    char  *line;
+    char **keys = NULL;
+    int    size = 0;
+    int    cnt = 0;
+    int    ret = 0;
+    int    i;
+    char   op = '+';
+    char   lineop = '+';
+    long   added = 0;
+    long   removed = 0;
+
+    if ((filename == NULL) || (*filename == '\0')) {
+      printf("Usage: batch <filename>\n");
+      return;
+    }
+    if ((fp = fopen(filename, "r")) == NULL) {
+      perror(filename);
+      return;
+    }
+    do {
+      if ((line = read_key(fp)) != NULL) {
+        lineop = '+';
+        if ((*line == '+') || (*line == '-')) {
+          lineop = *line++;
+          while (isspace(*line)) {
+            line++;
           }
         }
-        list(n->k[i].bigger);
       }
+      if (cnt && ((line == NULL) || (lineop != op))) {
+        if (op == '-') {
+          ret = btree_delete_batch(t, keys, cnt);
+        } else {
+          ret = btree_insert_batch(t, keys, cnt);
+        }
+        if (ret < 0) {
+          printf("%s: invalid or unsorted keys, or keys not logged\n",
+                 filename);
+        } else if (op == '-') {
+          removed += ret;
+        } else {
+          added += ret;
+        }
+        for (i = 0; i < cnt; i++) {
+          free(keys[i]);
+        }
+        cnt = 0;
+      }
+      if (line && *line) {
+        if (cnt == size) {
+          size = (size ? 2 * size : 1024);
+          keys = (char **)realloc(keys, size * sizeof(char *));
+          assert(keys);
+        }
+        if (G_echo) {
+          printf("%c%s\n", lineop, line);
+          fflush(stdout);
+        }
+        // Room for the length of bytes keys
+        keys[cnt] = (char *)malloc(strlen(line) + 1 + sizeof(uint16_t));
+        assert(keys[cnt]);
+        if (btree_keytype(t) == BTREE_BYTES) {
+          key_frombytes(keys[cnt++], line, strlen(line));
+        } else {
+          strcpy(keys[cnt++], line);
+        }
+        op = lineop;
+      }
+    } while (line && (ret >= 0));
+    for (i = 0; i < cnt; i++) {
+      free(keys[i]);
     }
+    free(keys);
+    fclose(fp);
+    printf("%ld key%s added, %ld removed\n",
+           added, (added == 1 ? "" : "s"), removed);
 }
 
-extern void  btree_show_node(NODE_T *n) {
-   short i;
+// One of the threads started by STRESS
+typedef struct stress_t {
+          BTREE_T   *t;
+          pthread_t  thread;
+          unsigned   seed;
+          long       ops;
+          long       keys;     // Keys are drawn from 0 to keys - 1
+          long       added;    // Successful insertions
+          long       removed;  // Successful deletions
+          long       disorders;  // Keys out of order in scans
+         } STRESS_T;
 
-   assert(n);
-   if (G_id) {
-     printf("%3d-", n->id);
-   }
-   fflush(stdout);
-   putchar('[');
-   if (!G_extended) {
-     for (i = 1; i <= n->keycnt; i++) {
-       if (i > 1) {
-         putchar(' ');
-       }
-   fflush(stdout);
-       if (btree_numeric()) {
-         printf("%d", *((int*)(n->k[i].key)));
-       } else {
-         printf("%s", n->k[i].key);
-       }
-   fflush(stdout);
-       if (i < n->keycnt) {
-         putchar(',');
-       }
-   fflush(stdout);
-     }
-   } else {
-     for (i = 0; i <= btree_maxkeys(); i++) {
-       if (n->k[i].key) {
-         if (btree_numeric()) {
-           printf("%d", *((int*)(n->k[i].key)));
-         } else {
-           printf("%s", n->k[i].key);
-         }
-   fflush(stdout);
-       } else {
-         if (i) {
-           putchar('*');
-         }
-   fflush(stdout);
-       }
-       if (n->k[i].bigger) {
-         if (G_id) {
-           printf("<%hd>", (n->k[i].bigger)->id);
-         } else {
-           putchar(':');
-         }
-   fflush(stdout);
-       } else {
-         putchar('~');
-   fflush(stdout);
-       }
-     }
-     if (n->parent) {
-       printf("(^%hd)", (n->parent)->id);
-       fflush(stdout);
-     }
-   }
-   printf("]\n");
-   fflush(stdout);
+static long count_keys(BTREE_T *t) {
+    CURSOR_T c;
+    long     cnt = 0;
+
+    if (btree_first(t, &c) == 0) {
+      do {
+        cnt++;
+      } while (cursor_next(&c) == 0);
+    }
+    return cnt;
 }
 
-extern void  btree_display(NODE_T *n, int blanks) {
-  if (n) {
-    int  i;
+static void scan(STRESS_T *s, char *key) {
+    // Up to STRESS_SCAN keys from key, that must come
+    // in order while other threads change the tree
+    CURSOR_T  c;
+    KEYBUF_T  prev;
+    char     *prevkey = NULL;
+    int       i;
 
-    for (i = 1; i <= blanks; i++) {
-      putchar(' ');
+    if (btree_seek(s->t, key, &c) == 0) {
+      for (i = 0; (i < STRESS_SCAN) && !cursor_end(&c); i++) {
+        if (prevkey && (btree_keycmp(s->t, prevkey, cursor_key(&c)) > 0)) {
+          (s->disorders)++;
+        }
+        if (btree_keysize(s->t)) {
+          memcpy(&prev, cursor_key(&c), btree_keysize(s->t));
+          prevkey = (char *)&prev;
+        } else {
+          prevkey = cursor_key(&c);
+        }
+        (void)cursor_next(&c);
+      }
+      cursor_close(&c);
     }
-    btree_show_node(n);
-    for (i = 0; i <= n->keycnt; i++) {
-      btree_display(n->k[i].bigger, blanks + 3);
+}
+
+static void *stress_thread(void *arg) {
+    // Random insertions (half of the operations),
+    // deletions, searches and short scans
+    STRESS_T *s = (STRESS_T *)arg;
+    char      text[32];
+    uint16_t  buf[sizeof(text) / sizeof(uint16_t) + 2];
+    char     *key;
+    long      i;
+
+    for (i = 0; i < s->ops; i++) {
+      sprintf(text, "%ld", (long)rand_r(&(s->seed)) % s->keys);
+      key = text;
+      if (btree_keytype(s->t) == BTREE_BYTES) {
+        key = key_frombytes((char *)buf, text, strlen(text));
+      }
+      switch (rand_r(&(s->seed)) % 8) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+          if (btree_insert(s->t, key) == 0) {
+            (s->added)++;
+          }
+          break;
+        case 4:
+        case 5:
+          if (btree_delete(s->t, key) == 0) {
+            (s->removed)++;
+          }
+          break;
+        case 6:
+          (void)btree_get(s->t, key, NULL);
+          break;
+        default:
+          scan(s, key);
+          break;
+      }
     }
-  }                             /* End of if */
-  fflush(stdout);
-}                               /* End of btree_display() */
+    return NULL;
+}
 
+static void  stress(BTREE_T *t, char *args) {
+    // STRESS [<threads> [<ops> [<keys>]]]: threads that
+    // hammer the tree at the same time, then checks that
+    // it's consistent and holds the expected number of keys
+    STRESS_T        *s;
+    char            *w;
+    int              threads = 4;
+    long             ops = 100000;
+    long             keys = 10000;
+    long             before;
+    long             expected;
+    long             after;
+    long             disorders = 0;
+    int              i;
+    struct timespec  start;
+    struct timespec  end;
+    double           elapsed;
 
-static void usage(char *prog) {
+    if (!btree_concurrent(t)) {
+      printf("The tree must be created with -m\n");
+      return;
+    }
+    if ((w = strtok(args, " \t")) != NULL) {
+      threads = atoi(w);
+      if ((w = strtok(NULL, " \t")) != NULL) {
+        ops = atol(w);
+        if ((w = strtok(NULL, " \t")) != NULL) {
+          keys = atol(w);
+        }
+      }
+    }
+    if ((threads <= 0) || (ops <= 0) || (keys <= 0)) {
+      printf("Usage: stress [<threads> [<ops> [<keys>]]]\n");
+      return;
+    }
+    if ((s = (STRESS_T *)calloc(threads, sizeof(STRESS_T))) == NULL) {
+      perror("calloc");
+      return;
+    }
+    before = count_keys(t);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+      s[i].t = t;
+      s[i].seed = (unsigned)(start.tv_nsec + i);
+      s[i].ops = ops;
+      s[i].keys = keys;
+      if (pthread_create(&(s[i].thread), NULL, stress_thread, &(s[i]))) {
+        perror("pthread_create");
+        threads = i;
+        break;
+      }
+    }
+    expected = before;
+    for (i = 0; i < threads; i++) {
+      pthread_join(s[i].thread, NULL);
+      expected += s[i].added - s[i].removed;
+      disorders += s[i].disorders;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec)
+              + (end.tv_nsec - start.tv_nsec) / 1e9;
+    free(s);
+    after = count_keys(t);
+    printf("%d thread%s, %ld operations in %.3f s (%.0f per second)\n",
+           threads, (threads > 1 ? "s" : ""), threads * ops, elapsed,
+           threads * ops / elapsed);
+    if (btree_check(t, btree_root(t), NULL) || (after != expected)
+        || disorders) {
+      printf("*** ERROR *** %ld keys, %ld expected, %ld out of order\n",
+             after, expected, disorders);
+    } else {
+      printf("%ld keys - tree checked\n", after);
+    }
+}
+
+static void usage(BTREE_T *t, char *prog) {
    fprintf(stdout, "Usage: %s [flags]\n", prog);
    fprintf(stdout, "  Flags:\n");
    fprintf(stdout, "    -p <filename>: preload <filename>\n");
+   fprintf(stdout,
+       "    -a           : parse -p files on a thread of their own\n");
+   fprintf(stdout,
+       "    -b <filename>: bulk load <filename>, keys must be sorted\n");
+   fprintf(stdout,
+       "    -f <rate>    : how full -b makes nodes, 0 to 1 (default %.1f)\n",
+       btree_loadrate(t));
+   fprintf(stdout,
+       "    -w <filename>: keep the tree (keys only) in <filename>, created\n"
+       "                   if needed, with the settings it was created with\n");
+   fprintf(stdout,
+       "    -g <pages>   : keep at most <pages> pages of the -w file in memory\n");
+   fprintf(stdout,
+       "    -r <filename>: restore the tree saved in <filename> (SAVE)\n");
+   fprintf(stdout,
+       "    -j <filename>: log changes in <filename>, replayed first if it exists\n");
+   fprintf(stdout,
+       "    -y <n>       : write the log to disk every <n> changes (default 1)\n");
+   fprintf(stdout,
+       "    -S <socket>  : serve INS, DEL, FIND and RANGE requests on a Unix\n"
+       "                   domain socket instead of reading commands\n");
    fprintf(stdout,
            "    -k <n>       : store at most <n> keys per node (default %d)\n",
-           btree_maxkeys());
+           btree_maxkeys(t));
    fprintf(stdout,
        "    -x           : extended display - show links and empty slots\n");
    fprintf(stdout,
        "    -q           : quiet; don't display tree after changes\n");
    fprintf(stdout, "    -e           : echo value added/removed\n");
    fprintf(stdout, "    -u           : unique (no duplicate keys)\n");
-   fprintf(stdout, "    -n           : numeric values\n");
+   fprintf(stdout,
+       "    -i           : intern keys (one copy of a key removed and added again)\n");
+   fprintf(stdout,
+       "    -c           : compress string keys (prefix stored once per node)\n");
+   fprintf(stdout,
+       "    -l           : B+tree - keys in linked leaves, separators above\n");
+   fprintf(stdout,
+       "    -o           : one pass - split or refill nodes on the way down\n");
+   fprintf(stdout,
+       "    -m           : multithreaded - latched nodes, implies -o\n");
+   fprintf(stdout, "    -n           : numeric values (same as -t int)\n");
+   fprintf(stdout,
+       "    -t <type>    : key type - string (default), bytes (compared\n"
+       "                   with memcmp), int, long or double\n");
+   fprintf(stdout,
+       "    -s <search>  : search in nodes - auto (default), linear, binary\n"
+       "                   or interp (interpolation, numeric keys)\n");
 }
 
 int main(int argc, char **argv) {
@@ -160,30 +435,128 @@ int main(int argc, char **argv) {
   int    ch;
   FILE  *fp;
   int    preloaded = 0;
+  char   stored = 0;    // -w
+  char   logged = 0;    // -j
+  char   parser = 0;    // -a
+  char  *sockpath = NULL; // -S
+  int    group = 1;     // -y
+  char   compressed = 0;
+  char   shared = 0;
   char   feedback = SHOW_TREE;
   int    maxkeys;
+  float  rate;
   char   read_cmd = 1;
   char   line[LINE_LEN];
   char  *p;
   char  *q;
+  char  *value;
   int    len;
   int    kw;
+  BTREE_T *tree;
 
+  if ((tree = btree_new()) == NULL) {
+    perror("btree_new");
+    exit(1);
+  }
+  btree_setvalfree(tree, free);  // Values are strdup()'ed below
   while ((ch = getopt(argc, argv, OPTIONS)) != -1) {
     switch (ch) {
       case 'p':   // Preload
+        if ((len = (int)btree_feed(tree, optarg, parser)) > 0) {
+          preloaded += len;
+        }
+        break;
+      case 'a':   // Parse preloaded files on another thread
+        parser = 1;
+        break;
+      case 'S':   // Serve requests on a socket, no command loop
+        sockpath = optarg;
+        break;
+      case 'b':   // Bulk load
+        if (preloaded) {
+          fprintf(stderr, "Tree already loaded\n");
+          btree_free(tree);
+          exit(1);
+        }
         if ((fp = fopen(optarg, "r")) != NULL) {
-          while ((key = read_key(fp)) != NULL) {
-            btree_insert(key);
-            preloaded++;
+          BULK_SRC_T src;
+
+          src.fp = fp;
+          src.t = tree;
+          if ((preloaded = btree_load(tree, bulk_key, &src)) < 0) {
+            fprintf(stderr, "%s: keys aren't sorted\n", optarg);
+            preloaded = 0;
           }
           fclose(fp);
         } else {
           perror(optarg);
-        } 
+        }
+        break;
+      case 'w':   // Tree kept in a file
+        if (preloaded || stored || logged) {
+          fprintf(stderr, "Option -w <filename> must precede options -p, -b and -j\n");
+          btree_free(tree);
+          exit(1);
+        }
+        if (btree_open(tree, optarg)) {
+          btree_free(tree);
+          exit(1);
+        }
+        stored = 1;
+        preloaded = (btree_root(tree) != NULL);
+        break;
+      case 'r':   // Restore a snapshot
+        if (preloaded || logged) {
+          fprintf(stderr, "Option -r <filename> must precede options -p, -b and -j\n");
+          btree_free(tree);
+          exit(1);
+        }
+        if ((len = btree_restore(tree, optarg)) < 0) {
+          btree_free(tree);
+          exit(1);
+        }
+        printf("%d keys restored from %s\n", len, optarg);
+        preloaded = (btree_root(tree) != NULL);
+        break;
+      case 'j':   // Changes logged in a file
+        if (logged) {
+          fprintf(stderr, "Option -j <filename> can only be given once\n");
+          btree_free(tree);
+          exit(1);
+        }
+        if ((len = btree_openlog(tree, optarg, group)) < 0) {
+          btree_free(tree);
+          exit(1);
+        }
+        printf("%d changes replayed from %s\n", len, optarg);
+        logged = 1;
+        preloaded = (btree_root(tree) != NULL);
+        break;
+      case 'y':   // Log flushed every <n> changes
+        if (logged) {
+           fprintf(stderr, "Option -y <n> must precede option -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if ((sscanf(optarg, "%d", &group) != 1) || (group < 1)) {
+          printf("Invalid number of changes - the log is flushed after each one\n");
+          group = 1;
+        }
+        break;
+      case 'f':
+        if (preloaded) {
+           fprintf(stderr, "Option -f <rate> must precede option -b <filename>\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if (sscanf(optarg, "%f", &rate) != 1) {
+          printf("Invalid fill rate - using %.1f\n", btree_loadrate(tree));
+        } else {
+          btree_setloadrate(tree, rate);
+        }
         break;
       case 'x':
-        G_extended = 1;
+        btree_setshowslots(1);
         break;
       case 'e':
         G_echo = 1;
@@ -196,44 +569,158 @@ int main(int argc, char **argv) {
         G_prompt = 0;
         break;
       case 'n':
-        if (preloaded) {
-           fprintf(stderr, "Option -n must precede option -p <filename>\n");
-           btree_free();
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -n must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
            exit(1);
         }
-        btree_setnumeric();
+        btree_setnumeric(tree);
+        break;
+      case 't':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -t <type> must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if (strcasecmp(optarg, "int") == 0) {
+          btree_setkeytype(tree, BTREE_INT32);
+        } else if (strcasecmp(optarg, "long") == 0) {
+          btree_setkeytype(tree, BTREE_INT64);
+        } else if (strcasecmp(optarg, "double") == 0) {
+          btree_setkeytype(tree, BTREE_DOUBLE);
+        } else if (strcasecmp(optarg, "string") == 0) {
+          btree_setkeytype(tree, BTREE_STRING);
+        } else if (strcasecmp(optarg, "bytes") == 0) {
+          btree_setkeytype(tree, BTREE_BYTES);
+        } else {
+          fprintf(stderr, "Invalid key type \"%s\"\n", optarg);
+          usage(tree, argv[0]);
+          btree_free(tree);
+          exit(1);
+        }
+        break;
+      case 's':
+        if (strcasecmp(optarg, "auto") == 0) {
+          btree_setnodesearch(tree, NSEARCH_AUTO);
+        } else if (strcasecmp(optarg, "linear") == 0) {
+          btree_setnodesearch(tree, NSEARCH_LINEAR);
+        } else if (strcasecmp(optarg, "binary") == 0) {
+          btree_setnodesearch(tree, NSEARCH_BINARY);
+        } else if (strcasecmp(optarg, "interp") == 0) {
+          btree_setnodesearch(tree, NSEARCH_INTERP);
+        } else {
+          fprintf(stderr, "Invalid search strategy \"%s\"\n", optarg);
+          usage(tree, argv[0]);
+          btree_free(tree);
+          exit(1);
+        }
         break;
       case 'u':
-        if (preloaded) {
-           fprintf(stderr, "Option -u must precede option -p <filename>\n");
-           btree_free();
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -u must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        btree_setunique(tree);
+        break;
+      case 'i':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -i must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        btree_setintern(tree);
+        break;
+      case 'c':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -c must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if (shared) {
+           fprintf(stderr, "Options -c and -m are incompatible\n");
+           btree_free(tree);
+           exit(1);
+        }
+        btree_setprefix(tree);
+        compressed = 1;
+        break;
+      case 'l':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -l must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        btree_setplus(tree);
+        break;
+      case 'o':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -o must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        btree_settopdown(tree);
+        break;
+      case 'm':
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -m must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if (compressed) {
+           fprintf(stderr, "Options -c and -m are incompatible\n");
+           btree_free(tree);
            exit(1);
         }
-        btree_setunique();
+        btree_setconcurrent(tree);
+        shared = 1;
+        break;
+      case 'g':   // Cache size of the file
+        if (stored) {
+           fprintf(stderr, "Option -g <pages> must precede option -w\n");
+           btree_free(tree);
+           exit(1);
+        }
+        if ((sscanf(optarg, "%d", &maxkeys) != 1) || (maxkeys < 0)) {
+          printf("Invalid number of pages - the system decides\n");
+        } else {
+          btree_setcache(tree, (size_t)maxkeys);
+        }
         break;
       case 'k':
-        if (preloaded) {
-           fprintf(stderr, "Option -k <n> must precede option -p <filename>\n");
-           btree_free();
+        if (preloaded || stored || logged) {
+           fprintf(stderr, "Option -k <n> must precede options -p, -b, -w and -j\n");
+           btree_free(tree);
            exit(1);
         }
         if (!sscanf(optarg, "%d", &maxkeys)) {
-          printf("Invalid max number of keys - using %d\n", btree_maxkeys());
+          printf("Invalid max number of keys - using %d\n", btree_maxkeys(tree));
         }
-        btree_setmaxkeys(maxkeys);
+        btree_setmaxkeys(tree, maxkeys);
         break;
       case '?':
       default:
-        usage(argv[0]);
+        usage(tree, argv[0]);
         exit(1);
     }
   }
   debug_off(); // In case it was turned-on for preload
   argc -= optind;
   argv += optind;
+  if (sockpath) {
+    printf("Serving on %s\n", sockpath);
+    fflush(stdout);
+    if ((len = (int)btree_serve(tree, sockpath)) < 0) {
+      btree_free(tree);
+      exit(1);
+    }
+    printf("%d requests served\n", len);
+    btree_free(tree);
+    return 0;
+  }
   if (preloaded) {
     printf("Preloaded data:\n");
-    btree_display(btree_root(), 0);
+    btree_display(tree, btree_root(tree), 0);
   }
   printf("Enter \"help\" for available commands.\n");
   while (read_cmd) {
@@ -245,7 +732,7 @@ int main(int argc, char **argv) {
       }
     }
     if (fgets(line, LINE_LEN, stdin) == NULL) {
-      btree_free();
+      btree_free(tree);
       printf("Goodbye\n");
       break;
     }
@@ -271,10 +758,10 @@ int main(int argc, char **argv) {
       }
       switch((kw = bt_search(p))) {
           case BT_ID:
-              G_id = 1;
+              btree_setshowids(1);
               break;
           case BT_NOID:
-              G_id = 0;
+              btree_setshowids(0);
               break;
           case BT_AUTOTREE:
               feedback = SHOW_TREE;
@@ -297,12 +784,12 @@ int main(int argc, char **argv) {
                 printf("+%s\n", q);
                 fflush(stdout);
               }
-              btree_insert(q);
+              btree_insert(tree, cli_key(tree, q));
               if (feedback) {
                 if (feedback == SHOW_TREE) {
-                   btree_display(btree_root(), 0);
+                   btree_display(tree, btree_root(tree), 0);
                 } else {
-                   list(btree_root());
+                   list(tree, btree_root(tree));
                 }
                 putchar('\n');
               }
@@ -313,27 +800,128 @@ int main(int argc, char **argv) {
                 printf("-%s\n", q);
                 fflush(stdout);
               }
-              btree_delete(q);
+              btree_delete(tree, cli_key(tree, q));
+              if (feedback) {
+                if (feedback == SHOW_TREE) {
+                   btree_display(tree, btree_root(tree), 0);
+                } else {
+                   list(tree, btree_root(tree));
+                }
+                putchar('\n');
+              }
+              break;
+          case BT_PUT :
+              // First word is the key, what follows is the value
+              key = q;
+              while (*q && !isspace(*q)) {
+                q++;
+              }
+              if (isspace(*q)) {
+                *q++ = '\0';
+                while (isspace(*q)) {
+                  q++;
+                }
+              }
+              if (G_echo) {
+                printf("+%s=%s\n", key, q);
+                fflush(stdout);
+              }
+              if (btree_file(tree)) {
+                printf("Values can't be kept in a file (-w)\n");
+              } else if ((q = strdup(q)) != NULL) {
+                if (btree_put(tree, cli_key(tree, key), q)) {
+                  free(q);
+                }
+              }
               if (feedback) {
                 if (feedback == SHOW_TREE) {
-                   btree_display(btree_root(), 0);
+                   btree_display(tree, btree_root(tree), 0);
                 } else {
-                   list(btree_root());
+                   list(tree, btree_root(tree));
                 }
                 putchar('\n');
               }
               break;
+          case BT_GET :
+              if (btree_get(tree, cli_key(tree, q), (void **)&value) == 0) {
+                printf("%s\n", (value ? value : ""));
+              } else {
+                printf("*** NOT FOUND ***\n");
+              }
+              break;
           case BT_FIND :
           case BT_SEARCH :
-              btree_search(q);
+              btree_search(tree, cli_key(tree, q));
               break;
           case BT_LIST :
-              list(btree_root());
+              list(tree, btree_root(tree));
               putchar('\n');
               break;
+          case BT_RANGE :
+              range(tree, q);
+              break;
+          case BT_STRESS :
+              stress(tree, q);
+              break;
+          case BT_SYNC :
+              if ((btree_file(tree) == NULL) && (btree_log(tree) == NULL)) {
+                printf("The tree has neither a file (-w) nor a log (-j)\n");
+              } else if (btree_sync(tree) == 0) {
+                printf("Synced\n");
+              } else {
+                printf("Not synced, changes may be lost\n");
+              }
+              break;
+          case BT_SAVE :
+              if ((q == NULL) || (*q == '\0')) {
+                printf("Usage: save <filename>\n");
+              } else if ((len = btree_save(tree, q)) >= 0) {
+                printf("%d keys saved\n", len);
+              }
+              break;
+          case BT_LOAD :
+              if ((q == NULL) || (*q == '\0')) {
+                printf("Usage: load <filename>\n");
+              } else if (btree_root(tree) || btree_log(tree)) {
+                printf("Only an empty tree without a log (-j) can be loaded\n");
+              } else if ((len = btree_restore(tree, q)) >= 0) {
+                printf("%d keys loaded\n", len);
+              }
+              break;
+          case BT_CACHE :
+              {
+                POOL_STATS_T st;
+
+                if (btree_cachestats(tree, &st)) {
+                  printf("The file isn't cached (-g and -w)\n");
+                } else {
+                  // Only refaults show that pages are used again,
+                  // once per turn of the hand: not a hit ratio
+                  printf("%lu of %lu pages in memory, %llu misses,"
+                         " %llu refaults (pages used again after the clock"
+                         " hand went by), %llu evictions, %llu writes\n",
+                         (unsigned long)st.used, (unsigned long)st.frames,
+                         (unsigned long long)st.misses,
+                         (unsigned long long)st.refaults,
+                         (unsigned long long)st.evictions,
+                         (unsigned long long)st.writes);
+                }
+              }
+              break;
+          case BT_BATCH :
+              batch(tree, q);
+              if (feedback) {
+                if (feedback == SHOW_TREE) {
+                   btree_display(tree, btree_root(tree), 0);
+                } else {
+                   list(tree, btree_root(tree));
+                }
+                putchar('\n');
+              }
+              break;
           case BT_SHOW :
           case BT_DISPLAY :
-              btree_display(btree_root(), 0);
+              btree_display(tree, btree_root(tree), 0);
               putchar('\n');
               break;
           case BT_HELP :
@@ -341,11 +929,27 @@ int main(int argc, char **argv) {
               printf(" help                       : display this\n");
               printf(" ins <key> or add <key>     : insert a key\n");
               printf(" rem <key> or del <key>     : remove a key\n");
+              printf(" batch <filename>           : insert the keys of a file, or\n");
+              printf("                              remove them if preceded by '-'\n");
+              printf("                              (sorted runs applied at once)\n");
+              printf(" put <key> <value>          : insert a key with a value\n");
+              printf("                              or replace its value\n");
+              printf(" get <key>                  : display the value of a key\n");
               printf(" find <key> or search <key> : display search path\n");
               printf(" id                         : display id next to node (default)\n");
               printf(" noid                       : suppress id next to node\n");
               printf(" show or display            : display the tree\n");
               printf(" list                       : list ordered keys\n");
+              printf(" range <lo> <hi> [<limit>]  : list keys from lo to hi\n");
+              printf(" stress [<thr> [<ops> [<keys>]]]\n");
+              printf("                            : random changes by concurrent\n");
+              printf("                              threads, then check (-m)\n");
+              printf(" sync                       : write the tree to its file (-w)\n");
+              printf("                              or the log to disk (-j)\n");
+              printf(" save <filename>            : write a snapshot of the tree\n");
+              printf(" load <filename>            : read a snapshot into the empty tree\n");
+              printf(" cache                      : display the counters of the\n");
+              printf("                              pages of the file in memory (-g)\n");
               printf(" hush                       : display nothing after change\n");
               printf(" autotree                   : show tree after change (default)\n");
               printf(" autolist                   : show ordered list after change\n");
@@ -357,7 +961,7 @@ int main(int argc, char **argv) {
           case BT_QUIT :
           case BT_STOP :
               read_cmd = 0;
-              btree_free();
+              btree_free(tree);
               printf("Goodbye\n");
               break;
           default:
@@ -2,17 +2,82 @@
 
 #define BTREE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define DEF_MAX_KEYS  4
 #define DEF_FILL_RATE 0.5 
+#define DEF_LOAD_RATE 1.0   // Nodes built by btree_load() are full
+
+// Key types
+#define BTREE_STRING  0
+#define BTREE_INT32   1   // Numeric keys are stored inline
+#define BTREE_INT64   2   // in the node (see NODE_T)
+#define BTREE_DOUBLE  3
+#define BTREE_BYTES   4   // Length-prefixed, compared with memcmp
+
+// Length-prefixed keys: a uint16_t length then the bytes
+#define BYTES_LEN(k)   (*((uint16_t *)(k)))
+#define BYTES_DATA(k)  ((k) + sizeof(uint16_t))
+#define BYTES_SIZE(k)  (sizeof(uint16_t) + BYTES_LEN(k))
+
+#define KEY_TEXTLEN  64   // Any numeric key, the start of others
+#define KEY_RING      4   // Compressed keys rebuilt at the same time
+
+// How the position of a key in a node is searched
+#define NSEARCH_AUTO    0   // Depends on key type and max keys
+#define NSEARCH_LINEAR  1
+#define NSEARCH_BINARY  2
+#define NSEARCH_INTERP  3   // Numeric keys only
 
 #define _is_leaf(n)  (n->k[0].bigger == NULL)
-#define MIN_KEYS     (int)(btree_maxkeys() * btree_fillrate())
+// A full node split without the key that caused it must
+// leave two valid halves in top-down mode - one key short
+// of half full is allowed then with an even maximum
+#define MIN_KEYS(t)  (btree_topdown(t) ? (btree_maxkeys(t) - 1) / 2 \
+                      : (int)(btree_maxkeys(t) * btree_fillrate(t)))
 
 struct node_t;
 
+// A tree and its settings - content is private to btree_op.c
+typedef struct btree_t BTREE_T;
+
+// Allocators of same-size objects and of keys - content
+// is private to btree_arena.c
+typedef struct arena_t    ARENA_T;
+typedef struct keyarena_t KEYARENA_T;
+
+// File that holds a tree - content is private to btree_page.c
+typedef struct pagefile_t PAGEFILE_T;
+
+// Log of the changes of a tree - content is private
+// to btree_log.c
+typedef struct log_t LOG_T;
+
+#define LOG_INSERT  'I'
+#define LOG_DELETE  'D'
+
+// Pages of a file kept in memory - content is private
+// to btree_pool.c. Pages are read when they fault: while
+// a pool exists it handles SIGSEGV (other faults are passed
+// to the previous handler), it must only be used by one
+// thread, and system calls reading or writing its pages
+// directly may fail with EFAULT
+typedef struct pool_t POOL_T;
+
+typedef struct pool_stats_t {
+          size_t    frames;     // Pages that can be in memory
+          size_t    used;       // Pages in memory
+          uint64_t  refaults;   // Used again after the hand went by
+          uint64_t  misses;     // Pages read from the file
+          uint64_t  evictions;  // Pages taken out of memory
+          uint64_t  writes;     // Pages written to the file
+         } POOL_STATS_T;
+
 // Convenience structure
 typedef struct redirect_t {
-            char          *key;
+            char          *key;    // Only used for non numeric keys
+            void          *value;  // Data associated with the key
             struct node_t *bigger;
                      // Pointer to the subtree that contains
                      // keys bigger than the current one
@@ -22,44 +87,275 @@ typedef struct redirect_t {
 typedef struct node_t {
           short           id;      // For educational purposes
           short           keycnt;
-          REDIRECT_T     *k;       // 1 + maximum number of keys
-          struct node_t  *parent;  // Helps when deleting
+          uint32_t        latch;   // Concurrent trees (btree_latch.c)
+          REDIRECT_T     *k;       // 1 + maximum number of keys,
+                                   // allocated with the node
+          char           *nk;      // Numeric keys: 1 + maximum number
+                                   // of keys stored contiguously,
+                                   // after the slots
+          char           *pfx;     // Prefix mode: what all keys in the
+          short           pfxlen;  // node start with, slots only
+                                   // reference what follows
+          struct node_t  *next;    // B+tree mode: leaves are
+          struct node_t  *prev;    // chained in key order
          } NODE_T;
 
+// Room for a numeric key when it isn't in a node
+typedef union keybuf_t {
+          int32_t  i32;
+          int64_t  i64;
+          double   d;
+         } KEYBUF_T;
+
 // Convenience structure (key location)
 typedef struct keyloc_t {
           NODE_T  *n;
           short    pos;
          } KEYLOC_T;
 
-extern void     btree_setunique(void);
-extern char     btree_unique(void);
-extern void     btree_setnumeric(void);
-extern char     btree_numeric(void);
-extern void     btree_setmaxkeys(short n);
-extern short    btree_maxkeys(void);
-extern float    btree_fillrate(void);
-extern NODE_T  *btree_root(void);
-extern void     btree_setroot(NODE_T *n);
-extern int      btree_insert(char *key);
-extern int      btree_delete(char *key);
-extern void     btree_search(char *key);
-extern void     btree_free(void);
-extern void     btree_show_node(NODE_T *n);
-extern void     btree_display(NODE_T *n, int blanks);
-extern int      btree_keycmp(char *k1, char *k2);
-extern KEYLOC_T btree_find_key(char *key);
+// Nodes don't know their parent: going down, the nodes met
+// are recorded, with the slot followed in each one (n[i]
+// is the parent of n[i+1], pos[i] the index of the child
+// in n[i]). The last entry is the parent of the node
+// reached, if it isn't the root.
+#define PATH_MAXDEPTH  64   // Non-root nodes have at least two
+                            // children, 2^64 leaves is plenty
+
+typedef struct path_t {
+          short    depth;
+          NODE_T  *n[PATH_MAXDEPTH];
+          short    pos[PATH_MAXDEPTH];
+         } PATH_T;
+
+#define path_push(p, node, slot)  {(p)->n[(p)->depth] = (node);   \
+                                   (p)->pos[((p)->depth)++] = (slot);}
+
+// Position in an ordered walk (see btree_cursor.c),
+// invalidated by any change to the tree - except in a
+// concurrent tree, where it holds copies of its key and
+// value and the versions of the nodes it has read
+typedef struct cursor_t {
+          BTREE_T  *t;
+          KEYLOC_T  loc;   // loc.n is NULL past either end
+          PATH_T    path;  // Above loc.n
+          // Concurrent trees
+          uint32_t  pathver[PATH_MAXDEPTH];  // Of path.n[]
+          uint32_t  version;  // Of loc.n
+          char     *key;
+          void     *value;
+          KEYBUF_T  keybuf;   // Numeric key
+          short     dups;     // Keys equal to key before it,
+                              // -1 if it's the last one
+         } CURSOR_T;
+
+extern BTREE_T *btree_new(void);
+extern void     btree_setunique(BTREE_T *t);
+extern char     btree_unique(BTREE_T *t);
+extern void     btree_setintern(BTREE_T *t);
+extern char     btree_intern(BTREE_T *t);
+extern void     btree_setprefix(BTREE_T *t);
+extern char     btree_prefix(BTREE_T *t);
+extern void     btree_setplus(BTREE_T *t);
+extern char     btree_plus(BTREE_T *t);
+extern void     btree_settopdown(BTREE_T *t);
+extern char     btree_topdown(BTREE_T *t);
+extern void     btree_setconcurrent(BTREE_T *t);
+extern char     btree_concurrent(BTREE_T *t);
+extern uint32_t *btree_rootlatch(BTREE_T *t);
+extern void     btree_setnumeric(BTREE_T *t);
+extern char     btree_numeric(BTREE_T *t);
+extern void     btree_setkeytype(BTREE_T *t, char keytype);
+extern char     btree_keytype(BTREE_T *t);
+extern short    btree_keysize(BTREE_T *t);
+extern void     btree_setnodesearch(BTREE_T *t, char strategy);
+extern char     btree_nodesearch(BTREE_T *t);
+extern void     btree_setmaxkeys(BTREE_T *t, short n);
+extern short    btree_maxkeys(BTREE_T *t);
+extern float    btree_fillrate(BTREE_T *t);
+extern void     btree_setloadrate(BTREE_T *t, float rate);
+extern float    btree_loadrate(BTREE_T *t);
+extern void     btree_setvalfree(BTREE_T *t, void (*valfree)(void *));
+extern int      btree_open(BTREE_T *t, const char *path);
+extern int      btree_sync(BTREE_T *t);
+extern long     btree_feed(BTREE_T *t, const char *path, char threaded);
+extern long     btree_serve(BTREE_T *t, const char *path);
+extern int      btree_save(BTREE_T *t, const char *path);
+extern int      btree_restore(BTREE_T *t, const char *path);
+extern int      btree_openlog(BTREE_T *t, const char *path, int group);
+extern LOG_T   *btree_log(BTREE_T *t);
+extern void     btree_setlog(BTREE_T *t, LOG_T *l);
+extern void     btree_setcache(BTREE_T *t, size_t pages);
+extern size_t   btree_cache(BTREE_T *t);
+extern int      btree_cachestats(BTREE_T *t, POOL_STATS_T *s);
+extern PAGEFILE_T *btree_file(BTREE_T *t);
+extern void     btree_setfile(BTREE_T *t, PAGEFILE_T *pf);
+extern ARENA_T *btree_nodearena(BTREE_T *t);
+extern KEYARENA_T *btree_keyarena(BTREE_T *t);
+extern void     btree_setarenas(BTREE_T *t, ARENA_T *nodes, KEYARENA_T *keys);
+extern short    btree_lastid(BTREE_T *t);
+extern void     btree_setlastid(BTREE_T *t, short id);
+extern NODE_T  *btree_root(BTREE_T *t);
+extern void     btree_setroot(BTREE_T *t, NODE_T *n);
+extern int      btree_insert(BTREE_T *t, char *key);
+extern int      btree_delete(BTREE_T *t, char *key);
+extern int      btree_insert_batch(BTREE_T *t, char **keys, int cnt);
+extern int      btree_delete_batch(BTREE_T *t, char **keys, int cnt);
+extern int      btree_put(BTREE_T *t, char *key, void *value);
+extern int      btree_get(BTREE_T *t, char *key, void **valptr);
+extern int      btree_get_many(BTREE_T *t, int cnt, char **keys,
+                               void **values, char *found);
+extern int      btree_update(BTREE_T *t, char *key, void *value);
+extern void     btree_search(BTREE_T *t, char *key);
+extern int      btree_load(BTREE_T *t,
+                           char *(*next)(void *ctx, void **valptr),
+                           void *ctx);
+extern void     btree_clear(BTREE_T *t);
+extern void     btree_compact(BTREE_T *t);
+extern void     btree_free(BTREE_T *t);
+extern void     btree_setshowslots(char on);
+extern void     btree_setshowids(char on);
+extern void     btree_show_node(BTREE_T *t, NODE_T *n);
+extern void     btree_display(BTREE_T *t, NODE_T *n, int blanks);
+extern int      btree_keycmp(BTREE_T *t, char *k1, char *k2);
+extern KEYLOC_T btree_find_key(BTREE_T *t, char *key);
+extern NODE_T  *latched_descend(BTREE_T *t, char *key, short *posptr,
+                                int *cmpptr);
+extern NODE_T  *optimistic_root(BTREE_T *t, uint32_t *vptr);
+extern int      optimistic_child(NODE_T *n, uint32_t v, NODE_T *c,
+                                 uint32_t *vptr);
+extern short    optimistic_search(BTREE_T *t, NODE_T *n, char *key,
+                                  int *cmpptr);
+extern int      btree_seek(BTREE_T *t, char *key, CURSOR_T *c);
+extern int      btree_first(BTREE_T *t, CURSOR_T *c);
+extern int      btree_last(BTREE_T *t, CURSOR_T *c);
+extern int      cursor_next(CURSOR_T *c);
+extern int      cursor_prev(CURSOR_T *c);
+extern char     cursor_end(CURSOR_T *c);
+extern char    *cursor_key(CURSOR_T *c);
+extern void    *cursor_value(CURSOR_T *c);
+extern void     cursor_close(CURSOR_T *c);
 // For debugging
-extern char     btree_check(NODE_T *n, char *prev_key);
+extern char     btree_check(BTREE_T *t, NODE_T *n, char *prev_key);
 
 
-extern char    *key_duplicate(char *key);
-extern NODE_T  *merge_leaf_nodes(NODE_T *left, char *sep_key,
+extern char    *key_parse(BTREE_T *t, char *key, KEYBUF_T *buf);
+extern char    *key_text(BTREE_T *t, char *key, char *buf);
+extern char    *key_frombytes(char *buf, const void *data, uint16_t len);
+extern char    *key_duplicate(BTREE_T *t, char *key);
+extern char    *key_space(BTREE_T *t, size_t size);
+extern char    *key_save(BTREE_T *t, const char *data, size_t len);
+extern char    *key_at(BTREE_T *t, NODE_T *n, short pos);
+extern char    *key_fetch(BTREE_T *t, NODE_T *n, short pos, KEYBUF_T *buf);
+extern void     key_store(BTREE_T *t, NODE_T *n, short pos, char *key);
+extern void     separator_set(BTREE_T *t, NODE_T *par, short pos,
+                              NODE_T *leaf);
+extern void     key_transfer(BTREE_T *t, NODE_T *dst, short dst_pos,
+                             NODE_T *src, short src_pos);
+extern void     slot_move(BTREE_T *t, NODE_T *dst, short dst_pos,
+                          NODE_T *src, short src_pos, short cnt);
+extern void     slot_clear(BTREE_T *t, NODE_T *n, short pos, short cnt);
+extern void     value_free(BTREE_T *t, void *value);
+extern NODE_T  *merge_leaf_nodes(BTREE_T *t, NODE_T *left,
+                                 char *sep_key, void *sep_value,
                                  NODE_T *right, short lvl);
-extern NODE_T  *new_node(NODE_T *parent);
-extern NODE_T  *left_sibling(NODE_T *n, short *sep_pos);
-extern NODE_T  *right_sibling(NODE_T *n, short *sep_pos);
-extern NODE_T  *find_node(NODE_T *tree, char *key);
-extern short    find_pos(NODE_T *n, char *key, char present, short lvl);
+extern int      key_insert(BTREE_T *t, char *k, void *value, char replace);
+extern int      key_delete(BTREE_T *t, char *k);
+extern int      key_get(BTREE_T *t, char *k, void **valptr);
+extern NODE_T  *new_node(BTREE_T *t);
+extern void     node_free(BTREE_T *t, NODE_T *n);
+extern NODE_T  *left_sibling(PATH_T *path, short *sep_pos);
+extern NODE_T  *right_sibling(PATH_T *path, short *sep_pos);
+extern NODE_T  *find_node(BTREE_T *t, NODE_T *tree, char *key);
+extern short    find_pos(BTREE_T *t, NODE_T *n, char *key,
+                         char present, short lvl);
+extern char   **batch_parse(BTREE_T *t, char **keys, int cnt);
+extern char    *path_fence(BTREE_T *t, PATH_T *path,
+                           KEYBUF_T *buf, char **copyptr);
+
+// Position of a key in a node, in a tree (btree_nsearch.c)
+extern short    node_search(BTREE_T *t, NODE_T *n, char *key, int *cmpptr);
+extern NODE_T  *node_descend(BTREE_T *t, NODE_T *n, char *key,
+                             short *posptr, int *cmpptr, short *lvlptr,
+                             PATH_T *path);
+extern int      key_bytescmp(char *k1, char *k2);
+extern char     nsearch_choose(char keytype, short maxkeys);
+
+// Prefix-compressed keys (btree_prefix.c)
+extern char    *pfx_full(NODE_T *n, short pos, char **bufptr, size_t *sizeptr);
+extern char    *pfx_adopt(BTREE_T *t, NODE_T *dst, const char *pfx,
+                          short pfxlen, char *suffix);
+extern char    *pfx_store(BTREE_T *t, NODE_T *n, char *key);
+extern void     pfx_fences(PATH_T *path, char **loptr, char **hiptr);
+extern void     pfx_fit(BTREE_T *t, NODE_T *n, char *lo, char *hi);
+extern void     pfx_fit_tree(BTREE_T *t, NODE_T *n, char *lo, char *hi);
+
+// Node and key allocators (btree_arena.c)
+extern ARENA_T *arena_new(size_t objsize);
+extern void    *arena_alloc(ARENA_T *a);
+extern void     arena_release(ARENA_T *a, void *obj);
+extern void     arena_free(ARENA_T *a);
+extern void     arena_setsource(ARENA_T *a,
+                                void *(*more)(void *ctx, size_t size),
+                                void *ctx);
+extern void    *arena_freelist(ARENA_T *a);
+extern void     arena_setfreelist(ARENA_T *a, void *freelist);
+extern void     arena_relocate(ARENA_T *a, ptrdiff_t delta);
+extern KEYARENA_T *keyarena_new(char intern);
+extern char    *keyarena_store(KEYARENA_T *a, const char *data, size_t len);
+extern void     keyarena_free(KEYARENA_T *a);
+extern size_t   keyarena_packsize(size_t len);
+extern char    *keyarena_pack(char *dst, const char *data, size_t len);
+extern char    *keyarena_reserve(KEYARENA_T *a, size_t size);
+extern void     keyarena_setsource(KEYARENA_T *a,
+                                   void *(*more)(void *ctx, size_t size),
+                                   void *ctx);
+extern void    *keyarena_block(KEYARENA_T *a, size_t *usedptr);
+extern void     keyarena_setblock(KEYARENA_T *a, void *block, size_t used);
+extern void     keyarena_relocate(KEYARENA_T *a, ptrdiff_t delta);
+extern void     keyarena_intern(KEYARENA_T *a, char *k);
+
+// Trees in files (btree_page.c)
+extern void     page_touch(BTREE_T *t);
+extern void     page_clear(BTREE_T *t);
+extern void     page_close(BTREE_T *t);
+
+// Write-ahead log (btree_log.c)
+extern void     log_lock(BTREE_T *t, char *k);
+extern void     log_unlock(BTREE_T *t, char *k);
+extern int      log_append(BTREE_T *t, char op, char *k);
+extern uint32_t crc32c(uint32_t crc, const char *p, size_t len);
+extern int      log_sync(BTREE_T *t);
+extern void     log_reset(BTREE_T *t);
+extern void     log_close(BTREE_T *t);
+
+// Buffer pool (btree_pool.c)
+extern POOL_T  *pool_new(int fd, void *hint, size_t reserve, size_t frames);
+extern char    *pool_base(POOL_T *p);
+extern void     pool_pin(POOL_T *p, void *addr);
+extern void     pool_unpin(POOL_T *p, void *addr);
+extern int      pool_sync(POOL_T *p);
+extern void     pool_drop(POOL_T *p);
+extern void     pool_stats(POOL_T *p, POOL_STATS_T *s);
+extern void     pool_free(POOL_T *p);
+
+// Latches of concurrent trees (btree_latch.c)
+extern void     latch_wrlock(uint32_t *l);
+extern void     latch_wrunlock(uint32_t *l);
+extern void     latch_obsolete(uint32_t *l);
+extern int      latch_version(uint32_t *l, uint32_t *vptr);
+extern int      latch_check(uint32_t *l, uint32_t v);
+extern void     node_wrlock(BTREE_T *t, NODE_T *n);
+extern void     node_wrunlock(BTREE_T *t, NODE_T *n);
+extern void     tree_wrlock(BTREE_T *t);
+extern void     tree_wrunlock(BTREE_T *t);
+extern void     epoch_enter(void);
+extern void     epoch_exit(void);
+extern uint64_t epoch_retire(void);
+extern uint64_t epoch_oldest(void);
+
+// Vector kernels (btree_simd.c)
+extern short    simd_count_less32(int32_t *keys, short cnt, int32_t key);
+extern short    simd_count_less64(int64_t *keys, short cnt, int64_t key);
+extern const char *simd_kernels(void);
 
 #endif
@@ -0,0 +1,403 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_arena.c
+ *
+ *  Allocation of what a tree is made of: nodes and keys.
+ *
+ *  Nodes all have the same size. They are carved from big blocks
+ *  (slabs) obtained from malloc() and handed out one after the
+ *  other. A released node goes to a free list, where the next
+ *  allocation finds it. Slabs are only given back when the whole
+ *  arena is released, in as many calls to free() as there are slabs.
+ *
+ *  Keys that aren't stored inline (strings, bytes) are copied
+ *  one after the other into blocks of a key arena, each one
+ *  preceded by its length. They are never released one by one:
+ *  the space of a deleted key is only recovered when the whole
+ *  arena goes. Optionally, the arena interns keys: a hash table
+ *  finds a copy already stored, which is shared instead of
+ *  storing the same bytes again.
+ *
+ *  Both arenas can be given another source than malloc(): a
+ *  function that returns memory that stays theirs until the
+ *  source itself goes (the pages of a file, see btree_page.c).
+ *  Nodes are then obtained from it one by one and nothing is
+ *  given back when the arena is released.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define ARENA_SLABSIZE   65536   // Bytes
+#define ARENA_MINOBJ     16      // Objects per slab, at least
+#define ARENA_ALIGN      16
+
+typedef struct slab_t {
+          struct slab_t *next;
+          // Objects follow (aligned on ARENA_ALIGN)
+         } SLAB_T;
+
+#define SLAB_HDR  ((sizeof(SLAB_T) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_t {
+          size_t   objsize;
+          size_t   perslab;   // Objects per slab
+          SLAB_T  *slabs;     // Most recent first
+          size_t   used;      // Objects handed out from the first slab
+          void    *freelist;  // Released objects, linked
+                              // through their first bytes
+          void  *(*more)(void *ctx, size_t size);  // Other source
+          void    *ctx;
+         };
+
+extern ARENA_T *arena_new(size_t objsize) {
+    ARENA_T *a = (ARENA_T *)malloc(sizeof(ARENA_T));
+
+    if (a) {
+      if (objsize < sizeof(void *)) {
+        objsize = sizeof(void *);
+      }
+      a->objsize = (objsize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+      a->perslab = (ARENA_SLABSIZE - SLAB_HDR) / a->objsize;
+      if (a->perslab < ARENA_MINOBJ) {
+        a->perslab = ARENA_MINOBJ;
+      }
+      a->slabs = NULL;
+      a->used = 0;
+      a->freelist = NULL;
+      a->more = NULL;
+      a->ctx = NULL;
+    }
+    return a;
+}
+
+extern void arena_setsource(ARENA_T *a,
+                            void *(*more)(void *ctx, size_t size),
+                            void *ctx) {
+    // Objects will come one by one from more(ctx, objsize)
+    assert(a && (a->slabs == NULL));
+    a->more = more;
+    a->ctx = ctx;
+}
+
+extern void *arena_alloc(ARENA_T *a) {
+    // Returns a zeroed object, NULL if memory is exhausted
+    void *obj;
+
+    assert(a);
+    if (a->freelist) {
+      obj = a->freelist;
+      a->freelist = *((void **)obj);
+    } else if (a->more) {
+      if ((obj = a->more(a->ctx, a->objsize)) == NULL) {
+        return NULL;
+      }
+    } else {
+      if ((a->slabs == NULL) || (a->used == a->perslab)) {
+        SLAB_T *s = (SLAB_T *)malloc(SLAB_HDR + a->perslab * a->objsize);
+
+        if (s == NULL) {
+          return NULL;
+        }
+        s->next = a->slabs;
+        a->slabs = s;
+        a->used = 0;
+      }
+      obj = (char *)(a->slabs) + SLAB_HDR + a->used * a->objsize;
+      (a->used)++;
+    }
+    memset(obj, 0, a->objsize);
+    return obj;
+}
+
+extern void arena_release(ARENA_T *a, void *obj) {
+    // The object will be reused by the next allocation
+    assert(a);
+    if (obj) {
+      *((void **)obj) = a->freelist;
+      a->freelist = obj;
+    }
+}
+
+extern void *arena_freelist(ARENA_T *a) {
+    return a->freelist;
+}
+
+extern void arena_setfreelist(ARENA_T *a, void *freelist) {
+    a->freelist = freelist;
+}
+
+extern void arena_relocate(ARENA_T *a, ptrdiff_t delta) {
+    // The objects of the source have moved by delta bytes,
+    // and so have the links of the free list (that already
+    // points to the new place)
+    void **obj;
+
+    for (obj = (void **)a->freelist; obj; obj = (void **)*obj) {
+      if (*obj) {
+        *obj = (char *)*obj + delta;
+      }
+    }
+}
+
+extern void arena_free(ARENA_T *a) {
+    // Releases all objects at once, and the arena
+    SLAB_T *s;
+
+    if (a) {
+      while ((s = a->slabs) != NULL) {
+        a->slabs = s->next;
+        free(s);
+      }
+      free(a);
+    }
+}
+
+// ----------------------------------------------------------------
+//                          Key arena
+// ----------------------------------------------------------------
+
+#define KEYS_BLOCKSIZE   65536   // Bytes, unless a key is bigger
+#define KEYS_ALIGN       sizeof(uint32_t)
+#define KEYS_MINHASH     1024    // Initial size of the hash table
+
+typedef struct keyblock_t {
+          struct keyblock_t *next;
+          size_t             size;   // Bytes available after header
+          // Keys follow
+         } KEYBLOCK_T;
+
+#define BLOCK_HDR  ((sizeof(KEYBLOCK_T) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define KEY_LEN(k) (((uint32_t *)(k))[-1])
+
+struct keyarena_t {
+          KEYBLOCK_T *blocks;     // Current block first
+          size_t      used;       // Bytes used in the current block
+          char        intern;
+          char      **hash;       // Stored keys, open addressing
+          size_t      hashsize;   // Power of 2
+          size_t      hashcnt;
+          void     *(*more)(void *ctx, size_t size);  // Other source
+          void       *ctx;
+         };
+
+extern KEYARENA_T *keyarena_new(char intern) {
+    KEYARENA_T *a = (KEYARENA_T *)malloc(sizeof(KEYARENA_T));
+
+    if (a) {
+      a->blocks = NULL;
+      a->used = 0;
+      a->intern = intern;
+      a->hash = NULL;
+      a->hashsize = 0;
+      a->hashcnt = 0;
+      a->more = NULL;
+      a->ctx = NULL;
+    }
+    return a;
+}
+
+extern void keyarena_setsource(KEYARENA_T *a,
+                               void *(*more)(void *ctx, size_t size),
+                               void *ctx) {
+    // Blocks will come from more(ctx, size)
+    assert(a && (a->blocks == NULL));
+    a->more = more;
+    a->ctx = ctx;
+}
+
+extern void *keyarena_block(KEYARENA_T *a, size_t *usedptr) {
+    // Current block, and bytes used in it
+    *usedptr = a->used;
+    return a->blocks;
+}
+
+extern void keyarena_setblock(KEYARENA_T *a, void *block, size_t used) {
+    a->blocks = (KEYBLOCK_T *)block;
+    a->used = used;
+}
+
+extern void keyarena_relocate(KEYARENA_T *a, ptrdiff_t delta) {
+    // The blocks have moved by delta bytes (the current one
+    // is already known at its new place)
+    KEYBLOCK_T *b;
+
+    for (b = a->blocks; b; b = b->next) {
+      if (b->next) {
+        b->next = (KEYBLOCK_T *)((char *)b->next + delta);
+      }
+    }
+}
+
+static uint32_t key_hash(const char *data, uint32_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+      h ^= (unsigned char)*data++;
+      h *= 16777619u;
+    }
+    return h;
+}
+
+static char **hash_slot(KEYARENA_T *a, const char *data, uint32_t len) {
+    // Where the key is in the table, or where it should go
+    size_t  mask = a->hashsize - 1;
+    size_t  i = key_hash(data, len) & mask;
+    char   *k;
+
+    while ((k = a->hash[i]) != NULL) {
+      if ((KEY_LEN(k) == len) && (memcmp(k, data, len) == 0)) {
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+    return &(a->hash[i]);
+}
+
+static int hash_grow(KEYARENA_T *a) {
+    char  **old = a->hash;
+    size_t  oldsize = a->hashsize;
+    size_t  i;
+
+    a->hashsize = (oldsize ? 2 * oldsize : KEYS_MINHASH);
+    if ((a->hash = (char **)calloc(a->hashsize, sizeof(char *))) == NULL) {
+      a->hash = old;
+      a->hashsize = oldsize;
+      return -1;
+    }
+    for (i = 0; i < oldsize; i++) {
+      if (old[i]) {
+        *hash_slot(a, old[i], KEY_LEN(old[i])) = old[i];
+      }
+    }
+    free(old);
+    return 0;
+}
+
+extern char *keyarena_store(KEYARENA_T *a, const char *data, size_t len) {
+    // Returns a stable copy of the len bytes at data
+    // (NULL if memory is exhausted)
+    char   **slot = NULL;
+    char    *k;
+    size_t   need;
+
+    assert(a && (len <= UINT32_MAX));
+    if (a->intern) {
+      if ((2 * (a->hashcnt + 1) > a->hashsize) && hash_grow(a)) {
+        return NULL;
+      }
+      slot = hash_slot(a, data, (uint32_t)len);
+      if (*slot) {
+        return *slot;
+      }
+    }
+    need = (sizeof(uint32_t) + len + KEYS_ALIGN - 1) & ~(KEYS_ALIGN - 1);
+    if ((a->blocks == NULL) || (a->used + need > a->blocks->size)) {
+      size_t      size = (need > KEYS_BLOCKSIZE ? need : KEYS_BLOCKSIZE);
+      KEYBLOCK_T *b;
+
+      if (a->more) {
+        b = (KEYBLOCK_T *)a->more(a->ctx, BLOCK_HDR + size);
+      } else {
+        b = (KEYBLOCK_T *)malloc(BLOCK_HDR + size);
+      }
+
+      if (b == NULL) {
+        return NULL;
+      }
+      b->next = a->blocks;
+      b->size = size;
+      a->blocks = b;
+      a->used = 0;
+    }
+    k = (char *)(a->blocks) + BLOCK_HDR + a->used + sizeof(uint32_t);
+    KEY_LEN(k) = (uint32_t)len;
+    memcpy(k, data, len);
+    a->used += need;
+    if (slot) {
+      *slot = k;
+      (a->hashcnt)++;
+    }
+    return k;
+}
+
+extern void keyarena_intern(KEYARENA_T *a, char *k) {
+    // Adds a key already in a block (of a file that has
+    // been opened again) to the table of an interning arena
+    char **slot;
+
+    assert(a && k);
+    if (a->intern) {
+      if ((2 * (a->hashcnt + 1) > a->hashsize) && hash_grow(a)) {
+        return;
+      }
+      slot = hash_slot(a, k, KEY_LEN(k));
+      if (*slot == NULL) {
+        *slot = k;
+        (a->hashcnt)++;
+      }
+    }
+}
+
+extern size_t keyarena_packsize(size_t len) {
+    // Room taken by a key of len bytes in a block
+    return (sizeof(uint32_t) + len + KEYS_ALIGN - 1) & ~(KEYS_ALIGN - 1);
+}
+
+extern char *keyarena_pack(char *dst, const char *data, size_t len) {
+    // Lays out a key at dst as it would be in a block
+    // (keyarena_packsize() bytes), and returns where the
+    // key starts. Keys packed one after the other from an
+    // aligned address can be copied to keyarena_reserve().
+    char *k = dst + sizeof(uint32_t);
+
+    assert(len <= UINT32_MAX);
+    KEY_LEN(k) = (uint32_t)len;
+    memcpy(k, data, len);
+    memset(k + len, 0, keyarena_packsize(len) - sizeof(uint32_t) - len);
+    return k;
+}
+
+extern char *keyarena_reserve(KEYARENA_T *a, size_t size) {
+    // Returns size bytes at the start of a new block, filled
+    // by the caller with packed keys (NULL if memory is
+    // exhausted). Keys stored afterwards go to another block;
+    // those packed aren't interned.
+    KEYBLOCK_T *b;
+
+    assert(a);
+    if (a->more) {
+      b = (KEYBLOCK_T *)a->more(a->ctx, BLOCK_HDR + size);
+    } else {
+      b = (KEYBLOCK_T *)malloc(BLOCK_HDR + size);
+    }
+    if (b == NULL) {
+      return NULL;
+    }
+    b->next = a->blocks;
+    b->size = size;
+    a->blocks = b;
+    a->used = size;
+    return (char *)b + BLOCK_HDR;
+}
+
+extern void keyarena_free(KEYARENA_T *a) {
+    // Releases all keys at once, and the arena
+    KEYBLOCK_T *b;
+
+    if (a) {
+      while (!a->more && ((b = a->blocks) != NULL)) {
+        a->blocks = b->next;
+        free(b);
+      }
+      free(a->hash);
+      free(a);
+    }
+}
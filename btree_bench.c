@@ -0,0 +1,560 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_bench.c
+ *
+ *  Benchmark driver (make bench).
+ *
+ *  For every combination of maximum number of keys per node (-k),
+ *  key type (-t), key order (-o) and number of keys (-n), a tree
+ *  is filled then emptied, and four phases are timed:
+ *    - insert: n insertions,
+ *    - lookup: -l lookups (n by default),
+ *    - scan:   -s scans (n / 1000 by default) of -c keys each
+ *              (100 by default), from a seek,
+ *    - delete: n deletions.
+ *  Keys are numbers from 0 to n - 1 (as text for string keys,
+ *  zero-padded so that both orders agree), and the order says
+ *  which ones each operation takes:
+ *    - seq:    ascending,
+ *    - random: every key once in a random order for insertions
+ *              and deletions, uniformly drawn for lookups and
+ *              scans,
+ *    - zipf:   drawn from a Zipfian distribution (theta 0.99),
+ *              the most frequent keys being scattered over the
+ *              range - some keys are then inserted or deleted
+ *              more than once, which fails (trees are unique).
+ *  Keys go to the tree already parsed (key_insert(), key_get()
+ *  and key_delete()), so that the conversion of text to numbers
+ *  isn't measured.
+ *
+ *  Throughput comes from the duration of a whole phase. One
+ *  operation in BENCH_SAMPLE is timed on its own, for latency
+ *  percentiles (from a histogram with 16 buckets per power of
+ *  two, within about 6%). The results are written as JSON on the
+ *  standard output, progress on the standard error.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "btree.h"
+
+#define BENCH_SAMPLE      16        // One op timed every
+#define BENCH_SUB          4        // log2 of buckets per power of 2
+#define BENCH_BUCKETS     (64 << BENCH_SUB)
+#define BENCH_THETA        0.99
+#define BENCH_MAXLIST     16
+#define BENCH_STRLEN      10        // Digits of string keys
+
+#define ORDER_SEQ          0
+#define ORDER_RANDOM       1
+#define ORDER_ZIPF         2
+
+static const char *G_orders[] = {"seq", "random", "zipf", NULL};
+
+typedef struct hist_t {
+          uint64_t  cnt[BENCH_BUCKETS];
+          uint64_t  samples;
+          uint64_t  max;
+         } HIST_T;
+
+// What a phase measured
+typedef struct phase_t {
+          uint64_t  ops;
+          uint64_t  hits;     // Ops that succeeded
+          uint64_t  keys;     // Keys read by scans
+          double    secs;
+          HIST_T    lat;
+         } PHASE_T;
+
+// Keys taken by the operations of a phase
+typedef struct stream_t {
+          char      order;
+          uint64_t  n;
+          uint64_t  i;
+          uint64_t  rng;
+          // Random permutation
+          uint64_t  mask;
+          uint64_t  mul;
+          uint64_t  add;
+          // Zipfian
+          double    zetan;
+          double    alpha;
+          double    eta;
+          char      permute;  // Each key once
+         } STREAM_T;
+
+static double G_zetan = 0;     // Of G_zetan_n, slow to compute
+static uint64_t G_zetan_n = 0;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+    // splitmix64
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void hist_add(HIST_T *h, uint64_t ns) {
+    // Exact below 2^BENCH_SUB, then BENCH_SUB bits after
+    // the highest one
+    int  msb;
+    int  b;
+
+    if (ns < (1 << BENCH_SUB)) {
+      b = (int)ns;
+    } else {
+      msb = 63 - __builtin_clzll(ns);
+      b = ((msb - BENCH_SUB + 1) << BENCH_SUB)
+          + (int)((ns >> (msb - BENCH_SUB)) & ((1 << BENCH_SUB) - 1));
+    }
+    h->cnt[b]++;
+    h->samples++;
+    if (ns > h->max) {
+      h->max = ns;
+    }
+}
+
+static uint64_t hist_pct(HIST_T *h, double pct) {
+    // Upper bound of the bucket where pct % of the
+    // samples are reached
+    uint64_t want = (uint64_t)ceil(h->samples * pct / 100.0);
+    uint64_t seen = 0;
+    uint64_t hi;
+    int      b;
+    int      e;
+
+    if (h->samples == 0) {
+      return 0;
+    }
+    for (b = 0; b < BENCH_BUCKETS; b++) {
+      if ((seen += h->cnt[b]) >= want) {
+        break;
+      }
+    }
+    if (b < (1 << BENCH_SUB)) {
+      return (uint64_t)b;
+    }
+    e = (b >> BENCH_SUB) + BENCH_SUB - 1;
+    hi = ((uint64_t)((b & ((1 << BENCH_SUB) - 1)) + 1 + (1 << BENCH_SUB)))
+         << (e - BENCH_SUB);
+    hi -= 1;
+    return (hi < h->max ? hi : h->max);
+}
+
+static double zeta(uint64_t n, double theta) {
+    double   sum = 0;
+    uint64_t i;
+
+    for (i = 1; i <= n; i++) {
+      sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void stream_init(STREAM_T *s, char order, uint64_t n,
+                        char permute, uint64_t seed) {
+    double   zeta2;
+
+    memset(s, 0, sizeof(STREAM_T));
+    s->order = order;
+    s->n = n;
+    s->rng = seed;
+    s->permute = permute;
+    if ((order == ORDER_RANDOM) && permute) {
+      // Two rounds of an affine map then a xor-shift, all
+      // one-to-one over the power of two above n; values
+      // past n are skipped (cycle walking)
+      s->mask = 1;
+      while (s->mask < n) {
+        s->mask <<= 1;
+      }
+      s->mask--;
+      s->mul = rng_next(&(s->rng)) | 1;
+      s->add = rng_next(&(s->rng));
+    } else if (order == ORDER_ZIPF) {
+      if (G_zetan_n != n) {
+        G_zetan = zeta(n, BENCH_THETA);
+        G_zetan_n = n;
+      }
+      s->zetan = G_zetan;
+      zeta2 = 1 + pow(0.5, BENCH_THETA);
+      s->alpha = 1.0 / (1.0 - BENCH_THETA);
+      s->eta = (1 - pow(2.0 / (double)n, 1 - BENCH_THETA))
+               / (1 - zeta2 / s->zetan);
+    }
+}
+
+static uint64_t stream_next(STREAM_T *s) {
+    // Number of the key of the next operation
+    uint64_t  x;
+    uint64_t  rank;
+    double    u;
+    double    uz;
+    int       half;
+
+    switch (s->order) {
+      case ORDER_SEQ:
+        return (s->i++) % s->n;
+      case ORDER_RANDOM:
+        if (!s->permute) {
+          return rng_next(&(s->rng)) % s->n;
+        }
+        half = (64 - __builtin_clzll(s->mask | 1)) / 2;
+        x = s->i++;
+        do {
+          x = (x * s->mul + s->add) & s->mask;
+          x ^= x >> (half ? half : 1);
+          x = (x * 0x9e3779b97f4a7c15ULL) & s->mask;
+          x ^= x >> (half ? half : 1);
+        } while (x >= s->n);
+        return x;
+      default:
+        // Gray et al., "Quickly generating billion-record
+        // synthetic databases"
+        u = (double)(rng_next(&(s->rng)) >> 11) / 9007199254740992.0;
+        uz = u * s->zetan;
+        if (uz < 1.0) {
+          rank = 0;
+        } else if (uz < 1.0 + pow(0.5, BENCH_THETA)) {
+          rank = 1;
+        } else {
+          rank = (uint64_t)((double)s->n
+                            * pow(s->eta * u - s->eta + 1, s->alpha));
+        }
+        // Frequent keys scattered (FNV-1a of the rank)
+        x = 0xcbf29ce484222325ULL;
+        for (half = 0; half < 8; half++) {
+          x = (x ^ ((rank >> (8 * half)) & 0xff)) * 0x100000001b3ULL;
+        }
+        return x % s->n;
+    }
+}
+
+static char *make_key(BTREE_T *t, uint64_t v, KEYBUF_T *buf, char *text) {
+    // Key number v, parsed
+    int i;
+
+    switch (btree_keytype(t)) {
+      case BTREE_INT32:
+        buf->i32 = (int32_t)v;
+        return (char *)buf;
+      case BTREE_INT64:
+        buf->i64 = (int64_t)v;
+        return (char *)buf;
+      default:
+        for (i = BENCH_STRLEN - 1; i >= 0; i--) {
+          text[i] = '0' + (char)(v % 10);
+          v /= 10;
+        }
+        text[BENCH_STRLEN] = '\0';
+        return text;
+    }
+}
+
+static char *key_string(BTREE_T *t, uint64_t v, char *text) {
+    // Key number v, as btree_seek() expects it
+    KEYBUF_T buf;
+
+    if (btree_keytype(t) == BTREE_STRING) {
+      return make_key(t, v, &buf, text);
+    }
+    snprintf(text, BENCH_STRLEN + 12, "%" PRIu64, v);
+    return text;
+}
+
+static void phase_keys(BTREE_T *t, PHASE_T *p, STREAM_T *s,
+                       uint64_t ops, char what) {
+    // Inserts ('i'), looks up ('l') or deletes ('d') ops keys
+    KEYBUF_T  buf;
+    char      text[BENCH_STRLEN + 12];
+    char     *k;
+    uint64_t  i;
+    uint64_t  t0 = 0;
+    int       ret = 0;
+    double    start = now();
+
+    memset(p, 0, sizeof(PHASE_T));
+    for (i = 0; i < ops; i++) {
+      k = make_key(t, stream_next(s), &buf, text);
+      if ((i % BENCH_SAMPLE) == 0) {
+        t0 = now_ns();
+      }
+      switch (what) {
+        case 'i':
+          ret = key_insert(t, k, NULL, 0);
+          break;
+        case 'l':
+          ret = key_get(t, k, NULL);
+          break;
+        default:
+          ret = key_delete(t, k);
+          break;
+      }
+      if ((i % BENCH_SAMPLE) == 0) {
+        hist_add(&(p->lat), now_ns() - t0);
+      }
+      p->hits += (ret == 0);
+    }
+    p->secs = now() - start;
+    p->ops = ops;
+}
+
+static void phase_scan(BTREE_T *t, PHASE_T *p, STREAM_T *s,
+                       uint64_t ops, int len) {
+    // ops scans of len keys; every scan is timed
+    CURSOR_T  c;
+    char      text[BENCH_STRLEN + 12];
+    uint64_t  i;
+    uint64_t  t0;
+    int       j;
+    double    start = now();
+
+    memset(p, 0, sizeof(PHASE_T));
+    for (i = 0; i < ops; i++) {
+      key_string(t, stream_next(s), text);
+      t0 = now_ns();
+      if (btree_seek(t, text, &c) == 0) {
+        p->hits++;
+        for (j = 0; (j < len) && !cursor_end(&c); j++) {
+          p->keys++;
+          (void)cursor_next(&c);
+        }
+        cursor_close(&c);
+      }
+      hist_add(&(p->lat), now_ns() - t0);
+    }
+    p->secs = now() - start;
+    p->ops = ops;
+}
+
+static void phase_json(const char *name, PHASE_T *p, char last) {
+    printf("      \"%s\": {\"ops\": %" PRIu64 ", \"hits\": %" PRIu64,
+           name, p->ops, p->hits);
+    if (p->keys) {
+      printf(", \"keys\": %" PRIu64 ", \"keys_per_sec\": %.0f",
+             p->keys, (p->secs > 0 ? p->keys / p->secs : 0));
+    }
+    printf(", \"seconds\": %.6f, \"ops_per_sec\": %.0f,\n", p->secs,
+           (p->secs > 0 ? p->ops / p->secs : 0));
+    printf("        \"latency_ns\": {\"samples\": %" PRIu64
+           ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+           ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+           ", \"max\": %" PRIu64 "}}%s\n",
+           p->lat.samples, hist_pct(&(p->lat), 50), hist_pct(&(p->lat), 90),
+           hist_pct(&(p->lat), 99), hist_pct(&(p->lat), 99.9),
+           p->lat.max, (last ? "" : ","));
+}
+
+static int parse_list(char *arg, uint64_t *vals, const char **names) {
+    // Comma-separated numbers, or names when names isn't
+    // NULL (their index goes into vals); -1 if invalid
+    char *p;
+    char *save;
+    char *end;
+    int   cnt = 0;
+    int   i;
+
+    for (p = strtok_r(arg, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+      if (cnt == BENCH_MAXLIST) {
+        return -1;
+      }
+      if (names) {
+        for (i = 0; names[i] && strcmp(names[i], p); i++) {
+          ;
+        }
+        if (names[i] == NULL) {
+          return -1;
+        }
+        vals[cnt++] = (uint64_t)i;
+      } else {
+        vals[cnt] = strtoull(p, &end, 10);
+        // 1000000 may be written 1M
+        if ((*end == 'k') || (*end == 'K')) {
+          vals[cnt] *= 1000;
+          end++;
+        } else if ((*end == 'm') || (*end == 'M')) {
+          vals[cnt] *= 1000000;
+          end++;
+        }
+        if ((*end != '\0') || (vals[cnt] == 0)) {
+          return -1;
+        }
+        cnt++;
+      }
+    }
+    return cnt;
+}
+
+static void usage(char *prog) {
+   fprintf(stderr, "Usage: %s [flags]\n", prog);
+   fprintf(stderr, "  Flags:\n");
+   fprintf(stderr,
+       "    -k <n>[,<n>...]   : keys per node (default 16,64,256)\n");
+   fprintf(stderr,
+       "    -t <type>[,...]   : int, long or string (default int,string)\n");
+   fprintf(stderr,
+       "    -o <order>[,...]  : seq, random or zipf (default all three)\n");
+   fprintf(stderr,
+       "    -n <n>[,<n>...]   : keys, 1M for a million (default 100k,1M)\n");
+   fprintf(stderr,
+       "    -l <n>            : lookups (default as many as keys)\n");
+   fprintf(stderr,
+       "    -s <n>            : scans (default keys / 1000)\n");
+   fprintf(stderr,
+       "    -c <n>            : keys read by a scan (default 100)\n");
+}
+
+int main(int argc, char **argv) {
+    static const char *types[] = {"int", "long", "string", NULL};
+    uint64_t   maxkeys[BENCH_MAXLIST] = {16, 64, 256};
+    uint64_t   keytypes[BENCH_MAXLIST] = {0, 2};
+    uint64_t   orders[BENCH_MAXLIST] = {ORDER_SEQ, ORDER_RANDOM, ORDER_ZIPF};
+    uint64_t   sizes[BENCH_MAXLIST] = {100000, 1000000};
+    int        nk = 3;
+    int        nt = 2;
+    int        no = 3;
+    int        ns = 2;
+    uint64_t   lookups = 0;
+    uint64_t   scans = 0;
+    uint64_t   v;
+    int        scanlen = 100;
+    int        ch;
+    int        ik;
+    int        it;
+    int        io;
+    int        is;
+    char       first = 1;
+    char       stamp[32];
+    time_t     clock;
+    BTREE_T   *t;
+    STREAM_T   s;
+    PHASE_T    ins;
+    PHASE_T    look;
+    PHASE_T    scan;
+    PHASE_T    del;
+    uint64_t   n;
+    uint64_t   seed = 42;
+
+    while ((ch = getopt(argc, argv, "k:t:o:n:l:s:c:")) != -1) {
+      switch (ch) {
+        case 'k':
+          nk = parse_list(optarg, maxkeys, NULL);
+          for (ik = 0; ik < nk; ik++) {
+            if ((maxkeys[ik] < 3) || (maxkeys[ik] > SHRT_MAX)) {
+              nk = -1;
+            }
+          }
+          break;
+        case 't':
+          nt = parse_list(optarg, keytypes, types);
+          break;
+        case 'o':
+          no = parse_list(optarg, orders, G_orders);
+          break;
+        case 'n':
+          ns = parse_list(optarg, sizes, NULL);
+          break;
+        case 'l':
+        case 's':
+          if (parse_list(optarg, &v, NULL) != 1) {
+            usage(argv[0]);
+            return 1;
+          }
+          *(ch == 'l' ? &lookups : &scans) = v;
+          break;
+        case 'c':
+          scanlen = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          return 1;
+      }
+      if ((nk < 1) || (nt < 1) || (no < 1) || (ns < 1) || (scanlen < 1)) {
+        fprintf(stderr, "-%c: invalid list\n", ch);
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    clock = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&clock));
+    printf("{\n");
+    printf("  \"date\": \"%s\",\n", stamp);
+    printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#ifdef __OPTIMIZE__
+    printf("  \"optimized\": true,\n");
+#else
+    printf("  \"optimized\": false,\n");
+    fprintf(stderr, "%s: not optimized, build it with make bench\n", argv[0]);
+#endif
+    printf("  \"simd\": \"%s\",\n", simd_kernels());
+    printf("  \"latency_sample\": %d,\n", BENCH_SAMPLE);
+    printf("  \"results\": [");
+    for (is = 0; is < ns; is++) {
+      n = sizes[is];
+      for (it = 0; it < nt; it++) {
+        for (ik = 0; ik < nk; ik++) {
+          for (io = 0; io < no; io++) {
+            fprintf(stderr, "%s keys, k=%d, %s order, %" PRIu64 " keys\n",
+                    types[keytypes[it]], (int)maxkeys[ik],
+                    G_orders[orders[io]], n);
+            t = btree_new();
+            if (keytypes[it] == 0) {
+              btree_setkeytype(t, (n > INT32_MAX ? BTREE_INT64 : BTREE_INT32));
+            } else if (keytypes[it] == 1) {
+              btree_setkeytype(t, BTREE_INT64);
+            }
+            btree_setmaxkeys(t, (short)maxkeys[ik]);
+            btree_setunique(t);
+            stream_init(&s, (char)orders[io], n, 1, seed++);
+            phase_keys(t, &ins, &s, n, 'i');
+            stream_init(&s, (char)orders[io], n, 0, seed++);
+            phase_keys(t, &look, &s, (lookups ? lookups : n), 'l');
+            stream_init(&s, (char)orders[io], n, 0, seed++);
+            phase_scan(t, &scan, &s, (scans ? scans : (n + 999) / 1000),
+                       scanlen);
+            stream_init(&s, (char)orders[io], n, 1, seed++);
+            phase_keys(t, &del, &s, n, 'd');
+            btree_free(t);
+            printf("%s\n    {\"keytype\": \"%s\", \"maxkeys\": %d, "
+                   "\"order\": \"%s\", \"keys\": %" PRIu64
+                   ", \"scan_length\": %d,\n",
+                   (first ? "" : ","), types[keytypes[it]],
+                   (int)maxkeys[ik], G_orders[orders[io]], n, scanlen);
+            phase_json("insert", &ins, 0);
+            phase_json("lookup", &look, 0);
+            phase_json("scan", &scan, 0);
+            phase_json("delete", &del, 1);
+            printf("    }");
+            fflush(stdout);
+            first = 0;
+          }
+        }
+      }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
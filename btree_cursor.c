@@ -0,0 +1,603 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_cursor.c
+ *
+ *  Walking keys in order from any point of the tree.
+ *
+ *  A cursor is a key location (KEYLOC_T) that can be moved to
+ *  the next or the previous key. From a key in an internal node,
+ *  the next key is the smallest one of the subtree on its right,
+ *  in a leaf; from the last key of a leaf, it's found by going up
+ *  until we come from a subtree that isn't the last one of its
+ *  parent. Nodes don't know their parent: the cursor keeps the
+ *  path from the root to its node, with the child taken at each
+ *  level. Each move is O(1) on average, a range scan costs the
+ *  descent to its first key plus one move per key returned.
+ *  In B+tree mode keys are all in leaves, chained to each other:
+ *  a move never leaves the bottom level.
+ *  A cursor is only valid as long as the tree isn't modified.
+ *
+ *  Except in a concurrent tree, which cursors read without
+ *  latching (see btree_latch.c): the cursor keeps a copy of its
+ *  key and value, and the version of each node on its path. A
+ *  move checks the versions of the nodes it reads; if one has
+ *  changed, the key the cursor was on is looked for again from
+ *  the root, and the move starts from there. Equal keys are
+ *  told apart by their rank among keys equal to them. Until it
+ *  has fallen off the tree, the cursor keeps the nodes it has
+ *  seen from being reused: a cursor that isn't walked to the
+ *  end must be released with cursor_close().
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+static void go_leftmost(CURSOR_T *c, NODE_T *n) {
+    while (n->k[0].bigger) {
+      path_push(&(c->path), n, 0);
+      n = n->k[0].bigger;
+    }
+    c->loc.n = n;
+    c->loc.pos = 1;
+}
+
+static void go_rightmost(CURSOR_T *c, NODE_T *n) {
+    while (n->k[n->keycnt].bigger) {
+      path_push(&(c->path), n, n->keycnt);
+      n = n->k[n->keycnt].bigger;
+    }
+    c->loc.n = n;
+    c->loc.pos = n->keycnt;
+}
+
+static int up_right(CURSOR_T *c) {
+    // Everything in the current node has been seen, the next
+    // key is in the first ancestor where we don't come from
+    // the last child
+    PATH_T *path = &(c->path);
+    short   d;
+
+    while ((d = path->depth - 1) >= 0) {
+      (path->depth)--;
+      if (path->pos[d] < path->n[d]->keycnt) {
+        c->loc.n = path->n[d];
+        c->loc.pos = path->pos[d] + 1;
+        return 0;
+      }
+    }
+    c->loc.n = NULL;
+    return -1;
+}
+
+static int up_left(CURSOR_T *c) {
+    // Same as up_right() going backwards
+    PATH_T *path = &(c->path);
+    short   d;
+
+    while ((d = path->depth - 1) >= 0) {
+      (path->depth)--;
+      if (path->pos[d] > 0) {
+        c->loc.n = path->n[d];
+        c->loc.pos = path->pos[d];
+        return 0;
+      }
+    }
+    c->loc.n = NULL;
+    return -1;
+}
+
+// Concurrent trees. The olc_xxx() functions return 0 when
+// the cursor has moved, -1 past either end and 1 when a node
+// that was read has changed.
+
+static int olc_fetch(CURSOR_T *c, NODE_T *n, short pos, uint32_t v) {
+    // Puts the cursor on the key at pos in n, read at version v
+    KEYBUF_T  buf;
+    char     *k;
+    void     *value;
+
+    if ((pos < 1) || (pos > btree_maxkeys(c->t))
+        || ((k = key_fetch(c->t, n, pos, &buf)) == NULL)) {
+      return 1;
+    }
+    value = n->k[pos].value;
+    if (latch_check(&(n->latch), v)) {
+      return 1;
+    }
+    c->loc.n = n;
+    c->loc.pos = pos;
+    c->version = v;
+    if (btree_keysize(c->t)) {
+      c->keybuf = buf;
+      c->key = (char *)&(c->keybuf);
+    } else {
+      c->key = k;
+    }
+    c->value = value;
+    return 0;
+}
+
+static int olc_edge(CURSOR_T *c, NODE_T *n, uint32_t v, short pos,
+                    char right) {
+    // Goes down from the child at pos in n, read at version
+    // v, to its smallest (or greatest, if right) key
+    NODE_T   *ch;
+    uint32_t  chv;
+
+    while (!_is_leaf(n)) {
+      ch = n->k[pos].bigger;
+      if (optimistic_child(n, v, ch, &chv)) {
+        return 1;
+      }
+      c->pathver[c->path.depth] = v;
+      path_push(&(c->path), n, pos);
+      n = ch;
+      v = chv;
+      pos = (right ? n->keycnt : 0);
+    }
+    return olc_fetch(c, n, (right ? n->keycnt : 1), v);
+}
+
+static int olc_next(CURSOR_T *c) {
+    NODE_T   *n = c->loc.n;
+    NODE_T   *p;
+    uint32_t  v = c->version;
+    uint32_t  pv;
+    short     pos = c->loc.pos;
+    short     d;
+
+    if (!_is_leaf(n)) {
+      return olc_edge(c, n, v, pos, 0);
+    }
+    if (pos < n->keycnt) {
+      return olc_fetch(c, n, pos + 1, v);
+    }
+    if (btree_plus(c->t)) {
+      p = n->next;
+      if (latch_check(&(n->latch), v)) {
+        return 1;
+      }
+      if (p == NULL) {
+        return -1;
+      }
+      if (optimistic_child(n, v, p, &pv)) {
+        return 1;
+      }
+      return olc_fetch(c, p, 1, pv);
+    }
+    if (latch_check(&(n->latch), v)) {
+      return 1;
+    }
+    // As up_right()
+    while ((d = c->path.depth - 1) >= 0) {
+      (c->path.depth)--;
+      p = c->path.n[d];
+      pos = c->path.pos[d];
+      if (pos < p->keycnt) {
+        return olc_fetch(c, p, pos + 1, c->pathver[d]);
+      }
+      if (latch_check(&(p->latch), c->pathver[d])) {
+        return 1;
+      }
+    }
+    return -1;
+}
+
+static int olc_prev(CURSOR_T *c) {
+    NODE_T   *n = c->loc.n;
+    NODE_T   *p;
+    uint32_t  v = c->version;
+    uint32_t  pv;
+    short     pos = c->loc.pos;
+    short     d;
+
+    if (!_is_leaf(n)) {
+      return olc_edge(c, n, v, pos - 1, 1);
+    }
+    if (pos > 1) {
+      return olc_fetch(c, n, pos - 1, v);
+    }
+    if (btree_plus(c->t)) {
+      p = n->prev;
+      if (latch_check(&(n->latch), v)) {
+        return 1;
+      }
+      if (p == NULL) {
+        return -1;
+      }
+      // A leaf doesn't latch its right neighbour to
+      // change its previous one, p must still lead to n
+      if (optimistic_child(n, v, p, &pv) || (p->next != n)) {
+        return 1;
+      }
+      return olc_fetch(c, p, p->keycnt, pv);
+    }
+    if (latch_check(&(n->latch), v)) {
+      return 1;
+    }
+    // As up_left()
+    while ((d = c->path.depth - 1) >= 0) {
+      (c->path.depth)--;
+      p = c->path.n[d];
+      pos = c->path.pos[d];
+      if (pos > 0) {
+        return olc_fetch(c, p, pos, c->pathver[d]);
+      }
+      if (latch_check(&(p->latch), c->pathver[d])) {
+        return 1;
+      }
+    }
+    return -1;
+}
+
+static int olc_locate(CURSOR_T *c, char *key, char before) {
+    // Positions the cursor on the first key greater than or
+    // equal to key or, if before is set, on the last key
+    // smaller than key. Without a key, on the first or the
+    // last key of the tree.
+    NODE_T   *n;
+    NODE_T   *ch;
+    uint32_t  v;
+    uint32_t  chv;
+    short     pos;
+    int       cmp;
+    int       ret = 1;
+
+    while (ret > 0) {
+      c->loc.n = NULL;
+      c->path.depth = 0;
+      if ((n = optimistic_root(c->t, &v)) == NULL) {
+        return -1;
+      }
+      while (1) {
+        if (key) {
+          if ((pos = optimistic_search(c->t, n, key, &cmp)) < 0) {
+            break;
+          }
+        } else {
+          pos = (before ? n->keycnt + 1 : 1);
+        }
+        if (_is_leaf(n)) {
+          if (before) {
+            // From the key on the right of the one wanted
+            c->loc.pos = pos;
+            ret = (pos > 1 ? olc_fetch(c, n, pos - 1, v) : -1);
+          } else {
+            c->loc.pos = pos - 1;
+            ret = (pos <= n->keycnt ? olc_fetch(c, n, pos, v) : -1);
+          }
+          if (ret < 0) {
+            // Not in this leaf
+            if (latch_check(&(n->latch), v)) {
+              break;
+            }
+            c->loc.n = n;
+            c->version = v;
+            ret = (before ? olc_prev(c) : olc_next(c));
+          }
+          break;
+        }
+        // Equal keys may also be on the left
+        ch = n->k[pos - 1].bigger;
+        if (optimistic_child(n, v, ch, &chv)) {
+          break;
+        }
+        c->pathver[c->path.depth] = v;
+        path_push(&(c->path), n, pos - 1);
+        n = ch;
+        v = chv;
+      }
+    }
+    if (ret < 0) {
+      c->loc.n = NULL;
+    }
+    return ret;
+}
+
+static int olc_find(CURSOR_T *c, char *key, short dups) {
+    // Positions the cursor on the key equal to key that
+    // has dups equal keys before it - on the first key
+    // greater than key if there aren't as many
+    int   ret;
+    short i;
+
+    do {
+      ret = olc_locate(c, key, 0);
+      for (i = 0;
+           (ret == 0) && (i < dups)
+           && (btree_keycmp(c->t, c->key, key) == 0);
+           i++) {
+        ret = olc_next(c);
+      }
+    } while (ret > 0);
+    return ret;
+}
+
+static short olc_count(CURSOR_T *c, char *key) {
+    // Number of keys equal to key
+    short cnt;
+    int   ret;
+
+    do {
+      cnt = 0;
+      ret = olc_locate(c, key, 0);
+      while ((ret == 0) && (btree_keycmp(c->t, c->key, key) == 0)) {
+        cnt++;
+        ret = olc_next(c);
+      }
+    } while (ret > 0);
+    return cnt;
+}
+
+static int olc_start(BTREE_T *t, char *key, char before, CURSOR_T *c) {
+    int ret;
+
+    c->t = t;
+    epoch_enter();
+    ret = olc_locate(c, key, before);
+    c->dups = ((before && !btree_unique(t)) ? -1 : 0);
+    if (ret) {
+      epoch_exit();
+    }
+    return ret;
+}
+
+static int olc_move(CURSOR_T *c, char forward) {
+    // cursor_next() and cursor_prev()
+    KEYBUF_T  buf;
+    char     *key = c->key;
+    short     dups = c->dups;
+    char      unique = btree_unique(c->t);
+    int       ret;
+
+    if (btree_keysize(c->t) && !unique) {
+      // To compare with the next one
+      buf = c->keybuf;
+      key = (char *)&buf;
+    }
+    ret = (forward ? olc_next(c) : olc_prev(c));
+    if (ret == 0) {
+      if (unique) {
+        return 0;
+      }
+    } else if (ret > 0) {
+      // Something has changed, the key the cursor was
+      // on is looked for again from the root
+      if (btree_keysize(c->t)) {
+        buf = c->keybuf;
+        key = (char *)&buf;
+      }
+      if (forward && (dups == -1)) {
+        ret = olc_find(c, key, SHRT_MAX);
+      } else {
+        if (dups < 0) {
+          // Counted from the end of equal keys
+          if ((dups += olc_count(c, key)) < 0) {
+            dups = 0;
+          }
+        }
+        if (forward) {
+          ret = olc_find(c, key, dups + 1);
+        } else {
+          ret = -1;
+          if (dups > 0) {
+            ret = olc_find(c, key, dups - 1);
+            if ((ret == 0) && (btree_keycmp(c->t, c->key, key) > 0)) {
+              // Fewer equal keys than there were
+              ret = olc_prev(c);
+            }
+          }
+          if (ret) {
+            ret = olc_locate(c, key, 1);
+          }
+        }
+      }
+    }
+    if (ret) {
+      c->loc.n = NULL;
+      epoch_exit();
+      return -1;
+    }
+    if (unique) {
+      c->dups = 0;
+    } else if (btree_keycmp(c->t, c->key, key)) {
+      c->dups = (forward ? 0 : -1);
+    } else if (forward) {
+      c->dups = (dups == -1 ? -1 : dups + 1);
+    } else {
+      c->dups = (dups ? dups - 1 : 0);
+    }
+    return 0;
+}
+
+extern int btree_first(BTREE_T *t, CURSOR_T *c) {
+    // Positions the cursor on the smallest key.
+    // Returns 0, -1 if the tree is empty.
+    assert(t && c);
+    if (btree_concurrent(t)) {
+      return olc_start(t, NULL, 0, c);
+    }
+    c->t = t;
+    c->loc.n = NULL;
+    c->loc.pos = 0;
+    c->path.depth = 0;
+    if (btree_root(t) == NULL) {
+      return -1;
+    }
+    go_leftmost(c, btree_root(t));
+    return 0;
+}
+
+extern int btree_last(BTREE_T *t, CURSOR_T *c) {
+    // Positions the cursor on the greatest key
+    assert(t && c);
+    if (btree_concurrent(t)) {
+      return olc_start(t, NULL, 1, c);
+    }
+    c->t = t;
+    c->loc.n = NULL;
+    c->loc.pos = 0;
+    c->path.depth = 0;
+    if (btree_root(t) == NULL) {
+      return -1;
+    }
+    go_rightmost(c, btree_root(t));
+    return 0;
+}
+
+extern int btree_seek(BTREE_T *t, char *key, CURSOR_T *c) {
+    // Positions the cursor on the first key greater than
+    // or equal to key (the first of equal keys if the tree
+    // isn't unique). Returns 0, -1 if there is no such key.
+    KEYBUF_T  val;
+    char     *k;
+    NODE_T   *n;
+    short     pos;
+    int       cmp;
+
+    assert(t && c);
+    c->t = t;
+    c->loc.n = NULL;
+    c->loc.pos = 0;
+    c->path.depth = 0;
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      return -1;
+    }
+    if (btree_concurrent(t)) {
+      return olc_start(t, k, 0, c);
+    }
+    if ((n = node_descend(t, btree_root(t), k, &pos, &cmp, NULL,
+                          &(c->path))) == NULL) {
+      return -1;
+    }
+    if (cmp && (pos > n->keycnt)) {
+      // Past the last key of the leaf
+      if (btree_plus(t)) {
+        if ((c->loc.n = n->next) == NULL) {
+          return -1;
+        }
+        c->loc.pos = 1;
+        return 0;
+      }
+      return up_right(c);
+    }
+    c->loc.n = n;
+    c->loc.pos = pos;
+    if ((cmp == 0) && !btree_unique(t)) {
+      // The descent stops at the first equal key met,
+      // there may be others before it
+      CURSOR_T prev = *c;
+
+      while ((cursor_prev(&prev) == 0)
+             && (btree_keycmp(t, cursor_key(&prev), k) == 0)) {
+        *c = prev;
+      }
+    }
+    return 0;
+}
+
+extern int cursor_next(CURSOR_T *c) {
+    // Moves to the next key. Returns 0, -1 when past the end.
+    NODE_T *n;
+
+    assert(c);
+    if ((n = c->loc.n) == NULL) {
+      return -1;
+    }
+    if (btree_concurrent(c->t)) {
+      return olc_move(c, 1);
+    }
+    if (!_is_leaf(n)) {
+      path_push(&(c->path), n, c->loc.pos);
+      go_leftmost(c, n->k[c->loc.pos].bigger);
+      return 0;
+    }
+    if (c->loc.pos < n->keycnt) {
+      (c->loc.pos)++;
+      return 0;
+    }
+    if (btree_plus(c->t)) {
+      c->loc.n = n->next;
+      c->loc.pos = 1;
+      return (c->loc.n ? 0 : -1);
+    }
+    return up_right(c);
+}
+
+extern int cursor_prev(CURSOR_T *c) {
+    // Moves to the previous key. Returns 0, -1 when
+    // before the beginning.
+    NODE_T *n;
+
+    assert(c);
+    if ((n = c->loc.n) == NULL) {
+      return -1;
+    }
+    if (btree_concurrent(c->t)) {
+      return olc_move(c, 0);
+    }
+    if (!_is_leaf(n)) {
+      path_push(&(c->path), n, c->loc.pos - 1);
+      go_rightmost(c, n->k[c->loc.pos - 1].bigger);
+      return 0;
+    }
+    if (c->loc.pos > 1) {
+      (c->loc.pos)--;
+      return 0;
+    }
+    if (btree_plus(c->t)) {
+      if ((c->loc.n = n->prev) == NULL) {
+        return -1;
+      }
+      c->loc.pos = c->loc.n->keycnt;
+      return 0;
+    }
+    return up_left(c);
+}
+
+extern char cursor_end(CURSOR_T *c) {
+    // True when the cursor isn't on a key any longer
+    assert(c);
+    return (c->loc.n == NULL);
+}
+
+extern char *cursor_key(CURSOR_T *c) {
+    // The key under the cursor, as stored in the tree
+    // (see key_text() for displaying it)
+    assert(c);
+    if (c->loc.n == NULL) {
+      return NULL;
+    }
+    if (btree_concurrent(c->t)) {
+      return c->key;
+    }
+    return key_at(c->t, c->loc.n, c->loc.pos);
+}
+
+extern void *cursor_value(CURSOR_T *c) {
+    assert(c);
+    if (c->loc.n == NULL) {
+      return NULL;
+    }
+    if (btree_concurrent(c->t)) {
+      return c->value;
+    }
+    return c->loc.n->k[c->loc.pos].value;
+}
+
+extern void cursor_close(CURSOR_T *c) {
+    // Leaves the tree - required, in a concurrent tree,
+    // for a cursor that hasn't fallen off it
+    assert(c);
+    if (c->loc.n && btree_concurrent(c->t)) {
+      epoch_exit();
+    }
+    c->loc.n = NULL;
+}
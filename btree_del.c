@@ -25,14 +25,18 @@ typedef struct key_pos_t {
             } KEY_POS_T;
 
 // Forward declaration
-static short delete_key(NODE_T    *n,
+static short delete_key(BTREE_T   *t,
+                        NODE_T    *n,
                         char      *key,
                         short indent);
 
-static NODE_T *leaf_with_greatest_key(NODE_T *subtree) {
+static NODE_T *leaf_with_greatest_key(NODE_T *subtree, PATH_T *path) {
+    // The path to subtree is extended to the leaf
     if (subtree) {
       if (subtree->k[subtree->keycnt].bigger) {
-        return leaf_with_greatest_key(subtree->k[subtree->keycnt].bigger);
+        path_push(path, subtree, subtree->keycnt);
+        return leaf_with_greatest_key(subtree->k[subtree->keycnt].bigger,
+                                      path);
       } else {
         return subtree;
       }
@@ -51,15 +55,27 @@ static NODE_T *leaf_with_smallest_key(NODE_T *subtree) {
     return NULL;
 }
 
-static int borrow_from_left(NODE_T *n, short indent) {
-   if (n && n->parent) {
+static int borrow_from_left(BTREE_T *t, PATH_T *path,
+                            NODE_T *n, short indent) {
+   if (n && path->depth) {
       short   parent_pos;
-      NODE_T *par = n->parent;
-      NODE_T *l = left_sibling(n, &parent_pos);
-      char   *k;
+      NODE_T *par = path->n[path->depth - 1];
+      NODE_T *l = left_sibling(path, &parent_pos);
 
+      if (l && (l->keycnt > MIN_KEYS(t)) && btree_plus(t) && _is_leaf(n)) {
+        // B+tree leaves: the greatest key of the left
+        // sibling simply moves, the separator follows
+        debug(indent, "borrowing from left leaf %hd", l->id);
+        slot_move(t, n, 2, n, 1, n->keycnt);
+        key_transfer(t, n, 1, l, l->keycnt);
+        (n->keycnt)++;
+        slot_clear(t, l, l->keycnt, 1);
+        (l->keycnt)--;
+        separator_set(t, par, parent_pos, n);
+        return 0;
+      }
       // Check whether we can borrow a key from the left sibling
-      if (l && (l->keycnt > MIN_KEYS)) {
+      if (l && (l->keycnt > MIN_KEYS(t))) {
         // Let's call K the key in the parent that
         // is greater than all keys in the left sibling
         // and smaller than all keys in the node that
@@ -73,36 +89,30 @@ static int borrow_from_left(NODE_T *n, short indent) {
         debug(indent, "borrowing from left node %hd", l->id);
         if (debugging()) {
           debug_no_nl(indent, "left node before borrowing: ");
-          btree_show_node(l);
+          btree_show_node(t, l);
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          btree_show_node(n);
+          btree_show_node(t, n);
         }
-        // Make room for K (dest, src, size)
-        (void)memmove(&(n->k[1]), &(n->k[0]),
-                      sizeof(REDIRECT_T) * (n->keycnt+1));
+        // Make room for K
+        slot_move(t, n, 1, n, 0, n->keycnt+1);
         // Add K
-        n->k[1].key = par->k[parent_pos].key;
+        key_transfer(t, n, 1, par, parent_pos);
         // Values that precede K are the ones bigger
         // than the biggest key in the left node
-        n->k[0].key = NULL;
+        slot_clear(t, n, 0, 1);
         n->k[0].bigger = l->k[l->keycnt].bigger;
-        if (n->k[0].bigger) {
-          (n->k[0].bigger)->parent = n;
-        }
         (n->keycnt)++;
-        // Find the greatest key in the left sibling
-        k = l->k[l->keycnt].key;
+        // Store the greatest key of the left sibling
+        // in the parent (K has already been moved)
+        key_transfer(t, par, parent_pos, l, l->keycnt);
         // Cleanup
-        l->k[l->keycnt].key = NULL;
-        l->k[l->keycnt].bigger = NULL;
+        slot_clear(t, l, l->keycnt, 1);
         (l->keycnt)--;
-        // Store k in the parent
-        par->k[parent_pos].key = k;
         if (debugging()) {
           debug_no_nl(indent, "left node after borrowing: ");
-          btree_show_node(l);
+          btree_show_node(t, l);
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          btree_show_node(n);
+          btree_show_node(t, n);
         }
         return 0;
       } 
@@ -110,15 +120,26 @@ static int borrow_from_left(NODE_T *n, short indent) {
     return -1;
 }
 
-static int borrow_from_right(NODE_T *n, short indent) {
-   if (n && n->parent) {
+static int borrow_from_right(BTREE_T *t, PATH_T *path,
+                            NODE_T *n, short indent) {
+   if (n && path->depth) {
       short   parent_pos;
-      NODE_T *par = n->parent;
-      NODE_T *r = right_sibling(n, &parent_pos);
-      char   *k;
+      NODE_T *par = path->n[path->depth - 1];
+      NODE_T *r = right_sibling(path, &parent_pos);
 
+      if (r && (r->keycnt > MIN_KEYS(t)) && btree_plus(t) && _is_leaf(n)) {
+        // B+tree leaves: same as borrow_from_left()
+        debug(indent, "borrowing from right leaf %hd", r->id);
+        (n->keycnt)++;
+        key_transfer(t, n, n->keycnt, r, 1);
+        slot_move(t, r, 1, r, 2, r->keycnt - 1);
+        slot_clear(t, r, r->keycnt, 1);
+        (r->keycnt)--;
+        separator_set(t, par, parent_pos, r);
+        return 0;
+      }
       // Check whether we can borrow a key from the right sibling
-      if (r && (r->keycnt > MIN_KEYS)) {
+      if (r && (r->keycnt > MIN_KEYS(t))) {
         // Let's call K the key in the parent that
         // is smaller than all keys in the right sibling
         // and greater than all keys in the node that
@@ -132,33 +153,28 @@ static int borrow_from_right(NODE_T *n, short indent) {
         debug(indent, "borrowing from right node %hd", r->id);
         if (debugging()) {
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          btree_show_node(n);
+          btree_show_node(t, n);
           debug_no_nl(indent, "right node before borrowing: ");
-          btree_show_node(r);
+          btree_show_node(t, r);
         }
         // Add K
         (n->keycnt)++;
-        n->k[n->keycnt].key = par->k[parent_pos].key;
+        key_transfer(t, n, n->keycnt, par, parent_pos);
         n->k[n->keycnt].bigger = r->k[0].bigger;
-        if (n->k[n->keycnt].bigger) {
-          (n->k[n->keycnt].bigger)->parent = n;
-        }
-        // Find the smallest key in the right sibling
-        k = r->k[1].key;
-        // Cleanup the right sibling - dest, src, size
-        (void)memmove(&(r->k[0]), &(r->k[1]),
-                      sizeof(REDIRECT_T) * r->keycnt);
+        // Store the smallest key of the right sibling
+        // in the parent (K has already been moved)
+        key_transfer(t, par, parent_pos, r, 1);
+        // Cleanup the right sibling
+        slot_move(t, r, 0, r, 1, r->keycnt);
         r->k[0].key = NULL;
-        r->k[r->keycnt].key = NULL;
-        r->k[r->keycnt].bigger = NULL;
+        r->k[0].value = NULL;
+        slot_clear(t, r, r->keycnt, 1);
         (r->keycnt)--;
-        // Store k in the parent
-        par->k[parent_pos].key = k;
         if (debugging()) {
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          btree_show_node(n);
+          btree_show_node(t, n);
           debug_no_nl(indent, "right node after borrowing: ");
-          btree_show_node(r);
+          btree_show_node(t, r);
         }
         return 0;
       } 
@@ -166,90 +182,79 @@ static int borrow_from_right(NODE_T *n, short indent) {
     return -1;
 }
 
-static short merge_nodes(NODE_T *left,
+static short merge_nodes(BTREE_T *t,
+                         NODE_T *left,
                          NODE_T *right,
                          NODE_T *par,  // parent of left and right
+                         short   i,    // separator in par
                          short   lvl) {
    // Note that this function doesn't remove the parent key
    // but it returns its position
-   short i = 0;
 
    assert(left && right && par);
    debug(lvl, "merging left node %hd with right node %hd",
               left->id, right->id);
    if (debugging()) {
       debug_no_nl(lvl, "left before merge: ");
-      btree_show_node(left);
+      btree_show_node(t, left);
       debug_no_nl(lvl, "right before merge: ");
-      btree_show_node(right);
-   }
-   assert((left->keycnt + 1 + right->keycnt) <= btree_maxkeys());
-   while ((i < par->keycnt)
-          && (par->k[i].bigger != left) > 0) {
-     i++;
+      btree_show_node(t, right);
    }
-   assert((i < par->keycnt) && (par->k[i+1].bigger == right));
-   i++; // We have stopped just before the key between left and right
-   left->k[left->keycnt+1].key = par->k[i].key;
-   left->k[left->keycnt+1].bigger = right->k[0].bigger;
-   par->k[i].key = NULL;
-   par->k[i].bigger = NULL;
-   (left->keycnt)++;
-   // (dest, src, size) 
-   (void)memmove(&(left->k[left->keycnt+1]),
-                 &(right->k[1]),
-                 sizeof(REDIRECT_T) * right->keycnt);
-   // Adjust parent pointer
-   if (!_is_leaf(left)) {
-     short k;
-     for (k = left->keycnt - 1;
-          k <= left->keycnt + right->keycnt;
-          k++) {
-       if (left->k[k].bigger) {
-         (left->k[k].bigger)->parent = left;
-       }
+   assert((left->keycnt + 1 + right->keycnt) <= btree_maxkeys(t));
+   assert((i > 0) && (i <= par->keycnt)
+          && (par->k[i-1].bigger == left) && (par->k[i].bigger == right));
+   if (btree_plus(t) && _is_leaf(left)) {
+     // B+tree leaves: the separator isn't a key, it just
+     // goes, and right leaves the chain
+     slot_clear(t, par, i, 1);
+     left->next = right->next;
+     if (left->next) {
+       (left->next)->prev = left;
      }
+   } else {
+     key_transfer(t, left, left->keycnt+1, par, i);
+     left->k[left->keycnt+1].bigger = right->k[0].bigger;
+     slot_clear(t, par, i, 1);
+     (left->keycnt)++;
    }
+   slot_move(t, left, left->keycnt+1, right, 1, right->keycnt);
    left->keycnt += right->keycnt; 
    if (debugging()) {
       debug_no_nl(lvl, "left after merge: ");
-      btree_show_node(left);
+      btree_show_node(t, left);
    }
    // Free the right node (except keys, moved)
    debug(lvl, "removing right node %hd after merge", right->id);
-   free(right->k);
-   free(right);
+   node_free(t, right);
    return i;
 }
 
-static int delete_node(NODE_T *n,
+static int delete_node(BTREE_T *t,
+                       PATH_T *path,  // Leads to n
+                       NODE_T *n,
                        short   pos,
                        short   indent) {
   assert(n && (pos > 0) && (pos <= n->keycnt));
   debug(indent, "removing key at position %hd from node %hd",
         pos, n->id);
-  if (n->k[pos].key) {
-    free(n->k[pos].key);
-  }
+  // The key stays in the key arena
+  value_free(t, n->k[pos].value);
   if (pos < n->keycnt) {
-    // (dest, src, size)
-    (void)memmove(&(n->k[pos]), &(n->k[pos+1]),
-                  sizeof(REDIRECT_T) * (n->keycnt - pos));
+    slot_move(t, n, pos, n, pos+1, n->keycnt - pos);
   }
-  n->k[n->keycnt].key = NULL;
-  n->k[n->keycnt].bigger = NULL;
+  slot_clear(t, n, n->keycnt, 1);
   (n->keycnt)--;
   if (debugging()) {
     debug_no_nl(indent, "node now contains: ");
-    btree_show_node(n);
+    btree_show_node(t, n);
   }
-  if (n->keycnt >= MIN_KEYS) {
+  if (n->keycnt >= MIN_KEYS(t)) {
     debug(indent,
           "still %hd key%s in it - success",
           n->keycnt, (n->keycnt > 1? "s" : ""));
     return 0; // Fine
   }
-  if (n->parent == NULL) { // Root
+  if (path->depth == 0) { // Root
     if (n->keycnt >= 1) {
       debug(indent,
             "removed one key from root (node %hd) - still %hd key%s in it",
@@ -260,41 +265,41 @@ static int delete_node(NODE_T *n,
         debug(indent,
               "node %hd deleted - new root node %hd",
               n->id, (n->k[0].bigger)->id);
-        btree_setroot(n->k[0].bigger);
+        btree_setroot(t, n->k[0].bigger);
       } else {
         debug(indent, "*** Tree emptied ***");
-        btree_setroot(NULL);
+        btree_setroot(t, NULL);
       }
-      free(n->k);
-      free(n);
+      node_free(t, n);
     }
     return 0;  // Fine
   }
   // Underflow
   debug(indent, "underflow detected");
   // Try to borrow a key from the left
-  if (borrow_from_left(n, indent)) {
+  if (borrow_from_left(t, path, n, indent)) {
     // If it fails borrow from right
-    if (borrow_from_right(n, indent)) {
+    if (borrow_from_right(t, path, n, indent)) {
       // If it fails merge with left node, but
       // then we must recurse
       short   parent_pos = 0;
-      NODE_T *par = n->parent;
-      NODE_T *l = left_sibling(n, &parent_pos);
+      NODE_T *par = path->n[path->depth - 1];
+      NODE_T *l = left_sibling(path, &parent_pos);
 
       if (l) {
          debug(indent, "merging with left node");
-         parent_pos = merge_nodes(l, n, par, indent);
+         parent_pos = merge_nodes(t, l, n, par, parent_pos, indent);
       } else {
-         NODE_T *r = right_sibling(n, &parent_pos);
+         NODE_T *r = right_sibling(path, &parent_pos);
          debug(indent, "merging with right node");
-         parent_pos = merge_nodes(n, r, par, indent);
+         parent_pos = merge_nodes(t, n, r, par, parent_pos, indent);
       }
       debug(indent, "remove key at position %hd from parent %hd",
                     parent_pos, par->id);
       // After merging one node must be removed from the 
       // parent - recurse
-      return delete_node(par, parent_pos, indent+2);
+      (path->depth)--;
+      return delete_node(t, path, par, parent_pos, indent+2);
     } else {
       return 0;
     }
@@ -304,24 +309,19 @@ static int delete_node(NODE_T *n,
   return -1;
 }
 
-static short delete_key(NODE_T    *n,
+static short delete_key(BTREE_T   *t,
+                        NODE_T    *n,
                         char      *key,
                         short indent) {
     // -1 if there is something wrong, 0 if OK
     // Find where the key is in the tree.
-    short pos = 1;
-    int   cmp = -1;
+    short  pos;
+    int    cmp;
+    PATH_T path;
 
     assert(key && n);
-    // Find the leaf node where the key should be stored
-    if (debugging()) {
-      debug_no_nl(indent, "searching node %hd: ", n->id);
-      btree_show_node(n);
-    }
-    while ((pos <= n->keycnt)
-           && ((cmp = btree_keycmp(key, n->k[pos].key)) > 0)) {
-      pos++;
-    }
+    path.depth = 0;
+    n = node_descend(t, n, key, &pos, &cmp, &indent, &path);
     if (cmp == 0) {
       // We've found it in the tree
       debug(indent, "** found at position %hd", pos);
@@ -329,9 +329,9 @@ static short delete_key(NODE_T    *n,
         debug(indent, "removing from leaf node");
         if (debugging()) {
           debug_no_nl(indent, "before calling delete_node:");
-          btree_show_node(n);
+          btree_show_node(t, n);
         }
-        return delete_node(n, pos, indent);
+        return delete_node(t, &path, n, pos, indent);
       } else {
         debug(indent, "removing from internal node");
         // Note that the previous key and the succeeding key of
@@ -340,27 +340,25 @@ static short delete_key(NODE_T    *n,
         // "Real" deletions are always from leaves, in the same
         // way that "real" insertions are always into leaves.
         debug(indent, "finding surrounding keys");
-        NODE_T *prev = leaf_with_greatest_key(n->k[pos-1].bigger);
+        PATH_T  prev_path = path;
+        NODE_T *prev;
         NODE_T *next;
+        char    buf[KEY_TEXTLEN];
 
+        path_push(&prev_path, n, pos-1);
+        prev = leaf_with_greatest_key(n->k[pos-1].bigger, &prev_path);
         if (prev) {
-          if (btree_numeric()) {
-            debug(indent, "previous key %d in leaf node %hd",
-                *((int*)(prev->k[prev->keycnt].key)),
+          debug(indent, "previous key %s in leaf node %hd",
+                key_text(t, key_at(t, prev, prev->keycnt), buf),
                 prev->id);
-          } else {
-            debug(indent, "previous key %s in leaf node %hd",
-                  prev->k[prev->keycnt].key,
-                prev->id);
-        }
-        if (prev->keycnt > MIN_KEYS) {
+        if (prev->keycnt > MIN_KEYS(t)) {
           // No problem, just replace the key to remove with 
           // the previous key, which will be removed from its
           // leaf
           debug(indent, "simple replacement with the previous key");
-          free(n->k[pos].key);
-          n->k[pos].key = prev->k[prev->keycnt].key;
-          prev->k[prev->keycnt].key = NULL;
+          value_free(t, n->k[pos].value);
+          key_transfer(t, n, pos, prev, prev->keycnt);
+          slot_clear(t, prev, prev->keycnt, 1);
           (prev->keycnt)--;
           debug(indent, "removal successful");
           return 0;   // Neat and clean - no need for a recursive call
@@ -373,27 +371,19 @@ static short delete_key(NODE_T    *n,
       // Not enough keys on the left. Try the right.
       next = leaf_with_smallest_key(n->k[pos].bigger);
       if (next) {
-        if (btree_numeric()) {
-          debug(indent, "next key %d in leaf node %hd",
-                *((int*)(next->k[1].key)),
-                next->id);
-        } else {
-          debug(indent, "next key %s in leaf node %hd",
-                next->k[1].key,
-                next->id);
-        }
-        if (next->keycnt > MIN_KEYS) {
+        debug(indent, "next key %s in leaf node %hd",
+              key_text(t, key_at(t, next, 1), buf),
+              next->id);
+        if (next->keycnt > MIN_KEYS(t)) {
           // Replace the key to remove with the next key, which
           // will be removed from its leaf
           debug(indent, "simple replacement with the next key");
-          free(n->k[pos].key);
-          n->k[pos].key = next->k[1].key;
+          value_free(t, n->k[pos].value);
+          key_transfer(t, n, pos, next, 1);
           // Shift everything in the node where the next key 
           // used to be
-          // (dest, src, size)
-          (void)memmove(&(next->k[1]), &(next->k[2]),
-                    sizeof(REDIRECT_T) * (next->keycnt - 1));
-          next->k[next->keycnt].key = NULL;
+          slot_move(t, next, 1, next, 2, next->keycnt - 1);
+          slot_clear(t, next, next->keycnt, 1);
           (next->keycnt)--;
           debug(indent, "removal successful");
           return 0;
@@ -414,53 +404,374 @@ static short delete_key(NODE_T    *n,
       // key was.
       if (prev) {
         debug(indent, "replacement with the previous key");
-        free(n->k[pos].key);
-        n->k[pos].key = prev->k[prev->keycnt].key;
+        value_free(t, n->k[pos].value);
+        key_transfer(t, n, pos, prev, prev->keycnt);
         prev->k[prev->keycnt].key = NULL;
+        prev->k[prev->keycnt].value = NULL;
         // Call the removal of this key
-        return delete_node(prev, prev->keycnt, indent+2); 
+        return delete_node(t, &prev_path, prev, prev->keycnt, indent+2); 
       }
     }
   } else {
-    // Key not found in this node
-    if (_is_leaf(n)) {
-      return -1;  // Not in the tree
-    }
-    // cmp = btree_keycmp(key, n->k[pos].key)) > 0)
-    if (cmp < 0) {
-      // The key at 'pos' is bigger than the searched one
-      return delete_key(n->k[pos-1].bigger, key, indent+2);
-    } else {
-      // The search key is bigger than all keys in the node
-      return delete_key(n->k[n->keycnt].bigger, key, indent+2);
-    }
+    // We have reached a leaf without finding it
+    return -1;  // Not in the tree
   }
   debug(indent, "removal failed");
   return -1;
 }
 
-extern int btree_delete(char *key) {
-    int      val;
-    int      ret;
+static NODE_T *refill(BTREE_T *t, PATH_T *path, NODE_T *n, short indent) {
+    // Top-down mode: n, that the path leads to, only holds
+    // the minimum number of keys and is about to be entered.
+    // It borrows a key from a sibling or is merged with one,
+    // which its parent can afford. Returns the node to enter
+    // instead of n (the left sibling after a merge with it);
+    // the path is adjusted to lead to it, and is one entry
+    // shorter if the parent was the root and went.
+    // In a concurrent tree, n and its parent are latched
+    // by the caller; siblings are latched here, and what is
+    // returned is latched instead of n.
+    short   lpos;
+    short   rpos;
+    short   sep_pos;
+    short   depth = path->depth;
+    NODE_T *par = path->n[depth - 1];
+    NODE_T *l;
+    NODE_T *r;
+    char    emptied;
 
-    if (btree_numeric()) {
-      if (sscanf(key, "%d", &val) == 0) {
-        fprintf(stdout, "Tree only contains numerical values\n");
-        return -1;
+    debug(indent, "node %hd only holds %hd key%s", n->id,
+          n->keycnt, (n->keycnt > 1 ? "s" : ""));
+    if ((l = left_sibling(path, &lpos)) != NULL) {
+      node_wrlock(t, l);
+      if (borrow_from_left(t, path, n, indent) == 0) {
+        node_wrunlock(t, l);
+        return n;
+      }
+    }
+    if ((r = right_sibling(path, &rpos)) != NULL) {
+      node_wrlock(t, r);
+      if (borrow_from_right(t, path, n, indent) == 0) {
+        node_wrunlock(t, r);
+        if (l) {
+          node_wrunlock(t, l);
+        }
+        return n;
+      }
+    }
+    // The node that goes keeps its latch, node_free()
+    // tells the readers that meet it
+    if (l) {
+      debug(indent, "merging with left node");
+      if (r) {
+        node_wrunlock(t, r);
+      }
+      merge_nodes(t, l, n, par, lpos, indent);
+      n = l;
+      path->pos[depth - 1] = lpos - 1;
+      sep_pos = lpos;
+    } else {
+      debug(indent, "merging with right node");
+      merge_nodes(t, n, r, par, rpos, indent);
+      sep_pos = rpos;
+    }
+    // Only the root may lose its last key
+    emptied = (par->keycnt == 1);
+    path->depth = depth - 1;
+    (void)delete_node(t, path, par, sep_pos, indent+2);
+    if (!emptied) {
+      path->depth = depth;
+    }
+    return n;
+}
+
+static NODE_T *edge_leaf(BTREE_T *t, PATH_T *path, NODE_T *n,
+                         char right, short indent) {
+    // Top-down mode: goes down to the leaf that holds the
+    // greatest (right) or smallest key of the subtree n,
+    // which has a key to spare, refilling nodes on the way.
+    // In a concurrent tree, n is latched by the caller, the
+    // leaf is returned latched.
+    NODE_T *c;
+    short   pos;
+
+    while (!_is_leaf(n)) {
+      pos = (right ? n->keycnt : 0);
+      c = n->k[pos].bigger;
+      node_wrlock(t, c);
+      path_push(path, n, pos);
+      if (c->keycnt <= MIN_KEYS(t)) {
+        c = refill(t, path, c, indent);
+      }
+      node_wrunlock(t, n);
+      n = c;
+    }
+    return n;
+}
+
+static int delete_topdown(BTREE_T *t, char *key, short indent) {
+    // Same as delete_key() in one pass: before a node that
+    // holds the minimum number of keys is entered, it gets
+    // one more, so that removing a key from a leaf never
+    // requires going back up.
+    // In a concurrent tree, the node being searched and the
+    // child being entered (and, for a refill, its siblings)
+    // are latched; the parent goes once the child is refilled.
+    NODE_T *n;
+    NODE_T *c;
+    NODE_T *leaf;
+    PATH_T  path;
+    short   pos;
+    int     cmp;
+    int     ret = -1;
+    char    emptied;
+    char    top = 1;   // n is the root, its pointer is latched
+
+    assert(key);
+    path.depth = 0;
+    tree_wrlock(t);
+    if ((n = btree_root(t)) == NULL) {
+      tree_wrunlock(t);
+      return -1;
+    }
+    node_wrlock(t, n);
+    while (1) {
+      pos = node_search(t, n, key, &cmp);
+      if ((cmp == 0) && _is_leaf(n)) {
+        debug(indent, "** found at position %hd in leaf", pos);
+        if (top && (n->keycnt == 1)) {
+          // The tree is emptied, the root goes
+          ret = delete_node(t, &path, n, pos, indent);
+          tree_wrunlock(t);
+          return ret;
+        }
+        ret = delete_node(t, &path, n, pos, indent);
+        break;
+      }
+      if ((cmp == 0) && !btree_plus(t)) {
+        NODE_T *prev = n->k[pos-1].bigger;
+        NODE_T *next = n->k[pos].bigger;
+
+        debug(indent, "** found at position %hd in internal node", pos);
+        node_wrlock(t, prev);
+        if (prev->keycnt > MIN_KEYS(t)) {
+          debug(indent, "replacement with the previous key");
+          path_push(&path, n, pos-1);
+          leaf = edge_leaf(t, &path, prev, 1, indent+2);
+          value_free(t, n->k[pos].value);
+          key_transfer(t, n, pos, leaf, leaf->keycnt);
+          slot_clear(t, leaf, leaf->keycnt, 1);
+          (leaf->keycnt)--;
+          node_wrunlock(t, leaf);
+          ret = 0;
+          break;
+        }
+        node_wrlock(t, next);
+        if (next->keycnt > MIN_KEYS(t)) {
+          debug(indent, "replacement with the next key");
+          node_wrunlock(t, prev);
+          path_push(&path, n, pos);
+          leaf = edge_leaf(t, &path, next, 0, indent+2);
+          value_free(t, n->k[pos].value);
+          key_transfer(t, n, pos, leaf, 1);
+          slot_move(t, leaf, 1, leaf, 2, leaf->keycnt - 1);
+          slot_clear(t, leaf, leaf->keycnt, 1);
+          (leaf->keycnt)--;
+          node_wrunlock(t, leaf);
+          ret = 0;
+          break;
+        }
+        // The key comes down between its two subtrees,
+        // merged, and is looked for again there
+        debug(indent, "merging the subtrees around the key");
+        merge_nodes(t, prev, next, n, pos, indent);
+        emptied = (n->keycnt == 1);  // Root, replaced by prev
+        (void)delete_node(t, &path, n, pos, indent+2);
+        if (!emptied) {
+          path_push(&path, n, pos-1);
+          node_wrunlock(t, n);
+          if (top) {
+            tree_wrunlock(t);
+            top = 0;
+          }
+        }
+        n = prev;
+        indent += 2;
+        continue;
+      }
+      if (_is_leaf(n)) {
+        // Not in the tree
+        break;
+      }
+      if (cmp) {
+        pos--;
       }
+      c = n->k[pos].bigger;
+      node_wrlock(t, c);
+      path_push(&path, n, pos);
+      if (c->keycnt <= MIN_KEYS(t)) {
+        c = refill(t, &path, c, indent);
+        if (path.depth == 0) {
+          // n was the root and went, c replaces it
+          n = c;
+          continue;
+        }
+      }
+      // Nothing will change in n any longer
+      node_wrunlock(t, n);
+      if (top) {
+        tree_wrunlock(t);
+        top = 0;
+      }
+      n = c;
+      indent += 2;
     }
-    if (btree_numeric()) {
-      ret = delete_key(btree_root(), (char *)&val, 0);
+    node_wrunlock(t, n);
+    if (top) {
+      tree_wrunlock(t);
+    }
+    return ret;
+}
+
+extern int key_delete(BTREE_T *t, char *k) {
+    // Deletes a parsed key and records it in the log of the
+    // tree, if there is one (see key_insert())
+    int ret;
+
+    page_touch(t);
+    if (btree_log(t)) {
+      log_lock(t, k);
+    }
+    if (btree_topdown(t)) {
+      ret = delete_topdown(t, k, 0);
     } else {
-      ret = delete_key(btree_root(), key, 0);
+      ret = delete_key(t, btree_root(t), k, 0);
+    }
+    if (btree_log(t)) {
+      if (ret == 0) {
+        ret = log_append(t, LOG_DELETE, k);
+      }
+      log_unlock(t, k);
+    }
+    return ret;
+}
+
+extern int btree_delete(BTREE_T *t, char *key) {
+    KEYBUF_T val;
+    int      ret;
+    char    *k;
+
+    if (!btree_concurrent(t) && (btree_root(t) == NULL)) {
+      // Empty tree, nothing to remove (a concurrent tree
+      // is only looked at under its root latch)
+      return -1;
     }
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      fprintf(stdout, "Tree only contains numerical values\n");
+      return -1;
+    }
+    ret = key_delete(t, k);
     /*
     if (debugging()) {
-      if (btree_check(btree_root(), (char *)NULL)) {
-        btree_display(btree_root(), 0);
+      if (btree_check(t, btree_root(t), (char *)NULL)) {
+        btree_display(t, btree_root(t), 0);
         assert(0);  // Force exit
       }
     }
     */
     return ret;
 }
+
+extern int btree_delete_batch(BTREE_T *t, char **keys, int cnt) {
+    // Removes the cnt keys of the array, in ascending order.
+    // After a descent, the keys that belong to the leaf reached
+    // (below its upper fence) are removed from it without going
+    // down again, as long as it keeps more than the minimum
+    // number of keys; the key that brings it down to less is
+    // removed as btree_delete() would, borrowing or merging,
+    // and the next one starts again from the root.
+    // Keys that aren't in the tree are skipped.
+    // Returns the number of keys removed, -1 if a key is
+    // invalid or if keys aren't sorted (nothing is removed),
+    // or if the keys couldn't be logged (they are removed).
+    char     **ks;
+    NODE_T    *n;
+    PATH_T     path;
+    KEYBUF_T   hibuf;
+    char      *hi;
+    char      *hicopy;
+    short      pos;
+    short      indent;
+    int        cmp;
+    int        i = 0;
+    int        removed = 0;
+
+    if (cnt <= 0) {
+      return 0;
+    }
+    if ((ks = batch_parse(t, keys, cnt)) == NULL) {
+      return -1;
+    }
+    page_touch(t);
+    if (btree_topdown(t)) {
+      // Nodes are refilled on the way down, and latched in
+      // a concurrent tree: one descent per key
+      for (i = 0; i < cnt; i++) {
+        if ((btree_concurrent(t) || btree_root(t))
+            && (key_delete(t, ks[i]) == 0)) {
+          removed++;
+        }
+      }
+      free(ks);
+      return removed;
+    }
+    while ((i < cnt) && btree_root(t)) {
+      path.depth = 0;
+      indent = 0;
+      n = node_descend(t, btree_root(t), ks[i], &pos, &cmp, &indent, &path);
+      if (cmp) {
+        debug(indent, "not in the tree");
+        i++;
+        continue;
+      }
+      if (!_is_leaf(n)) {
+        // Replaced by a key from a leaf
+        if (delete_key(t, btree_root(t), ks[i], 0) == 0) {
+          removed++;
+        }
+        i++;
+        continue;
+      }
+      hi = path_fence(t, &path, &hibuf, &hicopy);
+      while ((i < cnt) && ((hi == NULL) || (btree_keycmp(t, ks[i], hi) < 0))) {
+        pos = node_search(t, n, ks[i], &cmp);
+        i++;
+        if (cmp) {
+          continue;
+        }
+        if ((n->keycnt > MIN_KEYS(t))
+            || ((path.depth == 0) && (n->keycnt > 1))) {
+          // Nothing else changes
+          (void)delete_node(t, &path, n, pos, indent);
+          removed++;
+        } else {
+          // Underflow, or the last key of the tree
+          if (delete_node(t, &path, n, pos, indent) == 0) {
+            removed++;
+          }
+          break;
+        }
+      }
+      free(hicopy);
+    }
+    if (btree_log(t)) {
+      // Keys that weren't there too (see btree_insert_batch())
+      for (i = 0; i < cnt; i++) {
+        if (log_append(t, LOG_DELETE, ks[i])) {
+          removed = -1;
+        }
+      }
+    }
+    free(ks);
+    return removed;
+}
@@ -0,0 +1,357 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_feed.c
+ *
+ *  Loading keys from a file, one per line.
+ *
+ *  btree_feed() reads the file in big blocks, finds the ends of
+ *  lines with memchr() and hands the keys to the tree where they
+ *  are: a string key is terminated in place in the block, an
+ *  integer is converted by a parser of its own (sscanf() is
+ *  several times slower), and the parsed key goes straight to
+ *  the insertion, without being parsed again. A line cut by the
+ *  end of a block is moved to the start of the next one; a line
+ *  longer than a block (4 MB) is reported and skipped.
+ *
+ *  Optionally, a thread reads and parses blocks while the caller
+ *  inserts the keys of the previous one: each block, with what
+ *  was parsed from it, is a batch, and two batches are used in
+ *  turn.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define FEED_BLOCK  (4 * 1024 * 1024)
+
+// A block of the file and the keys found in it
+typedef struct feed_batch_t {
+          char      *block;
+          size_t     size;     // Allocated
+          size_t     len;      // Read
+          char     **keys;     // Into block or aux
+          int        cnt;
+          int        max;
+          KEYBUF_T  *vals;     // Numeric keys
+          char      *aux;      // Length-prefixed bytes keys
+          char       last;     // No more batches after this one
+          char       full;     // Ready to be inserted
+         } FEED_BATCH_T;
+
+typedef struct feed_t {
+          BTREE_T         *t;
+          int              fd;
+          char            *carry;     // Line cut at the end of
+          size_t           carrylen;  // the previous block
+          size_t           carrysize;
+          char             skip;      // In a line too long
+          char             err;       // Reading failed
+          long             read;      // Valid keys
+          FEED_BATCH_T     batch[2];
+          pthread_mutex_t  mx;
+          pthread_cond_t   cv;
+         } FEED_T;
+
+static int parse_int(const char *p, int64_t min, int64_t max, int64_t *v) {
+    // Optional sign then digits, what follows them is
+    // ignored as sscanf() would. Returns 0, -1 if there
+    // are no digits or if the value is out of range.
+    uint64_t  limit = (uint64_t)max;
+    uint64_t  n = 0;
+    char      neg = 0;
+    char      digits = 0;
+
+    if ((*p == '-') || (*p == '+')) {
+      neg = (*p == '-');
+      p++;
+    }
+    if (neg) {
+      limit = (uint64_t)(-(min + 1)) + 1;
+    }
+    while ((*p >= '0') && (*p <= '9')) {
+      if (n > (limit - (uint64_t)(*p - '0')) / 10) {
+        return -1;
+      }
+      n = n * 10 + (uint64_t)(*p - '0');
+      p++;
+      digits = 1;
+    }
+    if (!digits) {
+      return -1;
+    }
+    *v = (neg ? (int64_t)(0 - n) : (int64_t)n);
+    return 0;
+}
+
+static char *feed_key(BTREE_T *t, FEED_BATCH_T *b, char *line, size_t len) {
+    // The key of a line (terminated, spaces removed), as
+    // the tree stores it; NULL if it isn't valid
+    int64_t  v;
+    char    *k;
+
+    switch (btree_keytype(t)) {
+      case BTREE_INT32:
+        if (parse_int(line, INT32_MIN, INT32_MAX, &v)) {
+          return NULL;
+        }
+        b->vals[b->cnt].i32 = (int32_t)v;
+        return (char *)&(b->vals[b->cnt]);
+      case BTREE_INT64:
+        if (parse_int(line, INT64_MIN, INT64_MAX, &v)) {
+          return NULL;
+        }
+        b->vals[b->cnt].i64 = v;
+        return (char *)&(b->vals[b->cnt]);
+      case BTREE_DOUBLE:
+        // As key_parse(): NaN isn't ordered
+        b->vals[b->cnt].d = strtod(line, &k);
+        if ((k == line) || !isfinite(b->vals[b->cnt].d)) {
+          return NULL;
+        }
+        return (char *)&(b->vals[b->cnt]);
+      case BTREE_BYTES:
+        if (len > UINT16_MAX) {
+          return NULL;
+        }
+        // At twice its place in the block: aligned for the
+        // length, and the keys of two lines never overlap
+        k = b->aux + 2 * (size_t)(line - b->block);
+        return key_frombytes(k, line, (uint16_t)len);
+      default:
+        return line;
+    }
+}
+
+static void feed_parse(FEED_T *f, FEED_BATCH_T *b) {
+    // Reads a block and finds the keys in it
+    char    *p;
+    char    *end;
+    char    *nl;
+    char    *line;
+    size_t   len;
+    ssize_t  got = 0;
+
+    b->cnt = 0;
+    b->len = f->carrylen;
+    if (f->carrylen) {
+      memcpy(b->block, f->carry, f->carrylen);
+      f->carrylen = 0;
+    }
+    while ((b->len < b->size - 1)
+           && ((got = read(f->fd, b->block + b->len,
+                           b->size - 1 - b->len)) > 0)) {
+      b->len += (size_t)got;
+    }
+    if (got < 0) {
+      perror("read");
+      f->err = 1;
+    }
+    b->last = (f->err || (b->len < b->size - 1));
+    p = b->block;
+    end = b->block + b->len;
+    if (f->skip) {
+      // What is left of a line too long
+      if ((nl = (char *)memchr(p, '\n', b->len)) == NULL) {
+        p = end;
+      } else {
+        p = nl + 1;
+        f->skip = 0;
+      }
+    }
+    if (!b->last || f->err) {
+      // The end of the last line is in the next block
+      while ((end > p) && (end[-1] != '\n')) {
+        end--;
+      }
+      if (f->err) {
+        // A line cut by the error isn't inserted
+      } else if (end == b->block) {
+        fprintf(stdout, "%.20s...: line longer than %d bytes, skipped\n",
+                b->block, FEED_BLOCK);
+        f->skip = 1;
+      } else {
+        f->carrylen = (size_t)(b->block + b->len - end);
+        if (f->carrylen > f->carrysize) {
+          f->carrysize = f->carrylen;
+          f->carry = (char *)realloc(f->carry, f->carrysize);
+          assert(f->carry);
+        }
+        memcpy(f->carry, end, f->carrylen);
+      }
+    }
+    *end = '\0';
+    while (p < end) {
+      if ((nl = (char *)memchr(p, '\n', (size_t)(end - p))) == NULL) {
+        nl = end;
+      }
+      line = p;
+      p = nl + 1;
+      while ((line < nl) && isspace((unsigned char)*line)) {
+        line++;
+      }
+      while ((nl > line) && isspace((unsigned char)nl[-1])) {
+        nl--;
+      }
+      if ((len = (size_t)(nl - line)) == 0) {
+        continue;
+      }
+      *nl = '\0';
+      if (b->cnt == b->max) {
+        b->max *= 2;
+        b->keys = (char **)realloc(b->keys, b->max * sizeof(char *));
+        b->vals = (KEYBUF_T *)realloc(b->vals, b->max * sizeof(KEYBUF_T));
+        assert(b->keys && b->vals);
+      }
+      if ((b->keys[b->cnt] = feed_key(f->t, b, line, len)) == NULL) {
+        fprintf(stdout, "%s: invalid %s\n", line,
+                (btree_keytype(f->t) == BTREE_BYTES ? "key" : "numeric value"));
+        continue;
+      }
+      b->cnt++;
+      f->read++;
+    }
+}
+
+static long feed_insert(FEED_T *f, FEED_BATCH_T *b) {
+    long  added = 0;
+    char *k;
+    int   i;
+
+    for (i = 0; i < b->cnt; i++) {
+      // vals may have moved since keys[i] was set
+      k = (btree_keysize(f->t) ? (char *)&(b->vals[i]) : b->keys[i]);
+      if (key_insert(f->t, k, NULL, 0) == 0) {
+        added++;
+      }
+    }
+    return added;
+}
+
+static void *feed_parser(void *arg) {
+    // Fills the batches in turn, once the inserter is
+    // done with them
+    FEED_T       *f = (FEED_T *)arg;
+    FEED_BATCH_T *b;
+    int           i = 0;
+
+    do {
+      b = &(f->batch[i]);
+      pthread_mutex_lock(&(f->mx));
+      while (b->full) {
+        pthread_cond_wait(&(f->cv), &(f->mx));
+      }
+      pthread_mutex_unlock(&(f->mx));
+      feed_parse(f, b);
+      pthread_mutex_lock(&(f->mx));
+      b->full = 1;
+      pthread_cond_broadcast(&(f->cv));
+      pthread_mutex_unlock(&(f->mx));
+      i = 1 - i;
+    } while (!b->last);
+    return NULL;
+}
+
+static void batch_init(FEED_T *f, FEED_BATCH_T *b) {
+    b->size = FEED_BLOCK;
+    b->block = (char *)malloc(b->size);
+    b->max = 1024;
+    b->keys = (char **)malloc(b->max * sizeof(char *));
+    b->vals = (KEYBUF_T *)malloc(b->max * sizeof(KEYBUF_T));
+    b->aux = NULL;
+    if (btree_keytype(f->t) == BTREE_BYTES) {
+      b->aux = (char *)malloc(2 * b->size + 2);
+      assert(b->aux);
+    }
+    b->cnt = 0;
+    b->full = 0;
+    b->last = 0;
+    assert(b->block && b->keys && b->vals);
+}
+
+extern long btree_feed(BTREE_T *t, const char *path, char threaded) {
+    // Inserts the keys of the file at path, one per line
+    // (spaces around are ignored, as are empty lines), the
+    // file being parsed by another thread if threaded is set.
+    // Returns the number of valid keys read (duplicates
+    // included), -1 if the file can't be read (the keys
+    // read before an error are inserted).
+    FEED_T        f;
+    FEED_BATCH_T *b;
+    pthread_t     parser;
+    long          added = 0;
+    int           i = 0;
+    char          last;
+
+    assert(t && path);
+    if ((f.fd = open(path, O_RDONLY)) < 0) {
+      perror(path);
+      return -1;
+    }
+    (void)posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    f.t = t;
+    f.carry = NULL;
+    f.carrylen = 0;
+    f.carrysize = 0;
+    f.skip = 0;
+    f.err = 0;
+    f.read = 0;
+    batch_init(&f, &(f.batch[0]));
+    batch_init(&f, &(f.batch[1]));
+    if (threaded) {
+      pthread_mutex_init(&(f.mx), NULL);
+      pthread_cond_init(&(f.cv), NULL);
+      if (pthread_create(&parser, NULL, feed_parser, &f)) {
+        perror("pthread_create");
+        pthread_mutex_destroy(&(f.mx));
+        pthread_cond_destroy(&(f.cv));
+        threaded = 0;
+      }
+    }
+    do {
+      b = &(f.batch[i]);
+      if (threaded) {
+        pthread_mutex_lock(&(f.mx));
+        while (!b->full) {
+          pthread_cond_wait(&(f.cv), &(f.mx));
+        }
+        pthread_mutex_unlock(&(f.mx));
+        added += feed_insert(&f, b);
+        pthread_mutex_lock(&(f.mx));
+        last = b->last;   // The batch is refilled once released
+        b->full = 0;
+        pthread_cond_broadcast(&(f.cv));
+        pthread_mutex_unlock(&(f.mx));
+        i = 1 - i;
+      } else {
+        feed_parse(&f, b);
+        added += feed_insert(&f, b);
+        last = b->last;
+      }
+    } while (!last);
+    if (threaded) {
+      pthread_join(parser, NULL);
+      pthread_mutex_destroy(&(f.mx));
+      pthread_cond_destroy(&(f.cv));
+    }
+    for (i = 0; i < 2; i++) {
+      free(f.batch[i].block);
+      free(f.batch[i].keys);
+      free(f.batch[i].vals);
+      free(f.batch[i].aux);
+    }
+    free(f.carry);
+    close(f.fd);
+    debug(0, "%s: %ld keys read, %ld inserted", path, f.read, added);
+    return (f.err ? -1 : f.read);
+}
@@ -17,13 +17,13 @@
 #include "debug.h"
 
 
-static short split_position(short target_pos, char *new_up) {
+static short split_position(BTREE_T *t, short target_pos, char *new_up) {
     // Reminder: the split position is the 
     // position of the key that moves up.
     // Everything smaller remains in the left node,
     // everything bigger or equal goes to a newly
     // created right sibling node.
-    short maxkeys = btree_maxkeys();
+    short maxkeys = btree_maxkeys(t);
 
     assert(new_up);
     *new_up = 0;
@@ -60,67 +60,150 @@ static short split_position(short target_pos, char *new_up) {
     return -1; 
 }
 
-static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
+static NODE_T  *split_node(BTREE_T *t, PATH_T *path, NODE_T *n,
+                           short split_pos, short indent) {
    // Splits n at position split_pos (moves everything
    // from split_pos + 1 to the end into a new node to the
    // right) and returns a pointer to the new sibling node.
+   // path leads to n; if n is the root, the new root is
+   // pushed onto it.
    // indent is just for indenting debugging messages.
    NODE_T *new_n = NULL;
-   short   i;
 
    assert(n
-          && (n->keycnt == btree_maxkeys())
+          && (n->keycnt == btree_maxkeys(t))
           && (split_pos > 0)
           && (split_pos < n->keycnt));
    debug(indent, "splitting node %hd", n->id);
-   if (n->parent == NULL) {
+   if (path->depth == 0) {
+     NODE_T *root;
+
      debug(indent, "splitting the root");
      // We are splitting the root. We need a new root
-     n->parent = new_node(NULL);
-     debug(indent, "new root node %hd", (n->parent)->id);
-     btree_setroot(n->parent);
+     root = new_node(t);
+     root->k[0].bigger = n;
+     debug(indent, "new root node %hd", root->id);
+     btree_setroot(t, root);
+     path_push(path, root, 0);
    }
-   new_n = new_node(n->parent); // New sibling, same parent
+   new_n = new_node(t); // New sibling, same parent
    assert(new_n);
-   debug(indent, "created new node %hd, parent %hd",
-         new_n->id, (new_n->parent)->id);
+   debug(indent, "created new node %hd", new_n->id);
    // Copy nodes 
    debug(indent, "splitting at %hd", split_pos);
    if (debugging()) {
      debug_no_nl(indent, "before split: ");
-     btree_show_node(n);
+     btree_show_node(t, n);
+   }
+   if (btree_prefix(t)) {
+     // Same prefix, suffixes are moved as they are
+     new_n->pfx = n->pfx;
+     new_n->pfxlen = n->pfxlen;
    }
-   // (dest, src, size)
-   (void)memmove(&(new_n->k[1]), &(n->k[split_pos+1]),
-                    sizeof(REDIRECT_T) * (n->keycnt - split_pos));
+   slot_move(t, new_n, 1, n, split_pos+1, n->keycnt - split_pos);
    // Blank out what was moved for safety
-   (void)memset(&(n->k[split_pos+1]), 0,
-                    sizeof(REDIRECT_T) * (n->keycnt - split_pos));
+   slot_clear(t, n, split_pos+1, n->keycnt - split_pos);
    // Adjust key counts
    new_n->keycnt = n->keycnt;
    n->keycnt = split_pos;
    if (debugging()) {
      debug_no_nl(indent, "-> %hd keys in node %d ", n->keycnt, n->id);
-     btree_show_node(n);
+     btree_show_node(t, n);
    }
    new_n->keycnt -= split_pos;
    if (debugging()) {
      debug_no_nl(indent, "-> %hd keys in node %d ", new_n->keycnt, new_n->id);
-     btree_show_node(new_n);
+     btree_show_node(t, new_n);
    }
-   if (!_is_leaf(n)) {
-     // Change parent pointer in the new node
-     debug(indent, "updating parent pointer in children of new node");
-     // Note that at this point the 'smaller' node isn't known
-     for (i = 1; i <= new_n->keycnt; i++) {
-       (new_n->k[i].bigger)->parent = new_n;
+   if (btree_plus(t) && _is_leaf(n)) {
+     // The new leaf follows n in the chain
+     new_n->next = n->next;
+     if (new_n->next) {
+       (new_n->next)->prev = new_n;
      }
+     new_n->prev = n;
+     n->next = new_n;
    }
    return new_n;
 }
 
-static short insert_in_node(NODE_T  *n,
+// Forward declaration
+static short insert_in_node(BTREE_T *t,
+                            PATH_T  *path,
+                            NODE_T  *n,
+                            char    *key,
+                            void    *value,
+                            NODE_T  *smaller,
+                            NODE_T  *bigger,
+                            short    indent);
+
+static short split_leaf(BTREE_T *t,
+                        PATH_T  *path,
+                        NODE_T  *n,
+                        short    pos,
+                        char    *key,
+                        void    *value,
+                        short    indent) {
+  // B+tree mode: the keys of the full leaf n and the key
+  // that should go at pos are shared between n and a new
+  // right sibling. Nothing moves up, a copy of the first
+  // key of the sibling is inserted into the parent.
+  short     maxkeys = btree_maxkeys(t);
+  short     left = (maxkeys + 2) / 2;  // Keys in n afterwards
+  short     split_pos;
+  NODE_T   *new_n;
+  char     *sep;
+  char     *sep_copy = NULL;
+  KEYBUF_T  sep_buf;
+  NODE_T   *par;
+  char     *lo = NULL;
+  char     *hi = NULL;
+  short     ret;
+
+  split_pos = (pos <= left ? left - 1 : left);
+  if (split_pos >= maxkeys) {
+    split_pos = maxkeys - 1;
+  }
+  if (btree_prefix(t)) {
+    // Read before the parent changes
+    pfx_fences(path, &lo, &hi);
+  }
+  new_n = split_node(t, path, n, split_pos, indent);
+  if (pos <= left) {
+    ret = insert_in_node(t, path, n, key, value, NULL, NULL, indent+2);
+  } else {
+    ret = insert_in_node(t, path, new_n, key, value, NULL, NULL, indent+2);
+  }
+  if (ret < 0) {
+    free(lo);
+    free(hi);
+    return ret;
+  }
+  sep = key_fetch(t, new_n, 1, &sep_buf);
+  if (btree_prefix(t)) {
+    sep = sep_copy = strdup(sep);
+    assert(sep_copy);
+  } else {
+    sep = key_duplicate(t, sep);
+  }
+  debug(indent, "separator goes up");
+  par = path->n[--(path->depth)];
+  ret = insert_in_node(t, path, par, sep, NULL, n, new_n, indent+2);
+  if ((ret >= 0) && btree_prefix(t)) {
+    pfx_fit(t, n, lo, sep);
+    pfx_fit(t, new_n, sep, hi);
+  }
+  free(sep_copy);
+  free(lo);
+  free(hi);
+  return ret;
+}
+
+static short insert_in_node(BTREE_T *t,
+                            PATH_T  *path,
+                            NODE_T  *n,
                             char    *key,
+                            void    *value,
                             NODE_T  *smaller,
                             NODE_T  *bigger,
                             short    indent) {
@@ -128,41 +211,60 @@ static short insert_in_node(NODE_T  *n,
   assert(key);
   if (n == NULL) {
     debug(indent, "need to create a new root");
-    NODE_T *root = new_node(NULL);
+    NODE_T *root = new_node(t);
     root->keycnt = 1;
     root->k[0].bigger = smaller; 
-    root->k[1].key = key;
+    key_store(t, root, 1, key);
+    root->k[1].value = value;
     root->k[1].bigger = bigger; 
-    btree_setroot(root);
+    btree_setroot(t, root);
     if (debugging()) {
       debug_no_nl(indent, "new root is node %hd ", root->id);
-      btree_show_node(root);
+      btree_show_node(t, root);
     }
   } else {
-    short pos = find_pos(n, key, 0, indent);
+    short pos = find_pos(t, n, key, 0, indent);
     if (debugging()) {
-      if (btree_numeric()) {
-        debug_no_nl(indent, "inserting key %d at pos %hd in node %hd ",
-                    *((int*)key), pos, n->id);
-      } else {
-        debug_no_nl(indent, "inserting key %s at pos %hd in node %hd ",
-                    key, pos, n->id);
-      }
-      btree_show_node(n);
+      char buf[KEY_TEXTLEN];
+
+      debug_no_nl(indent, "inserting key %s at pos %hd in node %hd ",
+                  key_text(t, key, buf), pos, n->id);
+      btree_show_node(t, n);
     }
     if (pos >= 0) {
-      if (n->keycnt == btree_maxkeys()) {
+      if ((n->keycnt == btree_maxkeys(t)) && btree_plus(t) && _is_leaf(n)) {
+        return split_leaf(t, path, n, pos, key, value, indent);
+      } else if (n->keycnt == btree_maxkeys(t)) {
         // Must split
-        char   *key_up;
+        char     *key_up;
+        char     *up_copy = NULL; // Compressed key_up, rebuilt
+        void     *value_up;
+        KEYBUF_T  up_buf;   // Keeps a numeric key_up safe
+        NODE_T   *par;
+        char     *lo = NULL;  // Fences of n, prefix mode
+        char     *hi = NULL;
         char    new_up = 0; // Flag
-        short   split_pos = split_position(pos, &new_up);
+        short   split_pos = split_position(t, pos, &new_up);
+        short   ret;
         if (new_up) {
           // The key that will go up is the one being inserted
           key_up = key;
+          value_up = value;
         } else {
-          key_up = n->k[split_pos].key;
+          key_up = key_fetch(t, n, split_pos, &up_buf);
+          if (btree_prefix(t)) {
+            // Rebuilt in a buffer that other keys will reuse
+            key_up = up_copy = strdup(key_up);
+            assert(up_copy);
+          }
+          value_up = n->k[split_pos].value;
+        }
+        if (btree_prefix(t)) {
+          // Read before the parent changes
+          pfx_fences(path, &lo, &hi);
         }
-        NODE_T *new_n = split_node(n, split_pos, indent);
+        NODE_T *new_n = split_node(t, path, n, split_pos, indent);
+        par = path->n[--(path->depth)];
         if (!new_up) {
           // A key that already was in the node (at split_pos)
           // moves up.
@@ -173,22 +275,29 @@ static short insert_in_node(NODE_T  *n,
           debug(indent, "moving up the key already at %hd",
                         split_pos);
           new_n->k[0].bigger = n->k[split_pos].bigger;
-          if (new_n->k[0].bigger) {
-            (new_n->k[0].bigger)->parent = new_n;
-          }
           // Clear what refers to the promoted value (key already saved)
-          n->k[split_pos].key = NULL;
-          n->k[split_pos].bigger = NULL;
+          slot_clear(t, n, split_pos, 1);
           (n->keycnt)--;
           // Move up the key at split_pos in the left sibling (n)
-          if (insert_in_node(n->parent, key_up,
-                             n, new_n, indent+2) >= 0) {
+          ret = insert_in_node(t, path, par, key_up, value_up,
+                               n, new_n, indent+2);
+          if ((ret >= 0) && btree_prefix(t)) {
+            // Both nodes now have closer fences
+            pfx_fit(t, n, lo, key_up);
+            pfx_fit(t, new_n, key_up, hi);
+          }
+          free(up_copy);
+          free(lo);
+          free(hi);
+          if (ret >= 0) {
+            // There is room now, the path isn't used
             if (pos <= split_pos) {
               // Insert into n
-              return insert_in_node(n, key, smaller, bigger, indent+2);
+              return insert_in_node(t, path, n, key, value,
+                                    smaller, bigger, indent+2);
             } else {
               // Insert into new_sibling
-              return insert_in_node(new_n, key,
+              return insert_in_node(t, path, new_n, key, value,
                                   smaller, bigger, indent+2);
             } 
           } 
@@ -198,11 +307,15 @@ static short insert_in_node(NODE_T  *n,
           // is what was bigger than the key that is inserted
           debug(indent, "moving up the new key");
           new_n->k[0].bigger = bigger;
-          if (new_n->k[0].bigger) {
-            (new_n->k[0].bigger)->parent = new_n;
+          ret = insert_in_node(t, path, par, key_up, value_up,
+                               n, new_n, indent+2);
+          if ((ret >= 0) && btree_prefix(t)) {
+            pfx_fit(t, n, lo, key_up);
+            pfx_fit(t, new_n, key_up, hi);
           }
-          return insert_in_node(n->parent, key_up,
-                                n, new_n, indent+2);
+          free(lo);
+          free(hi);
+          return ret;
         }
       } else {
         // There is still room in the node
@@ -210,26 +323,18 @@ static short insert_in_node(NODE_T  *n,
           debug(indent, "shifting %d elements from %hd to %hd in node %hd",
                 (1 + n->keycnt - pos),
                 pos, pos + 1, n->id);
-          // (dest, src, size)
-          (void)memmove(&(n->k[pos+1]), &(n->k[pos]),
-                        sizeof(REDIRECT_T) * (1 + n->keycnt - pos));
+          slot_move(t, n, pos+1, n, pos, 1 + n->keycnt - pos);
         }
-        n->k[pos].key = key;
+        key_store(t, n, pos, key);
+        n->k[pos].value = value;
         if (!n->k[pos-1].bigger) {
           n->k[pos-1].bigger = smaller;
-          if (smaller) {
-            smaller->parent = n;
-          }
         }
         n->k[pos].bigger = bigger;
-        if (bigger) {
-          // Adjust
-          bigger->parent = n;
-        }
         (n->keycnt)++;
         if (debugging()) {
           debug_no_nl(indent, "updated node %d ", n->id);
-          btree_show_node(n);
+          btree_show_node(t, n);
         }
       }
     } else {
@@ -239,59 +344,234 @@ static short insert_in_node(NODE_T  *n,
   return 0;
 }
 
-static short insert_key(NODE_T  *n,
+static short insert_key(BTREE_T *t,
+                        NODE_T  *n,
                         char    *key,
+                        void    *value,
+                        char     replace,
                         short    indent) {
     // -1 if there is something wrong, 0 if OK
-    short pos = 1;
-    int   cmp = -1;
+    // If 'replace' is set and the key is found, its value
+    // is replaced by the new one.
+    short  pos;
+    int    cmp;
+    PATH_T path;
 
     assert(key && n);
-    // Find the leaf node where the key should be stored
-    if (debugging()) {
-      debug_no_nl(indent, "searching node %hd: ", n->id);
-      btree_show_node(n);
-    }
-    while ((pos <= n->keycnt)
-           && ((cmp = btree_keycmp(key, n->k[pos].key)) > 0)) {
-      pos++;
-    }
+    // Find the node that holds the key, or the leaf
+    // where it should be stored, and remember the way
+    path.depth = 0;
+    n = node_descend(t, n, key, &pos, &cmp, &indent, &path);
     if (cmp == 0) {
       // We've found it in the tree
       debug(indent, "** found at position %hd", pos);
-      if (btree_unique()) {
+      if (replace) {
+        debug(indent, "replacing value");
+        if (n->k[pos].value != value) {
+          value_free(t, n->k[pos].value);
+          n->k[pos].value = value;
+        }
+        return 0;
+      }
+      if (btree_unique(t)) {
         debug(indent, "duplicates not allowed");
         return -1;
       }
     } else {
-      // We have found a key that is greater or we have reached
-      // the end of the node
-      if (!_is_leaf(n)) {
-        return insert_key(n->k[pos-1].bigger, key, indent+2);
+      char *k;
+      debug(indent, "should go in this leaf node");
+      k = key_duplicate(t, key);
+      return insert_in_node(t, &path, n, k, value, NULL, NULL, indent);
+    }
+  return -1;
+}
+
+static short split_at(BTREE_T *t,
+                      PATH_T  *path,
+                      NODE_T  *n,
+                      short    split_pos,
+                      short    indent) {
+  // Splits the full node n, that the path leads to, at
+  // split_pos without inserting anything, and sends up
+  // what separates the halves (a copy of the first key of
+  // the new leaf in B+tree mode, the key at split_pos
+  // otherwise). The path is left leading to the parent
+  // if it didn't have to be split in turn.
+  char      leaf = (btree_plus(t) && _is_leaf(n));
+  NODE_T   *new_n;
+  NODE_T   *par;
+  char     *key_up;
+  char     *up_copy = NULL;
+  void     *value_up = NULL;
+  KEYBUF_T  up_buf;
+  char     *lo = NULL;
+  char     *hi = NULL;
+  short     ret;
+
+  if (btree_prefix(t)) {
+    pfx_fences(path, &lo, &hi);
+  }
+  new_n = split_node(t, path, n, split_pos, indent);
+  if (leaf) {
+    // A copy of the first key of the new leaf separates them
+    key_up = key_fetch(t, new_n, 1, &up_buf);
+    if (btree_prefix(t)) {
+      key_up = up_copy = strdup(key_up);
+      assert(up_copy);
+    } else {
+      key_up = key_duplicate(t, key_up);
+    }
+  } else {
+    key_up = key_fetch(t, n, split_pos, &up_buf);
+    if (btree_prefix(t)) {
+      key_up = up_copy = strdup(key_up);
+      assert(up_copy);
+    }
+    value_up = n->k[split_pos].value;
+    new_n->k[0].bigger = n->k[split_pos].bigger;
+    slot_clear(t, n, split_pos, 1);
+    (n->keycnt)--;
+  }
+  par = path->n[--(path->depth)];
+  ret = insert_in_node(t, path, par, key_up, value_up, n, new_n, indent+2);
+  if ((ret >= 0) && btree_prefix(t)) {
+    pfx_fit(t, n, lo, key_up);
+    pfx_fit(t, new_n, key_up, hi);
+  }
+  free(up_copy);
+  free(lo);
+  free(hi);
+  return ret;
+}
+
+static short split_full(BTREE_T *t,
+                        PATH_T  *path,
+                        NODE_T  *n,
+                        short    indent) {
+  // Top-down mode: splits the full node n, that the path
+  // leads to, before going down into it. Nothing else is
+  // inserted: the two halves must hold the minimum number
+  // of keys on their own. The parent isn't full, what goes
+  // up stops there; the path is left leading to it.
+  assert((path->depth == 0)
+         || (path->n[path->depth - 1]->keycnt < btree_maxkeys(t)));
+  return split_at(t, path, n, (btree_maxkeys(t) + 1) / 2, indent);
+}
+
+static short insert_topdown(BTREE_T *t,
+                            char    *key,
+                            void    *value,
+                            char     replace,
+                            short    indent) {
+    // Same as insert_key() in one pass: a full node is split
+    // before it's entered, the leaf reached has room for the
+    // key and nothing ever goes up more than one level.
+    // In a concurrent tree, the node being searched and the
+    // child being entered are latched; the parent goes as
+    // soon as the child has room.
+    NODE_T *n;
+    NODE_T *c;
+    PATH_T  path;
+    short   pos;
+    int     cmp;
+    short   ret;
+    char    top = 1;   // n is the root, its pointer is latched
+
+    assert(key);
+    path.depth = 0;
+    tree_wrlock(t);
+    if ((n = btree_root(t)) == NULL) {
+      debug(indent, "creating root");
+      n = new_node(t);
+      btree_setroot(t, n);
+    }
+    node_wrlock(t, n);
+    if (n->keycnt == btree_maxkeys(t)) {
+      debug(indent, "root is full");
+      ret = split_full(t, &path, n, indent);
+      node_wrunlock(t, n);
+      if (ret < 0) {
+        tree_wrunlock(t);
+        return ret;
+      }
+      n = btree_root(t);
+      node_wrlock(t, n);
+    }
+    while (1) {
+      pos = node_search(t, n, key, &cmp);
+      if ((cmp == 0) && (_is_leaf(n) || !btree_plus(t))) {
+        debug(indent, "** found at position %hd", pos);
+        if (replace) {
+          debug(indent, "replacing value");
+          if (n->k[pos].value != value) {
+            value_free(t, n->k[pos].value);
+            n->k[pos].value = value;
+          }
+          ret = 0;
+        } else {
+          debug(indent, "duplicates not allowed");
+          ret = -1;
+        }
+        break;
+      }
+      if (_is_leaf(n)) {
+        debug(indent, "should go in leaf node %hd", n->id);
+        ret = insert_in_node(t, &path, n, key_duplicate(t, key), value,
+                             NULL, NULL, indent);
+        break;
+      }
+      if (cmp) {
+        pos--;
+      }
+      c = n->k[pos].bigger;
+      node_wrlock(t, c);
+      path_push(&path, n, pos);
+      if (c->keycnt == btree_maxkeys(t)) {
+        debug(indent, "node %hd is full", c->id);
+        ret = split_full(t, &path, c, indent);
+        node_wrunlock(t, c);
+        if (ret < 0) {
+          break;
+        }
+        // n has received a key, search it again
       } else {
-        char *k;
-        debug(indent, "should go in this leaf node");
-        k = key_duplicate(key);
-        return insert_in_node(n, k, NULL, NULL, indent);
+        // Nothing will change in n any longer
+        node_wrunlock(t, n);
+        if (top) {
+          tree_wrunlock(t);
+          top = 0;
+        }
+        n = c;
+        indent += 2;
       }
     }
-  return -1;
+    node_wrunlock(t, n);
+    if (top) {
+      tree_wrunlock(t);
+    }
+    return ret;
 }
 
-static int insert_from_root(char *key, int indent) {
+static int insert_from_root(BTREE_T *t, char *key,
+                            void *value, char replace, int indent) {
    NODE_T *n;
    int     ret;
 
-   if (!btree_root()) {
+   if (btree_topdown(t)) {
+     // Creates the root itself, under the root latch
+     // of a concurrent tree
+     return insert_topdown(t, key, value, replace, indent);
+   }
+   if (!btree_root(t)) {
      debug(indent, "insert_from_root() - creating root");
-     n = new_node(NULL);
-     btree_setroot(n);
+     n = new_node(t);
+     btree_setroot(t, n);
    }
-   ret = insert_key(btree_root(), key, indent);
+   ret = insert_key(t, btree_root(t), key, value, replace, indent);
    /*
    if (debugging()) {
-     if (btree_check(btree_root(), (char *)NULL)) {
-       btree_display(btree_root(), 0);
+     if (btree_check(t, btree_root(t), (char *)NULL)) {
+       btree_display(t, btree_root(t), 0);
        assert(0);  // Force exit
      }
    }
@@ -299,19 +579,243 @@ static int insert_from_root(char *key, int indent) {
    return ret;
 }
 
-extern int btree_insert(char *key) {
-    int     val;
+extern int key_insert(BTREE_T *t, char *k, void *value, char replace) {
+    // Inserts a parsed key and records it in the log of the
+    // tree, if there is one. In a concurrent tree the change
+    // and its record are made under the same lock, so that
+    // the log keeps the changes of a key in order. Returns
+    // -1 if the key isn't inserted, and also if it couldn't
+    // be logged (see log_append()).
+    int ret;
 
-    if (btree_numeric()) {
-      if (sscanf(key, "%d", &val) == 0) {
-        fprintf(stdout, "%s: invalid numeric value\n", key);
+    page_touch(t);
+    if (btree_log(t) == NULL) {
+      return insert_from_root(t, k, value, replace, 0);
+    }
+    log_lock(t, k);
+    if ((ret = insert_from_root(t, k, value, replace, 0)) == 0) {
+      ret = log_append(t, LOG_INSERT, k);
+    }
+    log_unlock(t, k);
+    return ret;
+}
+
+extern int btree_insert(BTREE_T *t, char *key) {
+    // Key only, no associated data
+    KEYBUF_T  val;
+    char     *k;
+
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      fprintf(stdout, "%s: invalid numeric value\n", key);
+      return -1;
+    }
+    return key_insert(t, k, NULL, 0);
+}
+
+extern int btree_put(BTREE_T *t, char *key, void *value) {
+    // Inserts the key with its value or, if the key is
+    // already in the tree, replaces its value
+    KEYBUF_T  val;
+    char     *k;
+
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      fprintf(stdout, "%s: invalid numeric value\n", key);
+      return -1;
+    }
+    if (value && btree_file(t)) {
+      // Values can't be kept in a file
+      return -1;
+    }
+    return key_insert(t, k, value, 1);
+}
+
+extern int btree_update(BTREE_T *t, char *key, void *value) {
+    // Only replaces the value of a key already present
+    KEYBUF_T  val;
+    char     *k;
+    KEYLOC_T  loc;
+
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      fprintf(stdout, "%s: invalid numeric value\n", key);
+      return -1;
+    }
+    if (value && btree_file(t)) {
+      return -1;
+    }
+    page_touch(t);
+    if (btree_concurrent(t)) {
+      int cmp;
+
+      if ((loc.n = latched_descend(t, k, &(loc.pos), &cmp)) == NULL) {
         return -1;
       }
-    } 
-    if (btree_numeric()) {
-      return insert_from_root((char *)&val, 0);
-    } else {
-      return insert_from_root(key, 0);
+      if (cmp == 0) {
+        if (loc.n->k[loc.pos].value != value) {
+          value_free(t, loc.n->k[loc.pos].value);
+          loc.n->k[loc.pos].value = value;
+        }
+      }
+      node_wrunlock(t, loc.n);
+      return (cmp == 0 ? 0 : -1);
+    }
+    loc = btree_find_key(t, k);
+    if (loc.n == NULL) {
+      return -1;
+    }
+    if (loc.n->k[loc.pos].value != value) {
+      value_free(t, loc.n->k[loc.pos].value);
+      loc.n->k[loc.pos].value = value;
+    }
+    return 0;
+}
+
+static short append_split_pos(BTREE_T *t, short more) {
+    // Batch insertion: where to split a full leaf when the
+    // next keys all go after its last one, more of them (up
+    // to the minimum number of keys) being on their way.
+    // The new leaf takes as few keys as it needs to reach
+    // the minimum with them, the next keys fill it, and the
+    // left leaf stays as full as possible. 0 if the left
+    // leaf would be too small.
+    short maxkeys = btree_maxkeys(t);
+    short need = MIN_KEYS(t) - more;  // Keys the new leaf takes
+    short split_pos;
+
+    if (need < 1) {
+      need = 1;
+    }
+    split_pos = maxkeys - need;
+    // Outside of a B+tree, the key at split_pos goes up
+    if (split_pos - (btree_plus(t) ? 0 : 1) < MIN_KEYS(t)) {
+      return 0;
+    }
+    return split_pos;
+}
+
+static short batch_following(BTREE_T *t, char **ks, int i, int cnt,
+                             char *hi, short limit) {
+    // Number of different keys from ks[i] on that are below
+    // the fence hi, counting up to limit
+    short more = 1;
+    int   j;
+
+    for (j = i + 1; (j < cnt) && (more < limit); j++) {
+      if (hi && (btree_keycmp(t, ks[j], hi) >= 0)) {
+        break;
+      }
+      if (btree_keycmp(t, ks[j-1], ks[j])) {
+        more++;
+      }
+    }
+    return more;
+}
+
+extern int btree_insert_batch(BTREE_T *t, char **keys, int cnt) {
+    // Inserts the cnt keys of the array, in ascending order.
+    // After a descent, all the keys that belong to the leaf
+    // reached (below its upper fence) go into it without going
+    // down again, as long as it has room. A leaf that overflows
+    // with keys that all go after its own is split once so
+    // that the new leaf is filled by the keys that follow,
+    // instead of being split again every few keys.
+    // Keys already in the tree are skipped.
+    // Returns the number of keys inserted, -1 if a key is
+    // invalid or if keys aren't sorted (nothing is inserted),
+    // or if the keys couldn't be logged (they are inserted).
+    char     **ks;
+    NODE_T    *n;
+    PATH_T     path;
+    KEYBUF_T   hibuf;
+    char      *hi;
+    char      *hicopy;
+    short      maxkeys = btree_maxkeys(t);
+    short      split_pos;
+    short      pos;
+    short      indent;
+    int        cmp;
+    int        i = 0;
+    int        added = 0;
+
+    if (cnt <= 0) {
+      return 0;
+    }
+    if ((ks = batch_parse(t, keys, cnt)) == NULL) {
+      return -1;
+    }
+    page_touch(t);
+    if (btree_topdown(t)) {
+      // Nodes are split on the way down, and latched in a
+      // concurrent tree: one descent per key
+      for (i = 0; i < cnt; i++) {
+        if (key_insert(t, ks[i], NULL, 0) == 0) {
+          added++;
+        }
+      }
+      free(ks);
+      return added;
+    }
+    while (i < cnt) {
+      if (!btree_root(t)) {
+        debug(0, "btree_insert_batch() - creating root");
+        btree_setroot(t, new_node(t));
+      }
+      path.depth = 0;
+      indent = 0;
+      n = node_descend(t, btree_root(t), ks[i], &pos, &cmp, &indent, &path);
+      if (cmp == 0) {
+        debug(indent, "already in the tree");
+        i++;
+        continue;
+      }
+      hi = path_fence(t, &path, &hibuf, &hicopy);
+      while ((i < cnt) && ((hi == NULL) || (btree_keycmp(t, ks[i], hi) < 0))) {
+        pos = node_search(t, n, ks[i], &cmp);
+        if (cmp == 0) {
+          // Already in the leaf, or repeated in the batch
+          i++;
+          continue;
+        }
+        if (n->keycnt < maxkeys) {
+          if (pos <= n->keycnt) {
+            slot_move(t, n, pos+1, n, pos, 1 + n->keycnt - pos);
+          }
+          key_store(t, n, pos, key_duplicate(t, ks[i]));
+          n->k[pos].value = NULL;
+          (n->keycnt)++;
+          added++;
+          i++;
+          continue;
+        }
+        // Full leaf - the path changes, go down again afterwards
+        split_pos = 0;
+        if (pos > n->keycnt) {
+          split_pos = append_split_pos(t, batch_following(t, ks, i, cnt, hi,
+                                                          MIN_KEYS(t)));
+        }
+        if (split_pos) {
+          debug(indent, "splitting leaf %hd at %hd for what follows",
+                n->id, split_pos);
+          (void)split_at(t, &path, n, split_pos, indent);
+        } else {
+          if (insert_in_node(t, &path, n, key_duplicate(t, ks[i]), NULL,
+                             NULL, NULL, indent) == 0) {
+            added++;
+          }
+          i++;
+        }
+        break;
+      }
+      free(hicopy);
+    }
+    if (btree_log(t)) {
+      // Keys that were already there too: replaying
+      // them changes nothing
+      for (i = 0; i < cnt; i++) {
+        if (log_append(t, LOG_INSERT, ks[i])) {
+          added = -1;
+        }
+      }
     }
-    return -1;
+    free(ks);
+    return added;
 }
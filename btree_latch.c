@@ -0,0 +1,228 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_latch.c
+ *
+ *  Latches for trees shared by threads.
+ *
+ *  When a tree is concurrent (btree_setconcurrent()), each node
+ *  has a latch that is also a version number: a single word
+ *  changed with atomic operations, whose lowest bit is set by
+ *  the writer that holds it and the next one when the node has
+ *  been freed; the other bits count the times the node has been
+ *  changed. A thread that can't get a latch yields the processor.
+ *  The pointer to the root has a latch of its own, that acts as
+ *  the parent of the root.
+ *
+ *  Writers take latches from the root down, by "crabbing": the
+ *  latch of a child is requested while the latch of its parent
+ *  is held, and the parent is released as soon as the operation
+ *  can no longer change it. Insertions and deletions run in
+ *  top-down mode, in which a node is split or refilled before
+ *  it's entered: once that is done, nothing will come back to
+ *  the parent, which is released. Siblings are only latched,
+ *  for a borrow or a merge, while their parent is held. Latches
+ *  are thus only waited for going down or sideways under a held
+ *  parent, never going up, and no thread can wait for another
+ *  one that waits for it.
+ *
+ *  Readers don't take latches, which would make every search
+ *  write to the latch of the root, and send the cache line that
+ *  holds it from processor to processor. They note the version
+ *  of a node (waiting if a writer holds it), read what they need
+ *  in it, then check that the version hasn't moved; the version
+ *  of a child is noted before the version of its parent is checked
+ *  again. When a check fails the search starts again from the root
+ *  ("optimistic lock coupling").
+ *  A reader may thus be looking at a node that a merge has just
+ *  freed: freed nodes are only given back to the arena once all
+ *  the threads that were reading at that time have finished.
+ *  Reading threads announce it in a slot of their own, with the
+ *  current "epoch", a counter that moves on each time a node is
+ *  freed; a freed node is tagged with the epoch, and can be used
+ *  again when every slot holds a later one, or none.
+ *
+ *  Outside of a concurrent tree, the node_xxx() and tree_xxx()
+ *  functions do nothing.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "btree.h"
+
+#define LATCH_WRITER    1U   // A writer holds it
+#define LATCH_OBSOLETE  2U   // The node has been freed
+#define LATCH_VERSION   4U   // Added by each writer
+
+extern void latch_wrlock(uint32_t *l) {
+    uint32_t s;
+
+    while (1) {
+      s = __atomic_load_n(l, __ATOMIC_RELAXED);
+      if (!(s & LATCH_WRITER)
+          && __atomic_compare_exchange_n(l, &s, s | LATCH_WRITER, 0,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED)) {
+        return;
+      }
+      sched_yield();
+    }
+}
+
+extern void latch_wrunlock(uint32_t *l) {
+    // Readers that noted the previous version will
+    // see that something changed
+    uint32_t s = __atomic_load_n(l, __ATOMIC_RELAXED);
+
+    __atomic_store_n(l, (s & ~LATCH_WRITER) + LATCH_VERSION,
+                     __ATOMIC_RELEASE);
+}
+
+extern void latch_obsolete(uint32_t *l) {
+    // The node of a held latch is freed, the latch is never
+    // released: readers that meet it start again
+    __atomic_store_n(l, LATCH_WRITER | LATCH_OBSOLETE, __ATOMIC_RELEASE);
+}
+
+extern int latch_version(uint32_t *l, uint32_t *vptr) {
+    // Notes in *vptr the version of a latch, once no writer
+    // holds it. Returns 0, -1 if the node has been freed.
+    uint32_t s;
+
+    while ((s = __atomic_load_n(l, __ATOMIC_ACQUIRE)) & LATCH_WRITER) {
+      if (s & LATCH_OBSOLETE) {
+        return -1;
+      }
+      sched_yield();
+    }
+    *vptr = s;
+    return 0;
+}
+
+extern int latch_check(uint32_t *l, uint32_t v) {
+    // Returns 0 if the latch is still at version v (what was
+    // read since latch_version() is consistent), -1 otherwise
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(l, __ATOMIC_RELAXED) == v ? 0 : -1);
+}
+
+extern void node_wrlock(BTREE_T *t, NODE_T *n) {
+    if (btree_concurrent(t)) {
+      latch_wrlock(&(n->latch));
+    }
+}
+
+extern void node_wrunlock(BTREE_T *t, NODE_T *n) {
+    if (btree_concurrent(t)) {
+      latch_wrunlock(&(n->latch));
+    }
+}
+
+extern void tree_wrlock(BTREE_T *t) {
+    if (btree_concurrent(t)) {
+      latch_wrlock(btree_rootlatch(t));
+    }
+}
+
+extern void tree_wrunlock(BTREE_T *t) {
+    if (btree_concurrent(t)) {
+      latch_wrunlock(btree_rootlatch(t));
+    }
+}
+
+// Epochs. Slots are shared by all trees, a thread takes one
+// the first time it reads and gives it back when it ends.
+#define EPOCH_SLOTS  256
+
+typedef union epoch_slot_t {
+          struct {
+            uint64_t epoch;   // 0 when the thread isn't reading
+            char     used;
+          } s;
+          char pad[64];       // One cache line each
+         } EPOCH_SLOT_T;
+
+static EPOCH_SLOT_T    G_slot[EPOCH_SLOTS];
+static uint64_t        G_epoch = 1;
+static pthread_key_t   G_slot_key;
+static pthread_once_t  G_slot_once = PTHREAD_ONCE_INIT;
+static __thread int    G_my_slot = -1;
+static __thread int    G_nested = 0;   // epoch_enter() calls
+
+static void slot_release(void *p) {
+    EPOCH_SLOT_T *slot = (EPOCH_SLOT_T *)p;
+
+    __atomic_store_n(&(slot->s.epoch), 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&(slot->s.used), 0, __ATOMIC_RELEASE);
+}
+
+static void slot_key_create(void) {
+    (void)pthread_key_create(&G_slot_key, slot_release);
+}
+
+static int slot_take(void) {
+    int  i;
+    char free_slot;
+
+    (void)pthread_once(&G_slot_once, slot_key_create);
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+      free_slot = 0;
+      if (__atomic_compare_exchange_n(&(G_slot[i].s.used), &free_slot, 1,
+                                      0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+        (void)pthread_setspecific(G_slot_key, &(G_slot[i]));
+        return i;
+      }
+    }
+    assert(0);   // More than EPOCH_SLOTS reading threads
+    return -1;
+}
+
+extern void epoch_enter(void) {
+    // The calling thread starts reading nodes, that must not
+    // be reused until it calls epoch_exit(). Calls may nest.
+    if (G_nested++ == 0) {
+      if (G_my_slot < 0) {
+        G_my_slot = slot_take();
+      }
+      __atomic_store_n(&(G_slot[G_my_slot].s.epoch),
+                       __atomic_load_n(&G_epoch, __ATOMIC_SEQ_CST),
+                       __ATOMIC_SEQ_CST);
+    }
+}
+
+extern void epoch_exit(void) {
+    assert(G_nested > 0);
+    if (--G_nested == 0) {
+      __atomic_store_n(&(G_slot[G_my_slot].s.epoch), 0, __ATOMIC_RELEASE);
+    }
+}
+
+extern uint64_t epoch_retire(void) {
+    // Epoch to tag a node that has just been freed with,
+    // the next readers get a later one
+    return __atomic_fetch_add(&G_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+extern uint64_t epoch_oldest(void) {
+    // Oldest epoch of a reading thread (UINT64_MAX if
+    // none reads): nodes tagged with an earlier one
+    // can be used again
+    uint64_t oldest = UINT64_MAX;
+    uint64_t e;
+    int      i;
+
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+      if (__atomic_load_n(&(G_slot[i].s.used), __ATOMIC_ACQUIRE)) {
+        e = __atomic_load_n(&(G_slot[i].s.epoch), __ATOMIC_SEQ_CST);
+        if (e && (e < oldest)) {
+          oldest = e;
+        }
+      }
+    }
+    return oldest;
+}
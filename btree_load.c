@@ -0,0 +1,306 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_load.c
+ *
+ *  Building a tree from keys that come sorted.
+ *
+ *  Instead of inserting keys one by one, which means a descent
+ *  from the root and sometimes splits for each key, nodes are
+ *  filled from left to right, leaves first. When a node holds
+ *  the wanted number of keys, the next key goes up into the
+ *  level above, where it separates the complete node from a new
+ *  one that receives what follows. Only the rightmost node of
+ *  each level (the "right edge") is ever being filled.
+ *  At the end, the nodes of the right edge that don't hold the
+ *  minimum number of keys borrow keys from their left sibling,
+ *  or are merged with it.
+ *  In B+tree mode, the key that follows a complete leaf starts
+ *  the next one, and only a copy of it goes up.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define LOAD_MAXLEVELS  64
+
+typedef struct load_t {
+          BTREE_T *t;
+          short    fill;    // Number of keys in a complete node
+          short    levels;
+          NODE_T  *edge[LOAD_MAXLEVELS];  // Rightmost node of each
+                                          // level, leaves at 0
+         } LOAD_T;
+
+static int load_key(LOAD_T *ld, short lvl,
+                    char *key, void *value, NODE_T *bigger) {
+    // Adds the key (already duplicated) to the right edge at
+    // level lvl; bigger is the subtree on its right.
+    // Returns -1 if the tree becomes too high.
+    BTREE_T *t = ld->t;
+    NODE_T  *n = ld->edge[lvl];
+    NODE_T  *next;
+
+    if (n->keycnt < ld->fill) {
+      (n->keycnt)++;
+      key_store(t, n, n->keycnt, key);
+      n->k[n->keycnt].value = value;
+      n->k[n->keycnt].bigger = bigger;
+      return 0;
+    }
+    // The node is complete
+    if (lvl + 1 == ld->levels) {
+      // It was the root, a new one goes on top of it
+      if (ld->levels == LOAD_MAXLEVELS) {
+        return -1;
+      }
+      ld->edge[lvl+1] = new_node(t);
+      ld->edge[lvl+1]->k[0].bigger = n;
+      (ld->levels)++;
+    }
+    next = new_node(t);
+    next->k[0].bigger = bigger;
+    ld->edge[lvl] = next;
+    if ((lvl == 0) && btree_plus(t)) {
+      // The key stays in the new leaf, the separator
+      // above it is a copy
+      n->next = next;
+      next->prev = n;
+      next->keycnt = 1;
+      key_store(t, next, 1, key);
+      next->k[1].value = value;
+      return load_key(ld, 1, key, NULL, next);
+    }
+    return load_key(ld, lvl + 1, key, value, next);
+}
+
+static void load_rotate(BTREE_T *t, NODE_T *p, NODE_T *n) {
+    // n is the last child of its parent p. The parent key
+    // that precedes it comes down into n and is replaced by
+    // the greatest key of the left sibling.
+    NODE_T *l = p->k[p->keycnt - 1].bigger;
+
+    if (btree_plus(t) && _is_leaf(n)) {
+      // The key moves from leaf to leaf, the separator
+      // becomes a copy of it
+      slot_move(t, n, 2, n, 1, n->keycnt);
+      key_transfer(t, n, 1, l, l->keycnt);
+      (n->keycnt)++;
+      slot_clear(t, l, l->keycnt, 1);
+      (l->keycnt)--;
+      separator_set(t, p, p->keycnt, n);
+      return;
+    }
+    slot_move(t, n, 1, n, 0, n->keycnt + 1);
+    key_transfer(t, n, 1, p, p->keycnt);
+    slot_clear(t, n, 0, 1);
+    n->k[0].bigger = l->k[l->keycnt].bigger;
+    (n->keycnt)++;
+    key_transfer(t, p, p->keycnt, l, l->keycnt);
+    slot_clear(t, l, l->keycnt, 1);
+    (l->keycnt)--;
+}
+
+static NODE_T *load_merge(BTREE_T *t, NODE_T *p, NODE_T *n) {
+    // n is the last child of its parent p. Appends the parent
+    // key that precedes it, then its content, to the left
+    // sibling and releases it. Returns the left sibling.
+    NODE_T *l = p->k[p->keycnt - 1].bigger;
+
+    if (btree_plus(t) && _is_leaf(n)) {
+      // The separator just goes
+      assert(l->keycnt + n->keycnt <= btree_maxkeys(t));
+      slot_clear(t, p, p->keycnt, 1);
+      (p->keycnt)--;
+      slot_move(t, l, l->keycnt + 1, n, 1, n->keycnt);
+      l->keycnt += n->keycnt;
+      l->next = NULL;
+      node_free(t, n);
+      return l;
+    }
+    assert(l->keycnt + 1 + n->keycnt <= btree_maxkeys(t));
+    key_transfer(t, l, l->keycnt + 1, p, p->keycnt);
+    l->k[l->keycnt + 1].bigger = n->k[0].bigger;
+    slot_clear(t, p, p->keycnt, 1);
+    (p->keycnt)--;
+    slot_move(t, l, l->keycnt + 2, n, 1, n->keycnt);
+    l->keycnt += 1 + n->keycnt;
+    node_free(t, n);
+    return l;
+}
+
+static void load_finish(LOAD_T *ld) {
+    // Gives the right edge the minimum number of keys
+    // and installs the root
+    BTREE_T *t = ld->t;
+    NODE_T  *n;
+    short    lvl;
+    short    need;
+
+    // A node of the right edge may have received a child and
+    // no key yet. Going down, borrow one key for it from the
+    // left, so that every node below has a left sibling under
+    // the same parent. The parent of a node of the right
+    // edge is the node of the edge one level up.
+    for (lvl = ld->levels - 2; lvl >= 0; lvl--) {
+      if (ld->edge[lvl]->keycnt == 0) {
+        load_rotate(t, ld->edge[lvl+1], ld->edge[lvl]);
+      }
+    }
+    // Going up, complete the nodes that are short of keys.
+    // Complete nodes hold at least one key more than the
+    // minimum, so a left sibling either can spare the keys
+    // or is small enough for a merge.
+    for (lvl = 0; lvl < ld->levels - 1; lvl++) {
+      n = ld->edge[lvl];
+      if (n->keycnt < MIN_KEYS(t)) {
+        NODE_T *p = ld->edge[lvl+1];
+        NODE_T *l = p->k[p->keycnt - 1].bigger;
+
+        need = MIN_KEYS(t) - n->keycnt;
+        if (l->keycnt - need >= MIN_KEYS(t)) {
+          debug(lvl, "node %hd borrows %hd key%s from node %hd",
+                n->id, need, (need > 1 ? "s" : ""), l->id);
+          while (need--) {
+            load_rotate(t, p, n);
+          }
+        } else {
+          debug(lvl, "node %hd merged into node %hd", n->id, l->id);
+          ld->edge[lvl] = load_merge(t, p, n);
+        }
+      }
+    }
+    // Merges may have emptied the top
+    n = ld->edge[ld->levels - 1];
+    while ((n->keycnt == 0) && !_is_leaf(n)) {
+      ld->edge[--(ld->levels)] = NULL;
+      ld->edge[ld->levels - 1] = n->k[0].bigger;
+      node_free(t, n);
+      n = ld->edge[ld->levels - 1];
+    }
+    if (n->keycnt == 0) {
+      node_free(t, n);
+      n = NULL;
+    }
+    btree_setroot(t, n);
+}
+
+extern int btree_load(BTREE_T *t,
+                      char *(*next)(void *ctx, void **valptr),
+                      void *ctx) {
+    // Builds the tree from the keys (and values) returned by
+    // next() in ascending order, until it returns NULL.
+    // The tree must be empty. Duplicate keys are ignored,
+    // as well as invalid numeric keys; the tree releases
+    // their values if it owns values.
+    // Returns the number of keys loaded, -1 if keys aren't
+    // sorted or can't be logged (the tree is then left empty).
+    LOAD_T    ld;
+    KEYBUF_T  val;
+    KEYBUF_T  last_val;
+    char     *last = NULL;
+    char     *last_copy = NULL;  // Compressed keys
+    size_t    last_size = 0;
+    char     *key;
+    char     *k;
+    void     *value;
+    int       cmp;
+    int       cnt = 0;
+
+    assert(t);
+    if (btree_root(t)) {
+      return -1;
+    }
+    page_touch(t);
+    ld.t = t;
+    ld.fill = (short)(btree_maxkeys(t) * btree_loadrate(t) + 0.5);
+    // One key more than the minimum in complete nodes, so
+    // that the last ones can be completed at the end
+    if (ld.fill <= MIN_KEYS(t)) {
+      ld.fill = MIN_KEYS(t) + 1;
+    }
+    if (ld.fill > btree_maxkeys(t)) {
+      ld.fill = btree_maxkeys(t);
+    }
+    debug(0, "bulk load, %hd keys per node", ld.fill);
+    ld.levels = 1;
+    ld.edge[0] = new_node(t);
+    value = NULL;
+    while ((key = next(ctx, &value)) != NULL) {
+      if ((k = key_parse(t, key, &val)) == NULL) {
+        fprintf(stderr, "%s: invalid numeric value\n", key);
+        value_free(t, value);
+        value = NULL;
+        continue;
+      }
+      if (value && btree_file(t)) {
+        // Values can't be kept in a file
+        value_free(t, value);
+        value = NULL;
+      }
+      if (last && ((cmp = btree_keycmp(t, k, last)) <= 0)) {
+        if (cmp < 0) {
+          char buf1[KEY_TEXTLEN];
+          char buf2[KEY_TEXTLEN];
+
+          debug(0, "bulk load: %s after %s", key_text(t, k, buf1),
+                   key_text(t, last, buf2));
+          value_free(t, value);
+          btree_setroot(t, ld.edge[ld.levels - 1]);
+          btree_clear(t);
+          free(last_copy);
+          return -1;
+        }
+        value_free(t, value);
+        value = NULL;
+        continue;
+      }
+      k = key_duplicate(t, k);
+      if (load_key(&ld, 0, k, value, NULL)) {
+        // More than LOAD_MAXLEVELS levels
+        value_free(t, value);
+        btree_setroot(t, ld.edge[ld.levels - 1]);
+        btree_clear(t);
+        free(last_copy);
+        return -1;
+      }
+      if (btree_log(t) && log_append(t, LOG_INSERT, k)) {
+        // Emptied with the tree
+        btree_setroot(t, ld.edge[ld.levels - 1]);
+        btree_clear(t);
+        free(last_copy);
+        return -1;
+      }
+      if (btree_keysize(t)) {
+        memcpy(&last_val, k, btree_keysize(t));
+        last = (char *)&last_val;
+      } else if (btree_prefix(t)) {
+        // Not duplicated, what next() returned may be reused
+        if (strlen(k) >= last_size) {
+          last_size = strlen(k) + 1;
+          last_copy = (char *)realloc(last_copy, last_size);
+          assert(last_copy);
+        }
+        last = strcpy(last_copy, k);
+      } else {
+        last = k;
+      }
+      cnt++;
+      value = NULL;
+    }
+    load_finish(&ld);
+    free(last_copy);
+    if (btree_prefix(t)) {
+      // Keys were stored whole, nodes can now get their
+      // prefix, then the full copies go
+      pfx_fit_tree(t, btree_root(t), NULL, NULL);
+      btree_compact(t);
+    }
+    debug(0, "bulk load: %d keys", cnt);
+    return cnt;
+}
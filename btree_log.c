@@ -0,0 +1,486 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_log.c
+ *
+ *  Write-ahead log of the changes made to a tree.
+ *
+ *  A tree in memory is lost with the program. btree_openlog()
+ *  ties it to a log file where every key inserted or deleted is
+ *  appended as a record: the op, the key as the tree stores it
+ *  (binary for numeric keys) and a checksum (CRC-32C) of both.
+ *  When the log is opened, the records it already holds are
+ *  replayed into the tree, in order, up to the first one that is
+ *  incomplete or whose checksum is wrong (what a crash in the
+ *  middle of a write leaves); what follows is cut off.
+ *
+ *  Records are collected in a buffer and written in one go. A
+ *  change is durable once the log has been flushed to disk
+ *  (fdatasync()), which is done every group records (group
+ *  commit): with a group of 1, every change waits for its record
+ *  to be on disk, with a larger group one flush covers many
+ *  changes and up to group - 1 of them may be lost in a crash.
+ *  In a concurrent tree, the thread whose record ends a group
+ *  flushes everything appended so far, while the other threads
+ *  go on appending; those that must wait for durability wait
+ *  for the flush in progress, which often covers them.
+ *
+ *  If a write or a flush fails, the records that may not be on
+ *  disk are the ones the error is reported for, and a record
+ *  cut by a failed write is removed; nothing is logged any more
+ *  until the log is emptied, changes are reported as failed.
+ *
+ *  Changes of the same key are logged in the order they are
+ *  made: in a concurrent tree, a change and its record are made
+ *  under one of LOG_STRIPES locks, chosen by the key. Changes of
+ *  different keys don't depend on each other.
+ *
+ *  Values aren't logged (they belong to the program): a key
+ *  put with a value is logged as an insertion.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC_X86
+#include <nmmintrin.h>
+#endif
+
+#define LOG_MAGIC    "BTREELG1"
+#define LOG_HDRSIZE  16          // Magic and key type
+#define LOG_BUFSIZE  (64 * 1024)
+#define LOG_STRIPES  64
+
+// Header of a record, followed by the key
+typedef struct log_rec_t {
+          uint32_t  crc;    // Of what follows
+          uint32_t  len;    // Of the key
+          char      op;     // LOG_INSERT, LOG_DELETE
+          char      pad[3];
+         } LOG_REC_T;
+
+struct log_t {
+          int              fd;
+          int              group;     // Records per flush
+          char            *buf;
+          size_t           buflen;
+          uint64_t         appended;  // Records appended
+          uint64_t         synced;    // Records on disk
+          off_t            end;       // Of the last record written
+          char             syncing;   // Flush in progress
+          char             err;       // A write or flush failed
+          uint64_t         flushes;
+          pthread_mutex_t  mx;
+          pthread_cond_t   done;      // Flush finished
+          pthread_mutex_t  stripe[LOG_STRIPES];
+         };
+
+static uint32_t G_crctab[256];
+static uint32_t (*G_crc)(uint32_t crc, const char *p, size_t len) = NULL;
+
+static uint32_t table_crc(uint32_t crc, const char *p, size_t len) {
+    const unsigned char *q = (const unsigned char *)p;
+
+    while (len--) {
+      crc = G_crctab[(crc ^ *q++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t sse42_crc(uint32_t crc, const char *p, size_t len) {
+    // The same polynomial, 8 bytes per instruction
+    uint64_t v;
+
+    while (len >= sizeof(v)) {
+      memcpy(&v, p, sizeof(v));
+      crc = (uint32_t)_mm_crc32_u64(crc, v);
+      p += sizeof(v);
+      len -= sizeof(v);
+    }
+    while (len--) {
+      crc = _mm_crc32_u8(crc, (unsigned char)*p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc_init(void) {
+    uint32_t c;
+    int      i;
+    int      j;
+
+    for (i = 0; i < 256; i++) {
+      c = (uint32_t)i;
+      for (j = 0; j < 8; j++) {
+        c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+      }
+      G_crctab[i] = c;
+    }
+    G_crc = table_crc;
+#ifdef CRC_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+      G_crc = sse42_crc;
+    }
+#endif
+}
+
+extern uint32_t crc32c(uint32_t crc, const char *p, size_t len) {
+    // Adds len bytes to a CRC-32C, that starts from 0xFFFFFFFF
+    // and is complemented at the end. Also used by snapshots.
+    if (G_crc == NULL) {
+      crc_init();
+    }
+    return G_crc(crc, p, len);
+}
+
+static uint32_t rec_crc(LOG_REC_T *r, const char *key) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    crc = crc32c(crc, (char *)&(r->len), sizeof(r->len) + sizeof(r->op));
+    return ~crc32c(crc, key, r->len);
+}
+
+static uint32_t key_len(BTREE_T *t, char *k) {
+    // Size of a key as the tree stores it
+    if (btree_keysize(t)) {
+      return (uint32_t)btree_keysize(t);
+    }
+    if (btree_keytype(t) == BTREE_BYTES) {
+      return (uint32_t)BYTES_SIZE(k);
+    }
+    return (uint32_t)strlen(k);
+}
+
+static int log_write(LOG_T *l, const char *p, size_t len) {
+    // What is written after l->end is removed if it fails
+    ssize_t w;
+
+    while (len) {
+      if ((w = write(l->fd, p, len)) < 0) {
+        perror("log write");
+        l->err = 1;
+        if (ftruncate(l->fd, l->end)
+            || (lseek(l->fd, l->end, SEEK_SET) < 0)) {
+          perror("log write");
+        }
+        return -1;
+      }
+      p += w;
+      len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int log_flush(LOG_T *l, uint64_t upto) {
+    // Called with the mutex held: writes the buffer, then
+    // waits until record upto is on disk, flushing if no
+    // other thread is doing it. Returns -1 if it may not be
+    // on disk.
+    while (l->synced < upto) {
+      if (l->err) {
+        return -1;
+      }
+      if (l->syncing) {
+        pthread_cond_wait(&(l->done), &(l->mx));
+      } else {
+        uint64_t target = l->appended;
+
+        if (log_write(l, l->buf, l->buflen)) {
+          l->buflen = 0;
+          return -1;
+        }
+        l->end += (off_t)l->buflen;
+        l->buflen = 0;
+        l->syncing = 1;
+        pthread_mutex_unlock(&(l->mx));
+        if (fdatasync(l->fd)) {
+          perror("log fdatasync");
+          pthread_mutex_lock(&(l->mx));
+          l->err = 1;
+        } else {
+          pthread_mutex_lock(&(l->mx));
+          l->synced = target;
+        }
+        l->syncing = 0;
+        l->flushes++;
+        pthread_cond_broadcast(&(l->done));
+      }
+    }
+    return 0;
+}
+
+static int log_replay(BTREE_T *t, int fd, const char *path, off_t size) {
+    // Applies the records of the log, and cuts off what
+    // follows the last valid one. Returns the number of
+    // records, -1 if the file can't be read.
+    char      *map;
+    char      *key = NULL;
+    size_t     keysize = 0;
+    LOG_REC_T  r;
+    off_t      off = LOG_HDRSIZE;
+    int        cnt = 0;
+
+    if (size == LOG_HDRSIZE) {
+      return 0;
+    }
+    if ((map = (char *)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE,
+                            fd, 0)) == MAP_FAILED) {
+      perror(path);
+      return -1;
+    }
+    (void)madvise(map, (size_t)size, MADV_SEQUENTIAL);
+    while (off + (off_t)sizeof(r) <= size) {
+      memcpy(&r, map + off, sizeof(r));
+      if ((r.len > (uint64_t)(size - off - (off_t)sizeof(r)))
+          || ((r.op != LOG_INSERT) && (r.op != LOG_DELETE))
+          || (rec_crc(&r, map + off + sizeof(r)) != r.crc)) {
+        break;
+      }
+      // Copied where it's aligned, and can end with '\0'
+      if (r.len + sizeof(KEYBUF_T) > keysize) {
+        keysize = r.len + sizeof(KEYBUF_T);
+        key = (char *)realloc(key, keysize);
+        assert(key);
+      }
+      memcpy(key, map + off + sizeof(r), r.len);
+      key[r.len] = '\0';
+      if (r.op == LOG_INSERT) {
+        (void)key_insert(t, key, NULL, 0);
+      } else if (btree_concurrent(t) || btree_root(t)) {
+        (void)key_delete(t, key);
+      }
+      cnt++;
+      off += (off_t)(sizeof(r) + r.len);
+    }
+    free(key);
+    munmap(map, (size_t)size);
+    if (off < size) {
+      fprintf(stderr, "%s: %ld bytes of incomplete records dropped\n",
+              path, (long)(size - off));
+      if (ftruncate(fd, off)) {
+        perror(path);
+        return -1;
+      }
+    }
+    debug(0, "%s: %d records replayed", path, cnt);
+    return cnt;
+}
+
+extern int btree_openlog(BTREE_T *t, const char *path, int group) {
+    // Logs the changes of the tree in the file at path,
+    // created if needed with the key type of the tree; the
+    // changes it already records are applied to the tree
+    // first. The log is flushed to disk every group records
+    // (1 if group is less). Trees in files (btree_open())
+    // can't have a log: btree_sync() makes them durable.
+    // Returns the number of changes replayed, -1 if the log
+    // can't be used.
+    LOG_T       *l;
+    struct stat  st;
+    char         hdr[LOG_HDRSIZE];
+    int          fd;
+    int          cnt;
+    int          i;
+
+    assert(t && path);
+    if (btree_log(t) || btree_file(t)) {
+      fprintf(stderr, "%s: the tree already %s\n", path,
+              (btree_file(t) ? "is in a file" : "has a log"));
+      return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+      perror(path);
+      return -1;
+    }
+    if (fstat(fd, &st)) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    if (st.st_size == 0) {
+      memset(hdr, 0, sizeof(hdr));
+      memcpy(hdr, LOG_MAGIC, strlen(LOG_MAGIC));
+      hdr[strlen(LOG_MAGIC)] = btree_keytype(t);
+      if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        perror(path);
+        close(fd);
+        return -1;
+      }
+      st.st_size = LOG_HDRSIZE;
+    } else if ((st.st_size < LOG_HDRSIZE)
+               || (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+               || memcmp(hdr, LOG_MAGIC, strlen(LOG_MAGIC))) {
+      fprintf(stderr, "%s: not a log\n", path);
+      close(fd);
+      return -1;
+    } else if (hdr[strlen(LOG_MAGIC)] != btree_keytype(t)) {
+      fprintf(stderr, "%s: log of another key type\n", path);
+      close(fd);
+      return -1;
+    }
+    if ((cnt = log_replay(t, fd, path, st.st_size)) < 0) {
+      close(fd);
+      return -1;
+    }
+    if ((st.st_size = lseek(fd, 0, SEEK_END)) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    l = (LOG_T *)malloc(sizeof(LOG_T));
+    assert(l);
+    l->fd = fd;
+    l->group = (group < 1 ? 1 : group);
+    l->buf = (char *)malloc(LOG_BUFSIZE);
+    assert(l->buf);
+    l->buflen = 0;
+    l->appended = 0;
+    l->synced = 0;
+    l->end = st.st_size;
+    l->syncing = 0;
+    l->err = 0;
+    l->flushes = 0;
+    pthread_mutex_init(&(l->mx), NULL);
+    pthread_cond_init(&(l->done), NULL);
+    for (i = 0; i < LOG_STRIPES; i++) {
+      pthread_mutex_init(&(l->stripe[i]), NULL);
+    }
+    btree_setlog(t, l);
+    return cnt;
+}
+
+static pthread_mutex_t *key_stripe(BTREE_T *t, char *k) {
+    // FNV-1a of the key
+    uint32_t  h = 2166136261u;
+    uint32_t  len = key_len(t, k);
+    uint32_t  i;
+
+    for (i = 0; i < len; i++) {
+      h = (h ^ (unsigned char)k[i]) * 16777619u;
+    }
+    return &(btree_log(t)->stripe[h % LOG_STRIPES]);
+}
+
+extern void log_lock(BTREE_T *t, char *k) {
+    // Only needed when threads share the tree
+    if (btree_concurrent(t)) {
+      pthread_mutex_lock(key_stripe(t, k));
+    }
+}
+
+extern void log_unlock(BTREE_T *t, char *k) {
+    if (btree_concurrent(t)) {
+      pthread_mutex_unlock(key_stripe(t, k));
+    }
+}
+
+extern int log_append(BTREE_T *t, char op, char *k) {
+    // Records a change, and returns once it is durable if
+    // it ends a group. Returns -1 if it isn't logged, or if
+    // it ends a group that couldn't be made durable.
+    LOG_T     *l = btree_log(t);
+    LOG_REC_T  r;
+    uint64_t   rec;
+    int        ret = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.len = key_len(t, k);
+    r.op = op;
+    r.crc = rec_crc(&r, k);
+    pthread_mutex_lock(&(l->mx));
+    if (l->buflen + sizeof(r) + r.len > LOG_BUFSIZE) {
+      if (!l->err && (log_write(l, l->buf, l->buflen) == 0)) {
+        l->end += (off_t)l->buflen;
+      }
+      l->buflen = 0;
+    }
+    if (l->err) {
+      pthread_mutex_unlock(&(l->mx));
+      return -1;
+    }
+    if (sizeof(r) + r.len > LOG_BUFSIZE) {
+      // Too big for the buffer
+      if (log_write(l, (char *)&r, sizeof(r))
+          || log_write(l, k, r.len)) {
+        pthread_mutex_unlock(&(l->mx));
+        return -1;
+      }
+      l->end += (off_t)(sizeof(r) + r.len);
+    } else {
+      memcpy(l->buf + l->buflen, &r, sizeof(r));
+      memcpy(l->buf + l->buflen + sizeof(r), k, r.len);
+      l->buflen += sizeof(r) + r.len;
+    }
+    rec = ++(l->appended);
+    if (rec - l->synced >= (uint64_t)l->group) {
+      ret = log_flush(l, rec);
+    }
+    pthread_mutex_unlock(&(l->mx));
+    return ret;
+}
+
+extern int log_sync(BTREE_T *t) {
+    // Everything logged is on disk when it returns 0, -1
+    // if it may not be
+    LOG_T *l = btree_log(t);
+    int    ret;
+
+    pthread_mutex_lock(&(l->mx));
+    ret = log_flush(l, l->appended);
+    if (l->err) {
+      ret = -1;
+    }
+    pthread_mutex_unlock(&(l->mx));
+    return ret;
+}
+
+extern void log_reset(BTREE_T *t) {
+    // The tree has been emptied: so is the log
+    LOG_T *l = btree_log(t);
+
+    pthread_mutex_lock(&(l->mx));
+    l->buflen = 0;
+    if (ftruncate(l->fd, LOG_HDRSIZE) || (lseek(l->fd, 0, SEEK_END) < 0)
+        || fdatasync(l->fd)) {
+      perror("log reset");
+      l->err = 1;
+    } else {
+      // Records lost by an error were of the old tree
+      l->end = LOG_HDRSIZE;
+      l->err = 0;
+    }
+    l->synced = l->appended;
+    pthread_mutex_unlock(&(l->mx));
+}
+
+extern void log_close(BTREE_T *t) {
+    // Flushes the log and detaches it from the tree
+    LOG_T *l = btree_log(t);
+    int    i;
+
+    (void)log_sync(t);
+    debug(0, "log closed, %lu records, %lu flushes",
+          (unsigned long)l->appended, (unsigned long)l->flushes);
+    close(l->fd);
+    pthread_mutex_destroy(&(l->mx));
+    pthread_cond_destroy(&(l->done));
+    for (i = 0; i < LOG_STRIPES; i++) {
+      pthread_mutex_destroy(&(l->stripe[i]));
+    }
+    free(l->buf);
+    free(l);
+    btree_setlog(t, NULL);
+}
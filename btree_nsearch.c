@@ -0,0 +1,341 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_nsearch.c
+ *
+ *  Finding the position of a key inside a node, and the node
+ *  where a key is (or should go) inside a tree.
+ *
+ *  Every search, insertion or deletion asks each node on its
+ *  way down where a key is, or should go. Three strategies:
+ *   - linear: the historical loop (with vector kernels for
+ *     integer keys), best for small nodes,
+ *   - binary: branchless binary search, the loop only moves
+ *     a base pointer with a conditional move, so there are
+ *     no mispredicted branches,
+ *   - interpolation: guesses the position from the values at
+ *     both ends of the node then walks to it, best when numeric
+ *     keys are evenly spread.
+ *  Unless forced, the strategy is chosen from the maximum number
+ *  of keys per node and the key type (see btree_setnodesearch()).
+ *
+ *  The functions that scan a node and descend the tree are
+ *  generated once per key type by the macros below, with the
+ *  comparison written in place: the key type is tested once
+ *  per operation, not once per comparison.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "debug.h"
+
+// Length-prefixed keys: compare the common part,
+// then the shorter key is the smaller one
+static inline int bytes_cmp(char *k1, char *k2) {
+    uint16_t len1 = BYTES_LEN(k1);
+    uint16_t len2 = BYTES_LEN(k2);
+    int      cmp;
+
+    cmp = memcmp(BYTES_DATA(k1), BYTES_DATA(k2),
+                 (len1 < len2 ? len1 : len2));
+    if (cmp == 0) {
+      cmp = (len1 > len2) - (len1 < len2);
+    }
+    return cmp;
+}
+
+extern int key_bytescmp(char *k1, char *k2) {
+    // For btree_keycmp()
+    return bytes_cmp(k1, k2);
+}
+
+static inline short linear_double(double *keys, short cnt, double key) {
+    short i = 0;
+
+    while ((i < cnt) && (keys[i] < key)) {
+      i++;
+    }
+    return i;
+}
+
+// Numeric keys, stored inline in n->nk. The binary_xxx()
+// and interp_xxx() functions return, like the linear ones,
+// the number of keys in the (sorted) array smaller than key.
+#define NUM_NSEARCH(suffix, type, LINEAR)                           \
+static inline short binary_##suffix(type *keys, short cnt,          \
+                                    type key) {                     \
+    type  *base = keys;                                             \
+    short  half;                                                    \
+                                                                    \
+    if (cnt == 0) {                                                 \
+      return 0;                                                     \
+    }                                                               \
+    while (cnt > 1) {                                               \
+      half = cnt / 2;                                               \
+      base = (base[half] < key) ? base + half : base;               \
+      cnt -= half;                                                  \
+    }                                                               \
+    return (short)(base - keys) + (*base < key);                    \
+}                                                                   \
+                                                                    \
+static inline short interp_##suffix(type *keys, short cnt,          \
+                                    type key) {                     \
+    short  i;                                                       \
+                                                                    \
+    if ((cnt == 0) || (key <= keys[0])) {                           \
+      return 0;                                                     \
+    }                                                               \
+    if (key > keys[cnt-1]) {                                        \
+      return cnt;                                                   \
+    }                                                               \
+    /* keys[0] < key <= keys[cnt-1], guess then adjust */           \
+    i = (short)(((double)key - (double)keys[0])                     \
+                / ((double)keys[cnt-1] - (double)keys[0])           \
+                * (cnt - 1));                                       \
+    if (i < 0) {                                                    \
+      i = 0;                                                        \
+    } else if (i >= cnt) {                                          \
+      i = cnt - 1;                                                  \
+    }                                                               \
+    while ((i > 0) && (keys[i-1] >= key)) {                         \
+      i--;                                                          \
+    }                                                               \
+    while ((i < cnt) && (keys[i] < key)) {                          \
+      i++;                                                          \
+    }                                                               \
+    return i;                                                       \
+}                                                                   \
+                                                                    \
+static inline short node_search_##suffix(char strategy, NODE_T *n,  \
+                                         char *key, int *cmpptr) {  \
+    type  *keys = (type *)(n->nk) + 1;                              \
+    type   k = *((type *)key);                                      \
+    short  less;                                                    \
+                                                                    \
+    if (strategy == NSEARCH_BINARY) {                               \
+      less = binary_##suffix(keys, n->keycnt, k);                   \
+    } else if (strategy == NSEARCH_INTERP) {                        \
+      less = interp_##suffix(keys, n->keycnt, k);                   \
+    } else {                                                        \
+      less = LINEAR(keys, n->keycnt, k);                            \
+    }                                                               \
+    if (less < n->keycnt) {                                         \
+      *cmpptr = (keys[less] == k) ? 0 : -1;                         \
+    } else {                                                        \
+      *cmpptr = 1;                                                  \
+    }                                                               \
+    return less + 1;                                                \
+}
+
+// Keys referenced from the slots (strings, length-prefixed)
+#define PTR_NSEARCH(suffix, CMP)                                    \
+static inline short node_search_##suffix(char strategy, NODE_T *n,  \
+                                         char *key, int *cmpptr) {  \
+    short pos = 1;                                                  \
+    short cnt = n->keycnt;                                          \
+    short half;                                                     \
+    int   cmp = 1;                                                  \
+                                                                    \
+    if (strategy == NSEARCH_LINEAR) {                               \
+      while ((pos <= cnt)                                           \
+             && ((cmp = CMP(key, n->k[pos].key)) > 0)) {            \
+        pos++;                                                      \
+      }                                                             \
+    } else if (cnt) {                                               \
+      while (cnt > 1) {                                             \
+        half = cnt / 2;                                             \
+        pos = (CMP(key, n->k[pos + half].key) > 0) ?                \
+              pos + half : pos;                                     \
+        cnt -= half;                                                \
+      }                                                             \
+      if ((cmp = CMP(key, n->k[pos].key)) > 0) {                    \
+        pos++;                                                      \
+        if (pos <= n->keycnt) {                                     \
+          cmp = CMP(key, n->k[pos].key);                            \
+        }                                                           \
+      }                                                             \
+    }                                                               \
+    *cmpptr = cmp;                                                  \
+    return pos;                                                     \
+}
+
+// Going down from node n to the node that contains the key
+// or, if the key isn't in the tree, to the leaf where it
+// should be inserted. In B+tree mode (plus set) keys are all
+// in leaves and a key equal to a separator is on its right.
+// The nodes left behind are pushed onto path, if not NULL.
+#define DESCEND(suffix)                                             \
+static NODE_T *descend_##suffix(BTREE_T *t, char strategy,          \
+                                char plus, NODE_T *n, char *key,    \
+                                short *posptr, int *cmpptr,         \
+                                short *lvlptr, PATH_T *path) {      \
+    short pos;                                                      \
+    int   cmp;                                                      \
+    short lvl = *lvlptr;                                            \
+                                                                    \
+    for (;;) {                                                      \
+      if (debugging()) {                                            \
+        debug_no_nl(lvl, "searching node %hd: ", n->id);            \
+        btree_show_node(t, n);                                      \
+      }                                                             \
+      pos = node_search_##suffix(strategy, n, key, &cmp);           \
+      if (_is_leaf(n) || ((cmp == 0) && !plus)) {                   \
+        break;                                                      \
+      }                                                             \
+      if (cmp) {                                                    \
+        pos--;                                                      \
+      }                                                             \
+      if (path) {                                                   \
+        path_push(path, n, pos);                                    \
+      }                                                             \
+      n = n->k[pos].bigger;                                         \
+      lvl += 2;                                                     \
+    }                                                               \
+    *posptr = pos;                                                  \
+    *cmpptr = cmp;                                                  \
+    *lvlptr = lvl;                                                  \
+    return n;                                                       \
+}
+
+NUM_NSEARCH(int32, int32_t, simd_count_less32)
+NUM_NSEARCH(int64, int64_t, simd_count_less64)
+NUM_NSEARCH(double, double, linear_double)
+PTR_NSEARCH(string, strcmp)
+PTR_NSEARCH(bytes, bytes_cmp)
+
+// Prefix-compressed strings: the key is compared once with
+// the node prefix, then only what follows with the suffixes
+static inline short node_search_prefix(char strategy, NODE_T *n,
+                                       char *key, int *cmpptr) {
+    int cmp = (n->pfxlen ? strncmp(key, n->pfx, n->pfxlen) : 0);
+
+    if (cmp < 0) {
+      *cmpptr = -1;
+      return 1;
+    }
+    if (cmp > 0) {
+      *cmpptr = 1;
+      return n->keycnt + 1;
+    }
+    return node_search_string(strategy, n, key + n->pfxlen, cmpptr);
+}
+
+DESCEND(int32)
+DESCEND(int64)
+DESCEND(double)
+DESCEND(string)
+DESCEND(bytes)
+DESCEND(prefix)
+
+extern char nsearch_choose(char keytype, short maxkeys) {
+    // What NSEARCH_AUTO means for a given configuration.
+    // Thresholds come from timing random lookups in trees of
+    // 300,000 keys. The linear scan stays ahead longer with
+    // strings because it reads keys in order; the binary
+    // search wins with numbers as soon as nodes are a little big.
+    switch (keytype) {
+      case BTREE_INT32:
+      case BTREE_DOUBLE:
+        return (maxkeys <= 16 ? NSEARCH_LINEAR : NSEARCH_BINARY);
+      case BTREE_INT64:
+        return (maxkeys <= 32 ? NSEARCH_LINEAR : NSEARCH_BINARY);
+      default:
+        return (maxkeys <= 128 ? NSEARCH_LINEAR : NSEARCH_BINARY);
+    }
+}
+
+extern short node_search(BTREE_T *t, NODE_T *n, char *key, int *cmpptr) {
+    // Returns the position of the first key in the node that
+    // is greater than or equal to key, keycnt + 1 if there is
+    // none. *cmpptr is set to 0 if the key is at this position,
+    // to a value < 0 if the key there is bigger and to a value
+    // > 0 if we are past the last key.
+    short pos;
+    int   cmp;
+    char  strategy = btree_nodesearch(t);
+
+    switch (btree_keytype(t)) {
+      case BTREE_INT32:
+        pos = node_search_int32(strategy, n, key, &cmp);
+        break;
+      case BTREE_INT64:
+        pos = node_search_int64(strategy, n, key, &cmp);
+        break;
+      case BTREE_DOUBLE:
+        pos = node_search_double(strategy, n, key, &cmp);
+        break;
+      case BTREE_BYTES:
+        pos = node_search_bytes(strategy, n, key, &cmp);
+        break;
+      default:
+        if (btree_prefix(t)) {
+          pos = node_search_prefix(strategy, n, key, &cmp);
+        } else {
+          pos = node_search_string(strategy, n, key, &cmp);
+        }
+        break;
+    }
+    if (cmpptr) {
+      *cmpptr = cmp;
+    }
+    return pos;
+}
+
+extern NODE_T *node_descend(BTREE_T *t, NODE_T *n, char *key,
+                            short *posptr, int *cmpptr, short *lvlptr,
+                            PATH_T *path) {
+    // Returns the node that contains the key (*cmpptr is then 0)
+    // or the leaf where it should go, and the position in *posptr
+    // (see node_search()). *lvlptr is the indentation level for
+    // debugging messages, updated while going down. If path
+    // isn't NULL, it receives the nodes above the one returned
+    // (what it contains already is kept below).
+    short pos = -1;
+    int   cmp = 1;
+    short lvl = (lvlptr ? *lvlptr : 0);
+    char  strategy = btree_nodesearch(t);
+    char  plus = btree_plus(t);
+
+    if (n && key) {
+      switch (btree_keytype(t)) {
+        case BTREE_INT32:
+          n = descend_int32(t, strategy, plus, n, key,
+                            &pos, &cmp, &lvl, path);
+          break;
+        case BTREE_INT64:
+          n = descend_int64(t, strategy, plus, n, key,
+                            &pos, &cmp, &lvl, path);
+          break;
+        case BTREE_DOUBLE:
+          n = descend_double(t, strategy, plus, n, key,
+                             &pos, &cmp, &lvl, path);
+          break;
+        case BTREE_BYTES:
+          n = descend_bytes(t, strategy, plus, n, key,
+                            &pos, &cmp, &lvl, path);
+          break;
+        default:
+          if (btree_prefix(t)) {
+            n = descend_prefix(t, strategy, plus, n, key,
+                               &pos, &cmp, &lvl, path);
+          } else {
+            n = descend_string(t, strategy, plus, n, key,
+                               &pos, &cmp, &lvl, path);
+          }
+          break;
+      }
+    }
+    if (posptr) {
+      *posptr = pos;
+    }
+    if (cmpptr) {
+      *cmpptr = cmp;
+    }
+    if (lvlptr) {
+      *lvlptr = lvl;
+    }
+    return n;
+}
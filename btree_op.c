@@ -10,98 +10,473 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <unistd.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "btree.h"
 #include "debug.h"
 
-static short   G_maxkeys = DEF_MAX_KEYS;
-static float   G_fillrate = DEF_FILL_RATE;
-static NODE_T *G_root = NULL;
-static char    G_unique = 0;
-static char    G_numeric = 0;
+// A node freed in a concurrent tree, that readers may
+// still be looking at (see btree_latch.c)
+typedef struct retired_t {
+          NODE_T   *n;
+          uint64_t  epoch;
+         } RETIRED_T;
 
-extern void btree_setmaxkeys(short n) {
-  G_maxkeys = n;
+#define RETIRED_BATCH  64   // Reuse is checked for that often
+
+// Everything that describes one tree. Callers only ever
+// see a pointer to it, so that as many trees as needed,
+// each one with its own settings, can live side by side.
+struct btree_t {
+          NODE_T *root;
+          short   maxkeys;
+          float   fillrate;
+          float   loadrate; // How full btree_load() makes nodes
+          char    unique;
+          char    keytype;  // BTREE_STRING, BTREE_INT32 ...
+          short   keysize;  // Size of inline keys, 0 for strings
+          char    nsearch;  // Requested node search strategy
+          char    nsearch_used;  // What NSEARCH_AUTO resolves to
+          short   last_id;  // Last node id given in this tree
+          ARENA_T *nodes;   // Where nodes come from, created with
+                            // the first node (size depends on
+                            // maxkeys and keysize)
+          KEYARENA_T *keys; // Where string and bytes keys are
+                            // copied, created with the first one
+          char    intern;   // Share copies of identical keys
+          char    prefix;   // Prefix-compressed string keys
+          char    plus;     // B+tree: all keys in linked leaves
+          char    topdown;  // Split and refill on the way down
+          char    concurrent;  // Shared by threads
+          uint32_t rootlatch;  // Guards root, see btree_latch.c
+          pthread_mutex_t alloc;  // Guards arenas, last_id and
+                                  // retired in a concurrent tree
+          RETIRED_T *retired;     // Freed nodes not yet given
+          int     retiredcnt;     // back to the arena
+          int     retiredmax;
+          char   *ring[KEY_RING];      // Where key_at() rebuilds
+          size_t  ringsize[KEY_RING];  // compressed keys, in turn
+          short   ringpos;
+          void  (*valfree)(void *);  // How to release values, if
+                                     // the tree owns them
+          PAGEFILE_T *file; // Where nodes and keys are kept, if
+                            // not in memory (see btree_page.c)
+          LOG_T  *log;      // Where changes are recorded, if
+                            // anywhere (see btree_log.c)
+          size_t  cache;    // Pages of the file kept in memory,
+                            // 0 to leave it to the system
+         };
+
+extern BTREE_T *btree_new(void) {
+  BTREE_T *t = (BTREE_T *)malloc(sizeof(BTREE_T));
+
+  if (t) {
+    t->root = NULL;
+    t->maxkeys = DEF_MAX_KEYS;
+    t->fillrate = DEF_FILL_RATE;
+    t->loadrate = DEF_LOAD_RATE;
+    t->unique = 0;
+    t->keytype = BTREE_STRING;
+    t->keysize = 0;
+    t->nsearch = NSEARCH_AUTO;
+    t->nsearch_used = nsearch_choose(t->keytype, t->maxkeys);
+    t->last_id = 0;
+    t->nodes = NULL;
+    t->keys = NULL;
+    t->intern = 0;
+    t->prefix = 0;
+    t->plus = 0;
+    t->topdown = 0;
+    t->concurrent = 0;
+    t->rootlatch = 0;
+    t->retired = NULL;
+    t->retiredcnt = 0;
+    t->retiredmax = 0;
+    memset(t->ring, 0, sizeof(t->ring));
+    memset(t->ringsize, 0, sizeof(t->ringsize));
+    t->ringpos = 0;
+    t->valfree = NULL;
+    t->file = NULL;
+    t->log = NULL;
+    t->cache = 0;
+  }
+  return t;
 }
 
-extern short btree_maxkeys(void) {
-  return G_maxkeys;
+static void node_arena_reset(BTREE_T *t) {
+  // Node size is about to change - only possible while
+  // the tree holds no node
+  arena_free(t->nodes);
+  t->nodes = NULL;
 }
 
-extern float btree_fillrate(void) {
-  return G_fillrate;
+extern void btree_setmaxkeys(BTREE_T *t, short n) {
+  assert(t && (t->root == NULL));
+  node_arena_reset(t);
+  t->maxkeys = n;
+  btree_setnodesearch(t, t->nsearch);
 }
 
-extern void btree_setroot(NODE_T *n) {
-  G_root = n;
-  if (n) {
-    n->parent = NULL;
+extern short btree_maxkeys(BTREE_T *t) {
+  assert(t);
+  return t->maxkeys;
+}
+
+extern float btree_fillrate(BTREE_T *t) {
+  assert(t);
+  return t->fillrate;
+}
+
+extern void btree_setloadrate(BTREE_T *t, float rate) {
+  // Proportion of the maximum number of keys put in nodes
+  // built by btree_load(); it's never less than what
+  // DEF_FILL_RATE gives, plus one key.
+  assert(t);
+  if ((rate > 0) && (rate <= 1)) {
+    t->loadrate = rate;
+  }
+}
+
+extern float btree_loadrate(BTREE_T *t) {
+  assert(t);
+  return t->loadrate;
+}
+
+extern void btree_setvalfree(BTREE_T *t, void (*valfree)(void *)) {
+  // By default values belong to the caller. If a function is
+  // provided, the tree calls it on values that are replaced,
+  // deleted or still present when the tree is freed.
+  assert(t);
+  t->valfree = valfree;
+}
+
+extern void value_free(BTREE_T *t, void *value) {
+  if (t->valfree && value) {
+    (t->valfree)(value);
   }
 }
 
-extern NODE_T *btree_root(void) {
-  return G_root;
+extern PAGEFILE_T *btree_file(BTREE_T *t) {
+  assert(t);
+  return t->file;
+}
+
+extern void btree_setfile(BTREE_T *t, PAGEFILE_T *pf) {
+  assert(t);
+  t->file = pf;
+}
+
+extern LOG_T *btree_log(BTREE_T *t) {
+  assert(t);
+  return t->log;
+}
+
+extern void btree_setlog(BTREE_T *t, LOG_T *l) {
+  assert(t);
+  t->log = l;
+}
+
+extern void btree_setcache(BTREE_T *t, size_t pages) {
+  // Pages of its file that a tree opened afterwards keeps
+  // in memory (btree_pool.c); 0, the default, lets the
+  // system decide.
+  assert(t && (t->file == NULL));
+  t->cache = pages;
+}
+
+extern size_t btree_cache(BTREE_T *t) {
+  assert(t);
+  return t->cache;
+}
+
+extern ARENA_T *btree_nodearena(BTREE_T *t) {
+  assert(t);
+  return t->nodes;
+}
+
+extern KEYARENA_T *btree_keyarena(BTREE_T *t) {
+  assert(t);
+  return t->keys;
+}
+
+extern void btree_setarenas(BTREE_T *t, ARENA_T *nodes, KEYARENA_T *keys) {
+  // Arenas that don't take memory from malloc() (see
+  // btree_page.c), set up while the tree has none
+  assert(t && (t->nodes == NULL) && (t->keys == NULL));
+  t->nodes = nodes;
+  t->keys = keys;
+}
+
+extern short btree_lastid(BTREE_T *t) {
+  assert(t);
+  return t->last_id;
+}
+
+extern void btree_setlastid(BTREE_T *t, short id) {
+  assert(t);
+  t->last_id = id;
+}
+
+extern void btree_setroot(BTREE_T *t, NODE_T *n) {
+  assert(t);
+  t->root = n;
+}
+
+extern NODE_T *btree_root(BTREE_T *t) {
+  assert(t);
+  return t->root;
+}
+
+extern void btree_setunique(BTREE_T *t) {
+  assert(t);
+  t->unique = 1;
+}
+
+extern void btree_setintern(BTREE_T *t) {
+  // Identical keys share the same copy. Only useful when the
+  // same keys are removed and added again, since the tree
+  // holds no duplicates.
+  assert(t && (t->root == NULL));
+  keyarena_free(t->keys);
+  t->keys = NULL;
+  t->intern = 1;
+}
+
+extern char btree_intern(BTREE_T *t) {
+  assert(t);
+  return t->intern;
+}
+
+extern void btree_setprefix(BTREE_T *t) {
+  // Each node stores the prefix shared by its string keys
+  // once, and only suffixes in slots (see btree_prefix.c)
+  assert(t && (t->root == NULL) && !t->concurrent);
+  t->prefix = 1;
+}
+
+extern void btree_setplus(BTREE_T *t) {
+  // Keys and values are all stored in leaves, chained in
+  // order; internal nodes only hold copies of keys that
+  // separate their subtrees, with keys equal to a separator
+  // on its right
+  assert(t && (t->root == NULL));
+  t->plus = 1;
+}
+
+extern char btree_plus(BTREE_T *t) {
+  assert(t);
+  return t->plus;
+}
+
+extern void btree_settopdown(BTREE_T *t) {
+  // Insertions split the full nodes they go through, and
+  // deletions give one more key to the minimal ones, before
+  // entering them: each operation is a single descent that
+  // never comes back up. Nodes may then hold one key less
+  // than usual when the maximum is even (see MIN_KEYS).
+  assert(t && (t->root == NULL));
+  t->topdown = 1;
+}
+
+extern char btree_topdown(BTREE_T *t) {
+  assert(t);
+  return t->topdown;
+}
+
+extern void btree_setconcurrent(BTREE_T *t) {
+  // Insertions, deletions, btree_get(), btree_update()
+  // and cursors may be used by several threads at once
+  // (see btree_latch.c); changes run in top-down mode.
+  // Everything else (loading, display, check ...) still
+  // requires the tree to be left alone. Compressed keys,
+  // rebuilt in buffers shared by all users of the tree,
+  // aren't available.
+  assert(t && (t->root == NULL) && !t->prefix && !t->file);
+  if (!t->concurrent) {
+    pthread_mutex_init(&(t->alloc), NULL);
+    t->concurrent = 1;
+  }
+  t->topdown = 1;
+}
+
+extern char btree_concurrent(BTREE_T *t) {
+  assert(t);
+  return t->concurrent;
+}
+
+extern uint32_t *btree_rootlatch(BTREE_T *t) {
+  assert(t);
+  return &(t->rootlatch);
 }
 
-extern void btree_setunique(void) {
-  G_unique = 1;
+extern char btree_prefix(BTREE_T *t) {
+  // Only string keys can be compressed
+  assert(t);
+  return (t->prefix && (t->keytype == BTREE_STRING));
 }
 
-extern char btree_unique(void) {
-  return G_unique;
+extern char btree_unique(BTREE_T *t) {
+  assert(t);
+  return t->unique;
 }
 
-extern void btree_setnumeric(void) {
-  G_numeric = 1;
+extern void btree_setnumeric(BTREE_T *t) {
+  // Historical numeric mode: 32-bit integers
+  btree_setkeytype(t, BTREE_INT32);
 }
 
-extern char btree_numeric(void) {
-  return G_numeric;
+extern char btree_numeric(BTREE_T *t) {
+  assert(t);
+  // Numeric keys are the ones stored inline
+  return (t->keysize != 0);
 }
 
-extern int btree_keycmp(char *k1, char *k2) {
+extern void btree_setkeytype(BTREE_T *t, char keytype) {
+  assert(t && (t->root == NULL));
+  node_arena_reset(t);
+  t->keytype = keytype;
+  switch (keytype) {
+    case BTREE_INT32:
+      t->keysize = sizeof(int32_t);
+      break;
+    case BTREE_INT64:
+      t->keysize = sizeof(int64_t);
+      break;
+    case BTREE_DOUBLE:
+      t->keysize = sizeof(double);
+      break;
+    case BTREE_BYTES:
+      t->keysize = 0;
+      break;
+    default:
+      t->keytype = BTREE_STRING;
+      t->keysize = 0;
+      break;
+  }
+  btree_setnodesearch(t, t->nsearch);
+}
+
+extern void btree_setnodesearch(BTREE_T *t, char strategy) {
+  // NSEARCH_AUTO picks a strategy from the key type and the
+  // maximum number of keys; interpolation only makes sense
+  // with numeric keys.
+  assert(t);
+  t->nsearch = strategy;
+  if ((strategy == NSEARCH_AUTO)
+      || ((strategy == NSEARCH_INTERP) && (t->keysize == 0))) {
+    t->nsearch_used = nsearch_choose(t->keytype, t->maxkeys);
+  } else {
+    t->nsearch_used = strategy;
+  }
+}
+
+extern char btree_nodesearch(BTREE_T *t) {
+  // Strategy actually used
+  assert(t);
+  return t->nsearch_used;
+}
+
+extern char btree_keytype(BTREE_T *t) {
+  assert(t);
+  return t->keytype;
+}
+
+extern short btree_keysize(BTREE_T *t) {
+  // Size of an inline key, 0 for strings and bytes
+  assert(t);
+  return t->keysize;
+}
+
+extern int btree_keycmp(BTREE_T *t, char *k1, char *k2) {
   // Returns 0 if k1 == k2,
   //        a value > 0 if k1 > k2
   //        a value < 0 if k1 < k2
   int cmp;
 
-  if (G_numeric) {
-    if (*((int *)k1) == *((int *)k2)) {
-      cmp = 0;
-    } else if (*((int *)k1) > *((int *)k2)) {
-      cmp = 1;
-    } else {
-      cmp = -1;
-    }
-  } else {
-    cmp = strcmp(k1, k2);
+  switch (t->keytype) {
+    case BTREE_INT32:
+      cmp = (*((int32_t *)k1) > *((int32_t *)k2))
+            - (*((int32_t *)k1) < *((int32_t *)k2));
+      break;
+    case BTREE_INT64:
+      cmp = (*((int64_t *)k1) > *((int64_t *)k2))
+            - (*((int64_t *)k1) < *((int64_t *)k2));
+      break;
+    case BTREE_DOUBLE:
+      cmp = (*((double *)k1) > *((double *)k2))
+            - (*((double *)k1) < *((double *)k2));
+      break;
+    case BTREE_BYTES:
+      cmp = key_bytescmp(k1, k2);
+      break;
+    default:
+      cmp = strcmp(k1, k2);
+      break;
   }
   return cmp;
 }
 
-extern char btree_check(NODE_T *n, char *prev_key) {
+extern char btree_check(BTREE_T *t, NODE_T *n, char *prev_key) {
   // Debugging - check that everything is OK in the tree
-  static char *last_key;
+  static char   *last_key;
+  static char   *last_buf = NULL;  // Compressed keys
+  static size_t  last_size = 0;
+  static NODE_T *last_leaf;        // B+tree mode
 
   if (n) {
-    int  i;
+    int   i;
+    char *key;
 
-    assert((n->parent == NULL)
-           || ((n->keycnt <= btree_maxkeys()) && (n->keycnt >= MIN_KEYS)));
+    assert((n == t->root)
+           || ((n->keycnt <= btree_maxkeys(t)) && (n->keycnt >= MIN_KEYS(t))));
     if (prev_key == NULL) {
       last_key = prev_key;
+    }
+    if (n == t->root) {
+      last_leaf = NULL;
+    }
+    if (t->plus) {
+      if (_is_leaf(n)) {
+        // Leaves are met in order
+        if ((n->prev != last_leaf)
+            || (last_leaf && (last_leaf->next != n))) {
+          debug(0, "Leaf %hd badly chained", n->id);
+          return 1;
+        }
+        last_leaf = n;
+      } else {
+        for (i = 1; i <= n->keycnt; i++) {
+          if (n->k[i].value) {
+            debug(0, "Slot %d in node %hd: separator with a value",
+                  i, n->id);
+            return 1;
+          }
+        }
+      }
     }   
-    for (i = 0; i <= btree_maxkeys(); i++) {
-      if (n->k[i].key) {
+    for (i = 0; i <= btree_maxkeys(t); i++) {
+      if (t->keysize) {
+        // Inline keys are never null, only the
+        // key count says what is meaningful
+        key = ((i && (i <= n->keycnt)) ? key_at(t, n, i) : NULL);
+      } else if (btree_prefix(t)) {
+        key = key_at(t, n, i);
+      } else {
+        key = n->k[i].key;
+      }
+      if (key) {
         if (i == 0) {
           // Should be null
           debug(0, "Slot %d in node %hd: key should be null", i, n->id);
           return 1;
         }
         if (last_key) {
-          if (btree_keycmp(n->k[i].key, last_key) < 0) {
+          if (btree_keycmp(t, key, last_key) < 0) {
             debug(0, "Slot %d in node %hd: misplaced key", i, n->id);
             return 1;  // Inconsistent, current key
                        // should be greater than the previous one
@@ -112,7 +487,16 @@ extern char btree_check(NODE_T *n, char *prev_key) {
           debug(0, "Slot %d in node %hd: key should be null", i, n->id);
           return 1;
         }
-        last_key = n->k[i].key;
+        if (btree_prefix(t)) {
+          // key_at() will soon reuse its buffer
+          if (strlen(key) >= last_size) {
+            last_size = strlen(key) + 1;
+            last_buf = (char *)realloc(last_buf, last_size);
+            assert(last_buf);
+          }
+          key = strcpy(last_buf, key);
+        }
+        last_key = key;
       } else {
         if (i && (i <= n->keycnt)) {
           debug(0, "Slot %d in node %hd: no value, keycnt is %hd",
@@ -122,12 +506,7 @@ extern char btree_check(NODE_T *n, char *prev_key) {
       }
       if (n->k[i].bigger) {
         if (i <= n->keycnt) {  
-          if ((n->k[i].bigger)->parent != n) {
-            debug(0, "Parent pointer of node %hd inconsistent",
-                     (n->k[i].bigger)->id);
-            return 1;
-          }
-          if (btree_check(n->k[i].bigger, n->k[i].key)) {
+          if (btree_check(t, n->k[i].bigger, (i ? key : prev_key))) {
             return 1;
           }
         } else {
@@ -137,159 +516,505 @@ extern char btree_check(NODE_T *n, char *prev_key) {
         }
       }
     }
+    if (t->plus && (n == t->root)
+        && last_leaf && last_leaf->next) {
+      debug(0, "Leaf %hd isn't the last one", last_leaf->id);
+      return 1;
+    }
   }                             /* End of if */
   return 0;
 }                               /* End of btree_check() */
 
-extern char *key_duplicate(char *key) {
+extern char *key_save(BTREE_T *t, const char *data, size_t len) {
+    // Copies len bytes into the key arena of the tree.
+    // Copies are never released one by one.
+    char *k;
+
+    if (t->concurrent) {
+      pthread_mutex_lock(&(t->alloc));
+    }
+    if (t->keys == NULL) {
+      t->keys = keyarena_new(t->intern);
+      assert(t->keys);
+    }
+    k = keyarena_store(t->keys, data, len);
+    assert(k);
+    if (t->concurrent) {
+      pthread_mutex_unlock(&(t->alloc));
+    }
+    return k;
+}
+
+extern char *key_space(BTREE_T *t, size_t size) {
+    // Room for size bytes of packed keys in the key arena
+    // of the tree (see keyarena_reserve())
+    char *area;
+
+    if (t->keys == NULL) {
+      t->keys = keyarena_new(t->intern);
+      assert(t->keys);
+    }
+    area = keyarena_reserve(t->keys, size);
+    assert(area);
+    return area;
+}
+
+extern char *key_duplicate(BTREE_T *t, char *key) {
+    // Numeric keys are copied into the node when stored, and
+    // so are compressed keys; other keys need a private copy.
     char *dupl = NULL;
     if (key) {
-      if (G_numeric) {
-        // A union would be more space efficient, but
-        // would complicate the code unnecessarily for
-        // what shouldn't be the most common case.
-        int val = *((int *)key);
-
-        if ((dupl = (char *)malloc(sizeof(int))) != NULL) {
-          memcpy(dupl, &val, sizeof(int));
-        }
-      } else { 
-        dupl = strdup(key);
+      if (t->keysize || btree_prefix(t)) {
+        dupl = key;
+      } else if (t->keytype == BTREE_BYTES) {
+        dupl = key_save(t, key, BYTES_SIZE(key));
+      } else {
+        dupl = key_save(t, key, strlen(key) + 1);
       }
     }
     return dupl;
 }
 
-extern NODE_T *new_node(NODE_T *parent) {
-    static short last_id = 0;
+extern char *key_parse(BTREE_T *t, char *key, KEYBUF_T *buf) {
+    // Converts a key as typed by a user into what is
+    // stored and compared in the tree - in numeric mode
+    // a pointer to buf, which receives the value.
+    // Length-prefixed keys are taken as they are
+    // (see key_frombytes()).
+    // Returns NULL if the key isn't valid: no number, a
+    // value out of range, or a double that isn't finite
+    // (NaN isn't ordered, it can't be a key).
+    char      *end;
+    long long  v;
 
-    NODE_T *n =(NODE_T *)malloc(sizeof(NODE_T));
+    if (key && buf) {
+      errno = 0;
+      switch (t->keytype) {
+        case BTREE_INT32:
+          v = strtoll(key, &end, 10);
+          if ((end == key) || errno || (v < INT32_MIN) || (v > INT32_MAX)) {
+            return NULL;
+          }
+          buf->i32 = (int32_t)v;
+          break;
+        case BTREE_INT64:
+          v = strtoll(key, &end, 10);
+          if ((end == key) || errno) {
+            return NULL;
+          }
+          buf->i64 = (int64_t)v;
+          break;
+        case BTREE_DOUBLE:
+          buf->d = strtod(key, &end);
+          if ((end == key) || !isfinite(buf->d)) {
+            return NULL;
+          }
+          break;
+        default:
+          return key;
+      }
+      return (char *)buf;
+    }
+    return key;
+}
+
+extern char *key_text(BTREE_T *t, char *key, char *buf) {
+    // Returns something printable for a key, buf
+    // must be able to hold KEY_TEXTLEN characters.
+    if (key && buf) {
+      switch (t->keytype) {
+        case BTREE_INT32:
+          snprintf(buf, KEY_TEXTLEN, "%" PRId32, *((int32_t *)key));
+          return buf;
+        case BTREE_INT64:
+          snprintf(buf, KEY_TEXTLEN, "%" PRId64, *((int64_t *)key));
+          return buf;
+        case BTREE_DOUBLE:
+          snprintf(buf, KEY_TEXTLEN, "%g", *((double *)key));
+          return buf;
+        case BTREE_BYTES:
+          {
+            uint16_t i;
+            uint16_t len = BYTES_LEN(key);
+            char    *data = BYTES_DATA(key);
+
+            if (len >= KEY_TEXTLEN) {
+              len = KEY_TEXTLEN - 1;
+            }
+            for (i = 0; i < len; i++) {
+              buf[i] = (isprint((unsigned char)data[i]) ? data[i] : '.');
+            }
+            buf[len] = '\0';
+          }
+          return buf;
+        default:
+          break;
+      }
+    }
+    return key;
+}
+
+extern char *key_frombytes(char *buf, const void *data, uint16_t len) {
+    // Builds a length-prefixed key in buf, which must
+    // be able to hold len + sizeof(uint16_t) bytes.
+    BYTES_LEN(buf) = len;
+    memcpy(BYTES_DATA(buf), data, len);
+    return buf;
+}
+
+// Slot helpers. A slot is REDIRECT_T k[i] plus, with numeric
+// keys, the inline key nk[i]; all moves must keep them together.
+
+extern char *key_at(BTREE_T *t, NODE_T *n, short pos) {
+    // Where the key at pos is - only valid as long as
+    // slots aren't moved. Compressed keys are rebuilt in
+    // one of KEY_RING buffers, used in turn.
+    if (t->keysize) {
+      return n->nk + pos * t->keysize;
+    }
+    if (btree_prefix(t)) {
+      short r = t->ringpos;
+
+      t->ringpos = (r + 1) % KEY_RING;
+      return pfx_full(n, pos, &(t->ring[r]), &(t->ringsize[r]));
+    }
+    return n->k[pos].key;
+}
+
+extern char *key_fetch(BTREE_T *t, NODE_T *n, short pos, KEYBUF_T *buf) {
+    // Same as key_at() but numeric keys are copied to buf,
+    // so that what is returned survives slot moves.
+    // Compressed keys must be copied by the caller.
+    if (t->keysize) {
+      memcpy(buf, n->nk + pos * t->keysize, t->keysize);
+      return (char *)buf;
+    }
+    return key_at(t, n, pos);
+}
+
+extern void key_store(BTREE_T *t, NODE_T *n, short pos, char *key) {
+    // Strings are referenced (the node becomes the owner),
+    // numeric keys and compressed keys are copied.
+    if (t->keysize) {
+      memcpy(n->nk + pos * t->keysize, key, t->keysize);
+    } else if (btree_prefix(t)) {
+      n->k[pos].key = NULL;
+      n->k[pos].key = pfx_store(t, n, key);
+    } else {
+      n->k[pos].key = key;
+    }
+}
+
+extern void separator_set(BTREE_T *t, NODE_T *par, short pos,
+                          NODE_T *leaf) {
+    // B+tree mode: the separator at pos in par becomes
+    // a copy of the first key of the leaf
+    KEYBUF_T  buf;
+    char     *key = key_fetch(t, leaf, 1, &buf);
+
+    key_store(t, par, pos, key_duplicate(t, key));
+}
+
+extern void key_transfer(BTREE_T *t, NODE_T *dst, short dst_pos,
+                         NODE_T *src, short src_pos) {
+    // Moves a key and its value (not the subtree pointer)
+    char *key = src->k[src_pos].key;
+
+    if (t->keysize) {
+      memcpy(dst->nk + dst_pos * t->keysize,
+             src->nk + src_pos * t->keysize, t->keysize);
+    } else if (btree_prefix(t) && (dst != src) && key) {
+      dst->k[dst_pos].key = NULL;
+      key = pfx_adopt(t, dst, src->pfx, src->pfxlen, key);
+    }
+    dst->k[dst_pos].key = key;
+    dst->k[dst_pos].value = src->k[src_pos].value;
+}
+
+extern void slot_move(BTREE_T *t, NODE_T *dst, short dst_pos,
+                      NODE_T *src, short src_pos, short cnt) {
+    if ((cnt > 0) && btree_prefix(t) && (dst != src)) {
+      // Suffixes must be adapted to the prefix of dst,
+      // one by one
+      short i;
+      char *key;
+
+      for (i = 0; i < cnt; i++) {
+        key = src->k[src_pos + i].key;
+        dst->k[dst_pos + i] = src->k[src_pos + i];
+        if (key) {
+          dst->k[dst_pos + i].key = NULL;
+          dst->k[dst_pos + i].key = pfx_adopt(t, dst, src->pfx,
+                                              src->pfxlen, key);
+        }
+      }
+    } else if (cnt > 0) {
+      // (dest, src, size)
+      (void)memmove(&(dst->k[dst_pos]), &(src->k[src_pos]),
+                    sizeof(REDIRECT_T) * cnt);
+      if (t->keysize) {
+        (void)memmove(dst->nk + dst_pos * t->keysize,
+                      src->nk + src_pos * t->keysize,
+                      t->keysize * cnt);
+      }
+    }
+}
+
+extern void slot_clear(BTREE_T *t, NODE_T *n, short pos, short cnt) {
+    if (cnt > 0) {
+      (void)memset(&(n->k[pos]), 0, sizeof(REDIRECT_T) * cnt);
+      if (t->keysize) {
+        (void)memset(n->nk + pos * t->keysize, 0, t->keysize * cnt);
+      }
+    }
+}
+
+extern NODE_T *new_node(BTREE_T *t) {
+    // A node is one block from the arena of the tree: the
+    // header, then the slots, then with numeric keys the
+    // key array.
+    NODE_T *n;
+
+    if (t->concurrent) {
+      pthread_mutex_lock(&(t->alloc));
+    }
+    if (t->nodes == NULL) {
+      t->nodes = arena_new(sizeof(NODE_T)
+                           + (1 + t->maxkeys) * sizeof(REDIRECT_T)
+                           + (1 + t->maxkeys) * t->keysize);
+      assert(t->nodes);
+    }
+    n = (NODE_T *)arena_alloc(t->nodes);
     assert(n);
-    last_id++;
-    n->parent = parent;
-    n->id = last_id;
+    (t->last_id)++;
+    n->id = t->last_id;
+    if (t->concurrent) {
+      pthread_mutex_unlock(&(t->alloc));
+    }
     n->keycnt = 0;
-    n->k = (REDIRECT_T *)calloc((1 + G_maxkeys), sizeof(REDIRECT_T));
-    assert(n->k);
+    n->latch = 0;
+    n->k = (REDIRECT_T *)(n + 1);
+    n->nk = (t->keysize ? (char *)(n->k + 1 + t->maxkeys) : NULL);
     return n;
 }
 
-static void free_tree(NODE_T **root_ptr) {
-    if (root_ptr && *root_ptr) {
+static void retired_reuse(BTREE_T *t) {
+    // Gives back to the arena the freed nodes that no
+    // reader can see any longer
+    uint64_t oldest = epoch_oldest();
+    int      i;
+    int      kept = 0;
+
+    for (i = 0; i < t->retiredcnt; i++) {
+      if (t->retired[i].epoch < oldest) {
+        arena_release(t->nodes, t->retired[i].n);
+      } else {
+        t->retired[kept++] = t->retired[i];
+      }
+    }
+    t->retiredcnt = kept;
+}
+
+extern void node_free(BTREE_T *t, NODE_T *n) {
+    // Gives the node back to the arena (keys and values
+    // must have been moved or released). In a concurrent
+    // tree the node, latched by the caller, waits until
+    // readers that may have met it are gone.
+    if (t->concurrent) {
+      latch_obsolete(&(n->latch));
+      pthread_mutex_lock(&(t->alloc));
+      if (t->retiredcnt == t->retiredmax) {
+        t->retiredmax += RETIRED_BATCH;
+        t->retired = (RETIRED_T *)realloc(t->retired,
+                                          t->retiredmax * sizeof(RETIRED_T));
+        assert(t->retired);
+      }
+      t->retired[t->retiredcnt].n = n;
+      t->retired[(t->retiredcnt)++].epoch = epoch_retire();
+      if (t->retiredcnt % RETIRED_BATCH == 0) {
+        retired_reuse(t);
+      }
+      pthread_mutex_unlock(&(t->alloc));
+      return;
+    }
+    arena_release(t->nodes, n);
+}
+
+static void free_values(BTREE_T *t, NODE_T *n) {
+    if (n) {
       int i;
 
-      for (i = 0; i < (*root_ptr)->keycnt; i++) {
-        free_tree(&((*root_ptr)->k[i].bigger));
-        if ((*root_ptr)->k[i].key) {
-          free((*root_ptr)->k[i].key);
+      for (i = 0; i <= n->keycnt; i++) {
+        free_values(t, n->k[i].bigger);
+        value_free(t, n->k[i].value);
+      }
+    }
+}
+
+extern void btree_clear(BTREE_T *t) {
+    // Releases all nodes, the tree is empty again.
+    // Nodes and keys go with their arenas; the tree is
+    // only walked if there are values to release.
+    if (t) {
+      if (t->valfree) {
+        free_values(t, t->root);
+      }
+      t->root = NULL;
+      t->retiredcnt = 0;   // Gone with the arena
+      node_arena_reset(t);
+      keyarena_free(t->keys);
+      t->keys = NULL;
+      if (t->file) {
+        // The file is emptied, and gives pages again
+        page_clear(t);
+      }
+      if (t->log) {
+        // Nothing to replay
+        log_reset(t);
+      }
+    }
+}
+
+static void compact_node(BTREE_T *t, NODE_T *n, KEYARENA_T *keys) {
+    if (n) {
+      short  i;
+      char  *key;
+
+      if (n->pfxlen) {
+        n->pfx = keyarena_store(keys, n->pfx, n->pfxlen);
+        assert(n->pfx);
+      }
+      for (i = 0; i <= n->keycnt; i++) {
+        if ((key = n->k[i].key) != NULL) {
+          n->k[i].key = keyarena_store(keys, key,
+                                       (t->keytype == BTREE_BYTES ?
+                                        BYTES_SIZE(key) : strlen(key) + 1));
+          assert(n->k[i].key);
         }
+        compact_node(t, n->k[i].bigger, keys);
       }
-      free((*root_ptr)->k);
-      free(*root_ptr);
-      *root_ptr = NULL;
     }
 }
 
-extern void btree_free(void) {
-    free_tree(&G_root);
+extern void btree_compact(BTREE_T *t) {
+    // Copies the keys in use into a new key arena and
+    // releases the old one, with the space of deleted keys
+    // and of suffixes that have been copied again
+    KEYARENA_T *keys;
+
+    assert(t);
+    if (t->keys && !t->file) {   // Pages of a file stay in use
+      keys = keyarena_new(t->intern);
+      assert(keys);
+      compact_node(t, t->root, keys);
+      keyarena_free(t->keys);
+      t->keys = keys;
+    }
+}
+
+extern void btree_free(BTREE_T *t) {
+    // Releases all nodes and the tree itself
+    if (t) {
+      short r;
+
+      if (t->file) {
+        page_close(t);
+      }
+      if (t->log) {
+        log_close(t);
+      }
+      btree_clear(t);
+      for (r = 0; r < KEY_RING; r++) {
+        free(t->ring[r]);
+      }
+      if (t->concurrent) {
+        pthread_mutex_destroy(&(t->alloc));
+      }
+      free(t->retired);
+      free(t);
+    }
 }
 
-extern NODE_T *left_sibling(NODE_T *n, short *sep_pos) {
-   // Find the node on the left
+extern NODE_T *left_sibling(PATH_T *path, short *sep_pos) {
+   // Find the node on the left of the node that the
+   // path leads to (the last entry is its parent).
    // sep_pos is the index of the key in the parent
    // that is greater than all keys in the left sibling
    // and smaller than all keys in the current node.
-   NODE_T *l = NULL;
    NODE_T *p;
+   short   j;
 
-   if (n && sep_pos && ((p = n->parent) != NULL)) {
-     if (n == p->k[0].bigger) {
+   if (path && sep_pos && path->depth) {
+     p = path->n[path->depth - 1];
+     j = path->pos[path->depth - 1];
+     if (j == 0) {
        *sep_pos = -1;
        return NULL;
      }
-     assert(p->k);
-     // Where are we?
-     *sep_pos = 1;
-     while ((*sep_pos <= p->keycnt)
-            && (p->k[*sep_pos].bigger != n)) {
-       (*sep_pos)++;
-     }
-     assert(*sep_pos <= p->keycnt);
-     l = p->k[(*sep_pos)-1].bigger;
-   } 
-   return l;
+     *sep_pos = j;
+     return p->k[j-1].bigger;
+   }
+   return NULL;
 }
 
-extern NODE_T *right_sibling(NODE_T *n, short *sep_pos) {
+extern NODE_T *right_sibling(PATH_T *path, short *sep_pos) {
    // Find the node on the right
    // See comments in left_sibling
-   NODE_T *r = NULL;
    NODE_T *p;
+   short   j;
 
-   if (n && sep_pos && ((p = n->parent) != NULL)) {
-     assert(p->k);
-     *sep_pos = 0; 
-     // Where are we?
-     while ((*sep_pos <= p->keycnt)
-            && (p->k[*sep_pos].bigger != n)) {
-       (*sep_pos)++;
-     }
-     assert(p->k[*sep_pos].bigger == n);
-     if (*sep_pos == p->keycnt) {
+   if (path && sep_pos && path->depth) {
+     p = path->n[path->depth - 1];
+     j = path->pos[path->depth - 1];
+     if (j == p->keycnt) {
        *sep_pos = -1;
-       r = NULL;
-     } else {
-       (*sep_pos)++;
-       r = p->k[*sep_pos].bigger;
-     } 
-  }
-  return r;
+       return NULL;
+     }
+     *sep_pos = j + 1;
+     return p->k[j+1].bigger;
+   }
+   return NULL;
 }
 
-extern NODE_T *merge_leaf_nodes(NODE_T *left, char *sep_key,
+extern NODE_T *merge_leaf_nodes(BTREE_T *t, NODE_T *left,
+                                char *sep_key, void *sep_value,
                                 NODE_T *right, short lvl) {
    // Left and right are assumed to be two sibling nodes,
    // sep_key is the key in the parent that is bigger than all keys
    // in the left node and smaller than all keys in the right node.
    // It can be null if we are suppressing the last key in the node
    // and want to merge the two subtrees.
-   // Merges sep_key + "right" into "left" and returns "left"
+   // Merges sep_key (and its sep_value) + "right" into "left"
+   // and returns "left"
    if (left && right
        && _is_leaf(left)
        && _is_leaf(right)
-       && (left->parent == right->parent) 
        && ((left->keycnt
            + right->keycnt
-           + (sep_key ? 1 : 0)) <= G_maxkeys)) {
+           + (sep_key ? 1 : 0)) <= t->maxkeys)) {
      debug(lvl, "merging node %hd and node %hd", left->id, right->id);
      if (sep_key) {
-       left->k[left->keycnt+1].key = strdup(sep_key);
+       key_store(t, left, left->keycnt+1, key_duplicate(t, sep_key));
+       left->k[left->keycnt+1].value = sep_value;
        (left->keycnt)++;
      }
-     (void)memmove(&(left->k[left->keycnt+1]),
-                   &(right->k[1]),
-                   sizeof(REDIRECT_T) * right->keycnt);
+     slot_move(t, left, left->keycnt+1, right, 1, right->keycnt);
      left->keycnt += right->keycnt; 
-     // Nothing else to free than the containers as
+     // Nothing else to free than the container as
      // keys are moved and kept
-     free(right->k);
-     free(right);
+     node_free(t, right);
      if (debugging()) {
        int i;
        char node_buffer[1024];
-       char key_buffer[20];
+       char key_buffer[KEY_TEXTLEN];
 
        strcpy(node_buffer, "[");
        for (i = 1; i <= left->keycnt; i++) {
          if (i > 1) {
            strncat(node_buffer, ",", 1023 - strlen(node_buffer));
          }
-         if (btree_numeric()) {
-           sprintf(key_buffer, "%d", *((int*)(left->k[i].key)));
-           strncat(node_buffer, key_buffer, 1023 - strlen(node_buffer));
-         } else {
-           strncat(node_buffer, left->k[i].key, 1023 - strlen(node_buffer));
-         } 
+         strncat(node_buffer, key_text(t, key_at(t, left, i), key_buffer),
+                 1023 - strlen(node_buffer));
        } 
        strncat(node_buffer, "]", 1023 - strlen(node_buffer));
        debug(lvl, "merged (node %hd): %s", left->id, node_buffer);
@@ -298,25 +1023,21 @@ extern NODE_T *merge_leaf_nodes(NODE_T *left, char *sep_key,
    return left;
 }
 
-extern NODE_T *find_node(NODE_T *tree, char *key) {
+extern NODE_T *find_node(BTREE_T *t, NODE_T *tree, char *key) {
     // Find the leaf node where the key should be stored
     if (tree && key) {
        if (!_is_leaf(tree)) {
-         short i = 1;
-         int   cmp = -1;
+         int   cmp;
+         short i = node_search(t, tree, key, &cmp);
 
-         while ((i <= tree->keycnt)
-                && ((cmp = btree_keycmp(key, tree->k[i].key)) > 0)) {
-           i++;
-         }
          if (cmp == 0) {
            // We've found it in the tree
-           if (G_unique) {
+           if (t->unique) {
              return NULL;
            }
            return tree;
          } else {
-           return find_node(tree->k[i-1].bigger, key);
+           return find_node(t, tree->k[i-1].bigger, key);
          }
        } else {
          // Leaf - can only insert there
@@ -326,7 +1047,8 @@ extern NODE_T *find_node(NODE_T *tree, char *key) {
     return NULL;
 }
 
-extern short find_pos(NODE_T *n, char *key, char present, short lvl) {
+extern short find_pos(BTREE_T *t, NODE_T *n, char *key,
+                     char present, short lvl) {
     // 'present' says whether the key is expected to be
     // present or absent
     short pos = -1;
@@ -336,19 +1058,15 @@ extern short find_pos(NODE_T *n, char *key, char present, short lvl) {
       // Find where the key should go.
       // Note that we don't worry whether the node
       // is full or not.
-      pos = 1;
-      while ((pos <= n->keycnt)
-             && ((cmp = btree_keycmp(key, n->k[pos].key)) > 0)) {
-        pos++;
-      }
+      pos = node_search(t, n, key, &cmp);
       if (pos > 1) {
-        if (G_numeric) {
-          debug(lvl, "%d at pos %hd of node %hd (after %d)",
-                *((int*)key), pos, n->id,
-                *((int *)(n->k[pos-1].key)));
-        } else {
+        if (debugging()) {
+          char buf1[KEY_TEXTLEN];
+          char buf2[KEY_TEXTLEN];
+
           debug(lvl, "%s at pos %hd of node %hd (after %s)",
-                  key, pos, n->id, n->k[pos-1].key);
+                key_text(t, key, buf1), pos, n->id,
+                key_text(t, key_at(t, n, pos-1), buf2));
         }
       } else {
         debug(lvl, "goes at pos 1");
@@ -362,7 +1080,7 @@ extern short find_pos(NODE_T *n, char *key, char present, short lvl) {
       } else {
         // Not expected to be found
         // Not a problem if not unique, problem if unique
-        if (G_unique && (cmp == 0)) {
+        if (t->unique && (cmp == 0)) {
           debug(lvl, "key found and was NOT expected");
           return -1;
         }
@@ -370,3 +1088,152 @@ extern short find_pos(NODE_T *n, char *key, char present, short lvl) {
     }
     return pos;
 }
+
+extern char **batch_parse(BTREE_T *t, char **keys, int cnt) {
+    // Parses the cnt keys of a batch, that must come in
+    // ascending order (equal keys may follow each other).
+    // Returns what to search the tree with, in a single block
+    // that also holds the numeric values and must be freed by
+    // the caller; NULL if a key is invalid or out of order.
+    char     **ks;
+    KEYBUF_T  *buf;
+    int        i;
+
+    assert(t && keys && (cnt > 0));
+    ks = (char **)malloc(cnt * (sizeof(char *) + sizeof(KEYBUF_T)));
+    assert(ks);
+    buf = (KEYBUF_T *)(ks + cnt);
+    for (i = 0; i < cnt; i++) {
+      if ((ks[i] = key_parse(t, keys[i], &(buf[i]))) == NULL) {
+        fprintf(stdout, "%s: invalid numeric value\n", keys[i]);
+        free(ks);
+        return NULL;
+      }
+      if (i && (btree_keycmp(t, ks[i-1], ks[i]) > 0)) {
+        char buf1[KEY_TEXTLEN];
+        char buf2[KEY_TEXTLEN];
+
+        debug(0, "batch: %s after %s", key_text(t, ks[i], buf1),
+                 key_text(t, ks[i-1], buf2));
+        free(ks);
+        return NULL;
+      }
+    }
+    return ks;
+}
+
+extern char *path_fence(BTREE_T *t, PATH_T *path,
+                        KEYBUF_T *buf, char **copyptr) {
+    // Upper fence of the node that the path leads to, the
+    // first key on the right of the path going up (NULL on
+    // the right edge of the tree): every key below it that
+    // isn't below the node belongs to it. Numeric keys are
+    // copied to buf, compressed ones rebuilt in *copyptr,
+    // that the caller frees.
+    short  d;
+    size_t size = 0;
+
+    *copyptr = NULL;
+    for (d = path->depth - 1; d >= 0; d--) {
+      if (path->pos[d] < path->n[d]->keycnt) {
+        if (btree_prefix(t)) {
+          return pfx_full(path->n[d], path->pos[d] + 1, copyptr, &size);
+        }
+        return key_fetch(t, path->n[d], path->pos[d] + 1, buf);
+      }
+    }
+    return NULL;
+}
+
+// How btree_show_node() displays a node
+static char G_extended = 0;   // Every slot, with its child
+static char G_id = 1;         // Node ids
+
+extern void btree_setshowslots(char on) {
+    G_extended = on;
+}
+
+extern void btree_setshowids(char on) {
+    G_id = on;
+}
+
+extern void  btree_show_node(BTREE_T *t, NODE_T *n) {
+   short i;
+   char  buf[KEY_TEXTLEN];
+   char *key;
+
+   assert(n);
+   if (G_id) {
+     printf("%3d-", n->id);
+   }
+   fflush(stdout);
+   putchar('[');
+   if (!G_extended) {
+     for (i = 1; i <= n->keycnt; i++) {
+       if (i > 1) {
+         putchar(' ');
+       }
+   fflush(stdout);
+       printf("%s", key_text(t, key_at(t, n, i), buf));
+   fflush(stdout);
+       if (i < n->keycnt) {
+         putchar(',');
+       }
+   fflush(stdout);
+     }
+   } else {
+     if (n->pfxlen) {
+       // Slots only hold suffixes
+       printf("{%.*s}", (int)n->pfxlen, n->pfx);
+     }
+     for (i = 0; i <= btree_maxkeys(t); i++) {
+       if (btree_numeric(t)) {
+         // Inline numeric keys are never null
+         key = ((i && (i <= n->keycnt)) ? key_at(t, n, i) : NULL);
+       } else {
+         key = n->k[i].key;
+       }
+       if (key) {
+         printf("%s", key_text(t, key, buf));
+   fflush(stdout);
+       } else {
+         if (i) {
+           putchar('*');
+         }
+   fflush(stdout);
+       }
+       if (n->k[i].bigger) {
+         if (G_id) {
+           printf("<%hd>", (n->k[i].bigger)->id);
+         } else {
+           putchar(':');
+         }
+   fflush(stdout);
+       } else {
+         putchar('~');
+   fflush(stdout);
+       }
+     }
+     if (n->next && G_id) {
+       // B+tree leaf chain
+       printf("(>%hd)", (n->next)->id);
+     }
+   }
+   printf("]\n");
+   fflush(stdout);
+}
+
+extern void  btree_display(BTREE_T *t, NODE_T *n, int blanks) {
+  if (n) {
+    int  i;
+
+    for (i = 1; i <= blanks; i++) {
+      putchar(' ');
+    }
+    btree_show_node(t, n);
+    for (i = 0; i <= n->keycnt; i++) {
+      btree_display(t, n->k[i].bigger, blanks + 3);
+    }
+  }                             /* End of if */
+  fflush(stdout);
+}                               /* End of btree_display() */
@@ -0,0 +1,424 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_page.c
+ *
+ *  Trees kept in a file.
+ *
+ *  btree_open() ties a tree to a file of fixed-size pages: the
+ *  first one describes the tree (settings, root, what is free),
+ *  each node takes a page of its own, and string keys are copied
+ *  into blocks of consecutive pages. The file is mapped into
+ *  memory with mmap() and the arenas of the tree (btree_arena.c)
+ *  take their nodes and key blocks from its pages: the tree is
+ *  changed in place, by the same code as any other tree, and
+ *  btree_sync() makes the changes durable.
+ *
+ *  Pages of a mapped file may reach the disk at any time, while
+ *  the header (root, free list, current key block) is only
+ *  brought up to date by btree_sync(): a crash between two syncs
+ *  can leave new nodes under an old root. The header therefore
+ *  says whether the file is being changed: the first change after
+ *  a sync marks it, on disk, before anything else is written, and
+ *  btree_sync() clears the mark once everything else is on disk.
+ *  btree_open() refuses a file still marked.
+ *
+ *  Nodes reference each other and their keys by address. The
+ *  address where the file was mapped is recorded in it, and the
+ *  file is mapped there again when it's opened (much room is
+ *  reserved beyond its end, so that it can grow where it is):
+ *  a tree that was saved is then usable at once, without
+ *  reading it. If that address is taken, the file is mapped
+ *  elsewhere and every address it holds is moved by the same
+ *  distance, in one walk of the tree.
+ *
+ *  If a cache size was set (btree_setcache()), the file isn't
+ *  mapped: pages go through a buffer pool (btree_pool.c), that
+ *  only keeps that many of them in memory, and the header page
+ *  stays pinned there.
+ *
+ *  Values belong to the program that stores them and can't be
+ *  kept in a file: a tree in a file only holds keys. Which keys
+ *  are interned (btree_setintern()) isn't kept either: the table
+ *  is rebuilt from the tree when the file is opened.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define PAGE_BYTES    4096
+#define PAGE_MAGIC    "BTREEPG1"
+#define PAGE_RESERVE  ((size_t)1 << 36)   // Addresses kept for growth
+#define PAGE_GROWTH   ((size_t)64 << 20)  // The file grows by up to that
+
+// First page of the file
+typedef struct page_hdr_t {
+          char      magic[8];
+          uint32_t  pagesize;
+          char      keytype;
+          char      unique;
+          char      plus;
+          char      prefix;
+          char      topdown;
+          short     maxkeys;
+          short     last_id;
+          char     *base;       // Where the file is mapped
+          uint64_t  pages;      // Pages in use, this one included
+          NODE_T   *root;
+          void     *freenodes;  // Free list of the node arena
+          void     *keyblock;   // Current block of the key arena
+          uint64_t  keyused;    // and bytes used in it
+          uint64_t  dirty;      // Changed since the last sync
+         } PAGE_HDR_T;
+
+struct pagefile_t {
+          int          fd;
+          char        *base;
+          size_t       size;   // Of the file, in bytes
+          PAGE_HDR_T  *hdr;    // At base
+          POOL_T      *pool;   // NULL if the file is mapped
+         };
+
+static void *page_more(void *ctx, size_t size) {
+    // Source of the arenas: the next pages of the file,
+    // which is extended when they are past its end
+    PAGEFILE_T *pf = (PAGEFILE_T *)ctx;
+    uint64_t    cnt = (size + PAGE_BYTES - 1) / PAGE_BYTES;
+    size_t      need = (pf->hdr->pages + cnt) * PAGE_BYTES;
+    size_t      newsize;
+    char       *p;
+
+    if (need > PAGE_RESERVE) {
+      return NULL;
+    }
+    if (need > pf->size) {
+      newsize = pf->size + (pf->size < PAGE_GROWTH ? pf->size : PAGE_GROWTH);
+      if (newsize < need) {
+        newsize = need;
+      }
+      if (newsize > PAGE_RESERVE) {
+        newsize = PAGE_RESERVE;
+      }
+      if (ftruncate(pf->fd, (off_t)newsize)) {
+        perror("ftruncate");
+        return NULL;
+      }
+      pf->size = newsize;
+    }
+    p = pf->base + pf->hdr->pages * PAGE_BYTES;
+    pf->hdr->pages += cnt;
+    return p;
+}
+
+static void page_attach(BTREE_T *t, PAGEFILE_T *pf) {
+    // New arenas for the tree, that take pages from the file
+    ARENA_T    *nodes;
+    KEYARENA_T *keys;
+    size_t      nodesize = sizeof(NODE_T)
+                           + (1 + btree_maxkeys(t))
+                             * (sizeof(REDIRECT_T) + btree_keysize(t));
+
+    nodes = arena_new((nodesize + PAGE_BYTES - 1) & ~(size_t)(PAGE_BYTES - 1));
+    assert(nodes);
+    arena_setsource(nodes, page_more, pf);
+    keys = keyarena_new(btree_intern(t));
+    assert(keys);
+    keyarena_setsource(keys, page_more, pf);
+    btree_setarenas(t, nodes, keys);
+    btree_setfile(t, pf);
+}
+
+static int page_hdrsync(PAGEFILE_T *pf) {
+    // Writes the header to disk - with a pool, every page
+    // changed, which at the times it's called is the header
+    if (pf->pool) {
+      return pool_sync(pf->pool);
+    }
+    if (msync(pf->base, PAGE_BYTES, MS_SYNC)) {
+      perror("msync");
+      return -1;
+    }
+    return 0;
+}
+
+static void node_intern(BTREE_T *t, NODE_T *n) {
+    // Puts the keys of the subtree back into the interning
+    // table of the key arena
+    short i;
+
+    if (n->pfx) {
+      keyarena_intern(btree_keyarena(t), n->pfx);
+    }
+    for (i = 0; i <= n->keycnt; i++) {
+      if (i && n->k[i].key) {
+        keyarena_intern(btree_keyarena(t), n->k[i].key);
+      }
+      if (n->k[i].bigger) {
+        node_intern(t, n->k[i].bigger);
+      }
+    }
+}
+
+#define RELOC(p, delta)  if (p) { (p) = (void *)((char *)(p) + (delta)); }
+
+static void node_relocate(NODE_T *n, ptrdiff_t delta) {
+    // Moves what n references by delta bytes, then its subtrees
+    short i;
+
+    RELOC(n->k, delta);
+    RELOC(n->nk, delta);
+    RELOC(n->pfx, delta);
+    RELOC(n->next, delta);
+    RELOC(n->prev, delta);
+    for (i = 0; i <= n->keycnt; i++) {
+      RELOC(n->k[i].key, delta);
+      RELOC(n->k[i].bigger, delta);
+      if (n->k[i].bigger) {
+        node_relocate(n->k[i].bigger, delta);
+      }
+    }
+}
+
+static int page_settings(BTREE_T *t, PAGE_HDR_T *hdr) {
+    // The tree takes the settings of the file; those that
+    // change how nodes are linked must already be the same
+    if ((hdr->plus != btree_plus(t)) || (hdr->prefix != btree_prefix(t))) {
+      fprintf(stderr, "File created %s B+tree mode and %s compressed keys\n",
+              (hdr->plus ? "in" : "out of"), (hdr->prefix ? "with" : "without"));
+      return -1;
+    }
+    btree_setkeytype(t, hdr->keytype);
+    btree_setmaxkeys(t, hdr->maxkeys);
+    if (hdr->unique) {
+      btree_setunique(t);
+    }
+    if (hdr->topdown) {
+      btree_settopdown(t);
+    }
+    return 0;
+}
+
+extern int btree_open(BTREE_T *t, const char *path) {
+    // Keeps the tree in the file at path, created with the
+    // settings of the tree if it doesn't exist; otherwise the
+    // tree is what the file holds, with its settings. The tree
+    // must be empty, and can't be used by several threads.
+    // Returns 0, -1 if the file can't be used - among other
+    // reasons because it was changed and not synced (the
+    // program crashed), and may be inconsistent.
+    PAGEFILE_T  *pf;
+    PAGE_HDR_T   hdr;
+    struct stat  st;
+    int          fd;
+    ptrdiff_t    delta = 0;
+
+    assert(t && path);
+    if (btree_concurrent(t)) {
+      fprintf(stderr, "%s: a concurrent tree can't be kept in a file\n", path);
+      return -1;
+    }
+    if (btree_file(t) || btree_root(t)) {
+      fprintf(stderr, "%s: tree already in use\n", path);
+      return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+      perror(path);
+      return -1;
+    }
+    if (fstat(fd, &st) == 0) {
+      if (st.st_size == 0) {
+        // New file, the header is written below
+        memset(&hdr, 0, sizeof(hdr));
+      } else if ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+                 || memcmp(hdr.magic, PAGE_MAGIC, sizeof(hdr.magic))
+                 || (hdr.pagesize != PAGE_BYTES)) {
+        fprintf(stderr, "%s: not a tree file\n", path);
+        close(fd);
+        return -1;
+      } else if (hdr.dirty) {
+        fprintf(stderr, "%s: changed and not synced when last used,"
+                        " the tree may be damaged\n", path);
+        close(fd);
+        return -1;
+      } else if (page_settings(t, &hdr)) {
+        close(fd);
+        return -1;
+      }
+    } else {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    pf = (PAGEFILE_T *)malloc(sizeof(PAGEFILE_T));
+    assert(pf);
+    pf->fd = fd;
+    pf->size = (size_t)st.st_size;
+    if ((pf->size == 0) && ftruncate(fd, PAGE_BYTES)) {
+      perror(path);
+      free(pf);
+      close(fd);
+      return -1;
+    }
+    if (pf->size == 0) {
+      pf->size = PAGE_BYTES;
+    }
+    // Where it was mapped last time, if possible
+    pf->pool = NULL;
+    if (btree_cache(t)) {
+      if ((pf->pool = pool_new(fd, hdr.base, PAGE_RESERVE,
+                               btree_cache(t))) == NULL) {
+        free(pf);
+        close(fd);
+        return -1;
+      }
+      pf->base = pool_base(pf->pool);
+      pool_pin(pf->pool, pf->base);
+    } else {
+      pf->base = (char *)mmap(hdr.base, PAGE_RESERVE, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_NORESERVE, fd, 0);
+      if (pf->base == MAP_FAILED) {
+        perror("mmap");
+        free(pf);
+        close(fd);
+        return -1;
+      }
+    }
+    pf->hdr = (PAGE_HDR_T *)pf->base;
+    if (st.st_size == 0) {
+      memcpy(pf->hdr->magic, PAGE_MAGIC, sizeof(pf->hdr->magic));
+      pf->hdr->pagesize = PAGE_BYTES;
+      pf->hdr->keytype = btree_keytype(t);
+      pf->hdr->unique = btree_unique(t);
+      pf->hdr->plus = btree_plus(t);
+      pf->hdr->prefix = btree_prefix(t);
+      pf->hdr->topdown = btree_topdown(t);
+      pf->hdr->maxkeys = btree_maxkeys(t);
+      pf->hdr->base = pf->base;
+      pf->hdr->pages = 1;
+    } else if (pf->base != hdr.base) {
+      delta = pf->base - hdr.base;
+      debug(0, "%s mapped %ld bytes away from last time", path, (long)delta);
+    }
+    page_attach(t, pf);
+    RELOC(pf->hdr->root, delta);
+    RELOC(pf->hdr->freenodes, delta);
+    RELOC(pf->hdr->keyblock, delta);
+    if (delta && pf->hdr->root) {
+      node_relocate(pf->hdr->root, delta);
+    }
+    arena_setfreelist(btree_nodearena(t), pf->hdr->freenodes);
+    keyarena_setblock(btree_keyarena(t), pf->hdr->keyblock,
+                      (size_t)pf->hdr->keyused);
+    if (delta) {
+      arena_relocate(btree_nodearena(t), delta);
+      keyarena_relocate(btree_keyarena(t), delta);
+      pf->hdr->base = pf->base;
+    }
+    btree_setlastid(t, pf->hdr->last_id);
+    btree_setroot(t, pf->hdr->root);
+    if (btree_intern(t) && !btree_keysize(t) && pf->hdr->root) {
+      node_intern(t, pf->hdr->root);
+    }
+    return 0;
+}
+
+extern void page_touch(BTREE_T *t) {
+    // Called before the tree is changed: the first change
+    // after a sync marks the file as being changed, on disk
+    PAGEFILE_T *pf = btree_file(t);
+
+    if (pf && !pf->hdr->dirty) {
+      pf->hdr->dirty = 1;
+      (void)page_hdrsync(pf);
+    }
+}
+
+extern int btree_sync(BTREE_T *t) {
+    // Writes to the file what isn't there yet, and returns
+    // once it's on disk: 0, -1 if it failed. For a tree in
+    // memory, flushes its log if it has one.
+    PAGEFILE_T *pf = btree_file(t);
+    size_t      used;
+
+    if (pf == NULL) {
+      return (btree_log(t) ? log_sync(t) : 0);
+    }
+    pf->hdr->root = btree_root(t);
+    pf->hdr->last_id = btree_lastid(t);
+    pf->hdr->freenodes = arena_freelist(btree_nodearena(t));
+    pf->hdr->keyblock = keyarena_block(btree_keyarena(t), &used);
+    pf->hdr->keyused = used;
+    // Everything, the header still marked, then the header
+    if (pf->pool) {
+      if (pool_sync(pf->pool)) {
+        return -1;
+      }
+    } else if (msync(pf->base, pf->hdr->pages * PAGE_BYTES, MS_SYNC)) {
+      perror("msync");
+      return -1;
+    }
+    if (pf->hdr->dirty) {
+      pf->hdr->dirty = 0;
+      return page_hdrsync(pf);
+    }
+    return 0;
+}
+
+extern int btree_cachestats(BTREE_T *t, POOL_STATS_T *s) {
+    // Counters of the buffer pool of the tree; returns 0,
+    // -1 if the tree has none
+    PAGEFILE_T *pf = btree_file(t);
+
+    if ((pf == NULL) || (pf->pool == NULL)) {
+      return -1;
+    }
+    pool_stats(pf->pool, s);
+    return 0;
+}
+
+extern void page_clear(BTREE_T *t) {
+    // The tree has been emptied (and its arenas released):
+    // so is the file
+    PAGEFILE_T *pf = btree_file(t);
+
+    page_touch(t);
+    pf->hdr->pages = 1;
+    pf->hdr->root = NULL;
+    pf->hdr->freenodes = NULL;
+    pf->hdr->keyblock = NULL;
+    pf->hdr->keyused = 0;
+    if (ftruncate(pf->fd, PAGE_BYTES) == 0) {
+      pf->size = PAGE_BYTES;
+    }
+    if (pf->pool) {
+      pool_drop(pf->pool);
+    }
+    page_attach(t, pf);
+}
+
+extern void page_close(BTREE_T *t) {
+    // Syncs the file and detaches it from the tree, that
+    // is left empty; its arenas, that no longer have pages,
+    // remain to be released (btree_clear())
+    PAGEFILE_T *pf = btree_file(t);
+
+    (void)btree_sync(t);
+    btree_setroot(t, NULL);
+    btree_setfile(t, NULL);
+    if (pf->pool) {
+      pool_free(pf->pool);
+    } else {
+      munmap(pf->base, PAGE_RESERVE);
+    }
+    close(pf->fd);
+    free(pf);
+}
@@ -0,0 +1,393 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_pool.c
+ *
+ *  A bounded cache of the pages of a file (buffer pool).
+ *
+ *  A tree in a file (btree_page.c) is mapped into memory as a
+ *  whole, and it's the system that decides what stays in memory.
+ *  With a pool, the same addresses are reserved but nothing is
+ *  mapped there: the first access to a page faults, and the
+ *  handler of the fault reads the page from the file (pread())
+ *  before letting the access go on. At most a given number of
+ *  pages (the frames of the pool) are in memory; when all of
+ *  them are taken, a page goes out to make room, written back
+ *  first (pwrite()) if it was changed. The tree code doesn't know
+ *  about it: nodes are still reached by address.
+ *
+ *  The page that goes out is chosen by a clock: a hand turns over
+ *  the frames, and gives a second chance to those used since it
+ *  last went by. What the page protection tells is all that's
+ *  known about accesses:
+ *    - a page read from the file is readable only, and marked as
+ *      used; a write to it faults again and marks it as changed
+ *      (it becomes writable);
+ *    - when the hand goes by a page marked as used, the mark is
+ *      removed and the page made inaccessible: the next access
+ *      faults, puts the mark back and restores the protection.
+ *      Such a fault is a refault;
+ *    - a page that the hand finds without the mark goes out.
+ *  Pinned pages are never taken out.
+ *
+ *  Accesses to pages in memory aren't seen, only refaults: at
+ *  most one per page and turn of the hand. Refaults and misses
+ *  don't give a hit ratio. The hand removes the protection of
+ *  consecutive pages in one call.
+ *
+ *  The pool takes over SIGSEGV while it exists; faults outside
+ *  its pages go to the handler that was there before. Most of
+ *  the work is done in the handler, that only makes calls safe
+ *  in a signal handler and stops the program (abort()) if one of
+ *  them fails. A pool isn't meant for trees shared by threads,
+ *  and system calls given an address in it get EFAULT for pages
+ *  that aren't accessible, instead of faulting them in.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define POOL_MINFRAMES  8
+
+// State of a page
+#define PG_IN     1   // In memory, in a frame
+#define PG_USED   2   // Accessed since the hand went by
+#define PG_DIRTY  4   // Changed since read or written
+#define PG_PIN    8   // Never taken out
+
+struct pool_t {
+          int       fd;
+          char     *base;
+          size_t    reserve;   // Bytes reserved at base
+          size_t    pagesize;
+          uint8_t  *state;     // One per page of the reserve
+          int64_t  *frame;     // Page in each frame
+          size_t    frames;
+          size_t    used;      // Frames taken
+          size_t    hand;
+          size_t    pinned;
+          POOL_STATS_T stats;
+          POOL_T   *next;      // Other pools
+         };
+
+// A fault only says where it happened: pools are found
+// in a list
+static POOL_T           *G_pools = NULL;
+static struct sigaction  G_oldact;   // Handler for other faults
+
+static void pool_fail(const char *what) {
+    // Called from the handler of faults: no stdio
+    static const char msg[] = "btree_pool: failed: ";
+
+    (void)!write(2, msg, sizeof(msg) - 1);
+    (void)!write(2, what, strlen(what));
+    (void)!write(2, "\n", 1);
+    abort();
+}
+
+static void pages_protect(POOL_T *p, int64_t from, int64_t to, int prot) {
+    // Pages from to to (excluded)
+    if ((from < to)
+        && mprotect(p->base + from * p->pagesize,
+                    (size_t)(to - from) * p->pagesize, prot)) {
+      pool_fail("mprotect");
+    }
+}
+
+static void page_protect(POOL_T *p, int64_t pg, int prot) {
+    pages_protect(p, pg, pg + 1, prot);
+}
+
+static void page_out(POOL_T *p, int64_t pg) {
+    // Writes the page to the file if it was changed,
+    // then gives its memory back
+    char *addr = p->base + pg * p->pagesize;
+
+    if (p->state[pg] & PG_DIRTY) {
+      page_protect(p, pg, PROT_READ);
+      if (pwrite(p->fd, addr, p->pagesize, (off_t)(pg * p->pagesize))
+          != (ssize_t)p->pagesize) {
+        pool_fail("pwrite");
+      }
+      p->stats.writes++;
+    }
+    (void)madvise(addr, p->pagesize, MADV_DONTNEED);
+    page_protect(p, pg, PROT_NONE);
+    p->state[pg] = 0;
+}
+
+static size_t frame_get(POOL_T *p) {
+    // Returns a free frame, taking a page out if needed
+    int64_t pg;
+    int64_t from = 0;   // Pages to make inaccessible
+    int64_t to = 0;
+    size_t  f;
+
+    if (p->used < p->frames) {
+      return p->used++;
+    }
+    for (;;) {
+      f = p->hand;
+      p->hand = (p->hand + 1) % p->frames;
+      pg = p->frame[f];
+      if (p->state[pg] & PG_PIN) {
+        continue;
+      }
+      if (p->state[pg] & PG_USED) {
+        // Second chance; frames filled one after the other
+        // often hold consecutive pages
+        p->state[pg] &= ~PG_USED;
+        if (pg != to) {
+          pages_protect(p, from, to, PROT_NONE);
+          from = pg;
+        }
+        to = pg + 1;
+        continue;
+      }
+      pages_protect(p, from, to, PROT_NONE);
+      page_out(p, pg);
+      p->stats.evictions++;
+      return f;
+    }
+}
+
+static void page_in(POOL_T *p, int64_t pg) {
+    // Brings the page into memory, readable
+    char    *addr = p->base + pg * p->pagesize;
+    size_t   f = frame_get(p);
+    ssize_t  len;
+
+    page_protect(p, pg, PROT_READ | PROT_WRITE);
+    // Past the end of the file, the page stays zeroed
+    if ((len = pread(p->fd, addr, p->pagesize, (off_t)(pg * p->pagesize))) < 0) {
+      pool_fail("pread");
+    }
+    page_protect(p, pg, PROT_READ);
+    p->frame[f] = pg;
+    p->state[pg] = PG_IN | PG_USED;
+    p->stats.misses++;
+}
+
+static void page_fault(POOL_T *p, int64_t pg) {
+    uint8_t s = p->state[pg];
+
+    if ((s & PG_IN) == 0) {
+      page_in(p, pg);
+    } else if ((s & PG_USED) == 0) {
+      // Protection removed by the hand
+      p->state[pg] |= PG_USED;
+      page_protect(p, pg, (s & PG_DIRTY) ? PROT_READ | PROT_WRITE : PROT_READ);
+      p->stats.refaults++;
+    } else {
+      // Readable, so a write
+      p->state[pg] |= PG_DIRTY;
+      page_protect(p, pg, PROT_READ | PROT_WRITE);
+    }
+}
+
+static void pool_handler(int sig, siginfo_t *si, void *ctx) {
+    char   *addr = (char *)si->si_addr;
+    POOL_T *p;
+
+    for (p = G_pools; p; p = p->next) {
+      if ((addr >= p->base) && (addr < p->base + p->reserve)) {
+        page_fault(p, (int64_t)((addr - p->base) / p->pagesize));
+        return;
+      }
+    }
+    // Not a page of a pool
+    if (G_oldact.sa_flags & SA_SIGINFO) {
+      G_oldact.sa_sigaction(sig, si, ctx);
+    } else if ((G_oldact.sa_handler != SIG_DFL)
+               && (G_oldact.sa_handler != SIG_IGN)) {
+      G_oldact.sa_handler(sig);
+    } else if (si->si_code > 0) {
+      // A fault, that the system doesn't let a program ignore:
+      // the program ends as it would have, when the access
+      // faults again once the default action is restored
+      signal(SIGSEGV, SIG_DFL);
+    } else if (G_oldact.sa_handler == SIG_DFL) {
+      // Sent by kill(): delivered again, with the default
+      // action, once the handler returns
+      signal(SIGSEGV, SIG_DFL);
+      raise(SIGSEGV);
+    }
+    // Sent and ignored: the handler stays
+}
+
+extern POOL_T *pool_new(int fd, void *hint, size_t reserve, size_t frames) {
+    // Reserves reserve bytes, at hint if possible, for the
+    // pages of the open file fd, at most frames of which are
+    // in memory at the same time. Returns NULL on failure.
+    POOL_T           *p;
+    struct sigaction  act;
+
+    if (frames < POOL_MINFRAMES) {
+      frames = POOL_MINFRAMES;
+    }
+    if ((p = (POOL_T *)malloc(sizeof(POOL_T))) == NULL) {
+      return NULL;
+    }
+    memset(p, 0, sizeof(POOL_T));
+    p->fd = fd;
+    p->pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    p->reserve = (reserve + p->pagesize - 1) & ~(p->pagesize - 1);
+    p->frames = frames;
+    p->base = (char *)mmap(hint, p->reserve, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    // One byte per page, only touched where pages are used
+    p->state = (uint8_t *)mmap(NULL, p->reserve / p->pagesize,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+    p->frame = (int64_t *)malloc(frames * sizeof(int64_t));
+    if ((p->base == MAP_FAILED) || (p->state == MAP_FAILED)
+        || (p->frame == NULL)) {
+      perror("pool_new");
+      if (p->base != MAP_FAILED) {
+        munmap(p->base, p->reserve);
+      }
+      if (p->state != MAP_FAILED) {
+        munmap(p->state, p->reserve / p->pagesize);
+      }
+      free(p->frame);
+      free(p);
+      return NULL;
+    }
+    p->stats.frames = frames;
+    if (G_pools == NULL) {
+      memset(&act, 0, sizeof(act));
+      act.sa_sigaction = pool_handler;
+      act.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&act.sa_mask);
+      sigaction(SIGSEGV, &act, &G_oldact);
+    }
+    p->next = G_pools;
+    G_pools = p;
+    debug(0, "pool of %lu frames at %p", (unsigned long)frames, p->base);
+    return p;
+}
+
+extern char *pool_base(POOL_T *p) {
+    assert(p);
+    return p->base;
+}
+
+extern void pool_pin(POOL_T *p, void *addr) {
+    // The page at addr is read if needed and stays in memory,
+    // writable, until unpinned
+    int64_t pg = (int64_t)(((char *)addr - p->base) / p->pagesize);
+
+    assert(p && (p->pinned + 1 < p->frames));
+    if ((p->state[pg] & PG_IN) == 0) {
+      page_in(p, pg);
+    }
+    if ((p->state[pg] & PG_PIN) == 0) {
+      p->state[pg] |= PG_PIN | PG_USED | PG_DIRTY;
+      page_protect(p, pg, PROT_READ | PROT_WRITE);
+      p->pinned++;
+    }
+}
+
+extern void pool_unpin(POOL_T *p, void *addr) {
+    int64_t pg = (int64_t)(((char *)addr - p->base) / p->pagesize);
+
+    assert(p);
+    if (p->state[pg] & PG_PIN) {
+      p->state[pg] &= ~PG_PIN;
+      p->pinned--;
+    }
+}
+
+extern int pool_sync(POOL_T *p) {
+    // Writes the pages that were changed, and returns once
+    // they are on disk: 0, -1 if it failed
+    size_t   f;
+    int64_t  pg;
+    char    *addr;
+
+    assert(p);
+    for (f = 0; f < p->used; f++) {
+      pg = p->frame[f];
+      if (p->state[pg] & PG_DIRTY) {
+        addr = p->base + pg * p->pagesize;
+        if ((p->state[pg] & PG_PIN) == 0) {
+          // The hand may have made it inaccessible, and the
+          // system doesn't fault pages in for pwrite()
+          page_protect(p, pg, PROT_READ);
+        }
+        if (pwrite(p->fd, addr, p->pagesize, (off_t)(pg * p->pagesize))
+            != (ssize_t)p->pagesize) {
+          perror("pwrite");
+          return -1;
+        }
+        p->stats.writes++;
+        if ((p->state[pg] & PG_PIN) == 0) {
+          // The next write will fault again
+          p->state[pg] &= ~PG_DIRTY;
+          page_protect(p, pg, (p->state[pg] & PG_USED) ? PROT_READ : PROT_NONE);
+        }
+      }
+    }
+    if (fsync(p->fd)) {
+      perror("fsync");
+      return -1;
+    }
+    return 0;
+}
+
+extern void pool_drop(POOL_T *p) {
+    // The file has been truncated: pages that aren't
+    // pinned are forgotten, without being written
+    size_t  f;
+    size_t  kept = 0;
+    int64_t pg;
+
+    assert(p);
+    for (f = 0; f < p->used; f++) {
+      pg = p->frame[f];
+      if (p->state[pg] & PG_PIN) {
+        p->frame[kept++] = pg;
+      } else {
+        p->state[pg] &= ~PG_DIRTY;
+        page_out(p, pg);
+      }
+    }
+    p->used = kept;
+    p->hand = 0;
+}
+
+extern void pool_stats(POOL_T *p, POOL_STATS_T *s) {
+    assert(p && s);
+    *s = p->stats;
+    s->used = p->used;
+}
+
+extern void pool_free(POOL_T *p) {
+    // Pages aren't written: pool_sync() first
+    POOL_T **pp;
+
+    if (p) {
+      for (pp = &G_pools; *pp && (*pp != p); pp = &((*pp)->next)) {
+        ;
+      }
+      if (*pp) {
+        *pp = p->next;
+      }
+      if (G_pools == NULL) {
+        sigaction(SIGSEGV, &G_oldact, NULL);
+      }
+      munmap(p->base, p->reserve);
+      munmap(p->state, p->reserve / p->pagesize);
+      free(p->frame);
+      free(p);
+    }
+}
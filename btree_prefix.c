@@ -0,0 +1,268 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_prefix.c
+ *
+ *  Prefix-compressed string keys.
+ *
+ *  When the tree is in prefix mode (btree_setprefix()), each
+ *  node stores once, in n->pfx and n->pfxlen, a prefix that all
+ *  its keys share, and slots only reference what follows it
+ *  (the suffix). A full key is the node prefix followed by the
+ *  suffix of its slot.
+ *
+ *  The prefix of a node comes from its "fences", the keys of
+ *  its ancestors that bound its subtree: every key between two
+ *  fences starts with their common prefix. Nodes on the edges of
+ *  the tree, that lack a fence, use their own first or last key.
+ *  Prefixes are set when a node is split (or after a bulk load),
+ *  and may only grow at that point - which just moves suffix
+ *  pointers forward.
+ *  When a key that doesn't start with the prefix of a node gets
+ *  into it (after keys have been borrowed between siblings, or
+ *  merged), the prefix shrinks, and suffixes are copied again
+ *  with what they lose from the prefix in front of them.
+ *  The space of the old copies is recovered by btree_compact().
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+static short common_len(const char *a, short alen, const char *b, short blen) {
+    short i = 0;
+
+    while ((i < alen) && (i < blen) && (a[i] == b[i])) {
+      i++;
+    }
+    return i;
+}
+
+static short key_common(NODE_T *n, const char *key) {
+    // Length of what the key shares with the node prefix
+    short i = 0;
+
+    while ((i < n->pfxlen) && key[i] && (key[i] == n->pfx[i])) {
+      i++;
+    }
+    return i;
+}
+
+static char *concat_store(BTREE_T *t, const char *head, short headlen,
+                          const char *tail) {
+    // Stores head (headlen bytes) followed by the
+    // string tail in the key arena
+    char   *k;
+    char   *p;
+    size_t  len = headlen + strlen(tail) + 1;
+
+    if (headlen == 0) {
+      return key_save(t, tail, len);
+    }
+    p = (char *)malloc(len);
+    assert(p);
+    memcpy(p, head, headlen);
+    strcpy(p + headlen, tail);
+    k = key_save(t, p, len);
+    free(p);
+    return k;
+}
+
+extern char *pfx_full(NODE_T *n, short pos, char **bufptr, size_t *sizeptr) {
+    // Rebuilds the full key at pos in *bufptr, which is
+    // (re)allocated if needed
+    char   *suffix = n->k[pos].key;
+    size_t  len;
+
+    if (suffix == NULL) {
+      return NULL;
+    }
+    len = n->pfxlen + strlen(suffix) + 1;
+    if (len > *sizeptr) {
+      *bufptr = (char *)realloc(*bufptr, len);
+      assert(*bufptr);
+      *sizeptr = len;
+    }
+    if (n->pfxlen) {
+      memcpy(*bufptr, n->pfx, n->pfxlen);
+    }
+    strcpy(*bufptr + n->pfxlen, suffix);
+    return *bufptr;
+}
+
+static void pfx_shrink(BTREE_T *t, NODE_T *n, short len) {
+    // Shortens the prefix of the node, suffixes get
+    // back what the prefix loses
+    short i;
+
+    assert(len < n->pfxlen);
+    debug(0, "prefix of node %hd shrinks from %hd to %hd bytes",
+          n->id, n->pfxlen, len);
+    for (i = 1; i <= btree_maxkeys(t); i++) {
+      if (n->k[i].key) {
+        n->k[i].key = concat_store(t, n->pfx + len, n->pfxlen - len,
+                                   n->k[i].key);
+      }
+    }
+    n->pfxlen = len;
+    if (len == 0) {
+      n->pfx = NULL;
+    }
+}
+
+static void pfx_grow(BTREE_T *t, NODE_T *n, const char *pfx, short len) {
+    // Lengthens the prefix of the node - all keys in
+    // the node must start with the len bytes of pfx
+    short i;
+    short delta = len - n->pfxlen;
+
+    assert(delta > 0);
+    debug(0, "prefix of node %hd grows from %hd to %hd bytes",
+          n->id, n->pfxlen, len);
+    for (i = 1; i <= n->keycnt; i++) {
+      n->k[i].key += delta;
+    }
+    n->pfx = key_save(t, pfx, len);
+    n->pfxlen = len;
+}
+
+extern char *pfx_adopt(BTREE_T *t, NODE_T *dst, const char *pfx,
+                       short pfxlen, char *suffix) {
+    // Returns what must be stored in a slot of dst for the
+    // key that is pfx (pfxlen bytes) followed by suffix,
+    // shrinking the prefix of dst if it doesn't fit.
+    // The slot must have been cleared beforehand.
+    short common;
+
+    common = common_len(dst->pfx, dst->pfxlen, pfx, pfxlen);
+    if (common == pfxlen) {
+      // pfx is all in the prefix of dst, what follows
+      // must be checked against the suffix
+      short i = 0;
+
+      while ((common + i < dst->pfxlen)
+             && suffix[i] && (suffix[i] == dst->pfx[common + i])) {
+        i++;
+      }
+      common += i;
+    }
+    if (common < dst->pfxlen) {
+      pfx_shrink(t, dst, common);
+    }
+    if (dst->pfxlen >= pfxlen) {
+      // Same or longer prefix - just skip what it covers
+      return suffix + (dst->pfxlen - pfxlen);
+    }
+    // Shorter prefix
+    return concat_store(t, pfx + dst->pfxlen, pfxlen - dst->pfxlen, suffix);
+}
+
+extern char *pfx_store(BTREE_T *t, NODE_T *n, char *key) {
+    // Returns what must be stored in a slot of n for a full
+    // key - a copy of what follows the prefix.
+    // The slot must have been cleared beforehand.
+    short common = key_common(n, key);
+
+    if (common < n->pfxlen) {
+      pfx_shrink(t, n, common);
+    }
+    return key_save(t, key + n->pfxlen,
+                           strlen(key + n->pfxlen) + 1);
+}
+
+extern void pfx_fit(BTREE_T *t, NODE_T *n, char *lo, char *hi) {
+    // Gives n the longest prefix that its fences, lo and
+    // hi, allow. At the edges of the tree, where a fence is
+    // missing, the first or last key of the node stands for
+    // it (a key that goes past it may shrink the prefix later).
+    short   len;
+    char   *first = NULL;
+    char   *last = NULL;
+    size_t  firstsize = 0;
+    size_t  lastsize = 0;
+
+    if (n->keycnt == 0) {
+      return;
+    }
+    if (lo == NULL) {
+      lo = pfx_full(n, 1, &first, &firstsize);
+    }
+    if (hi == NULL) {
+      hi = pfx_full(n, n->keycnt, &last, &lastsize);
+    }
+    if (lo && hi) {
+      len = common_len(lo, (short)strlen(lo), hi, (short)strlen(hi));
+      if (len > n->pfxlen) {
+        pfx_grow(t, n, lo, len);
+      }
+    }
+    free(first);
+    free(last);
+}
+
+extern void pfx_fences(PATH_T *path, char **loptr, char **hiptr) {
+    // Copies into *loptr and *hiptr (NULL if there is none)
+    // the fences of the node that path leads to: going up,
+    // the lower one is the first key on the left of the
+    // path, the upper one the first key on the right.
+    // Both must be freed by the caller.
+    NODE_T *p;
+    char   *lo = NULL;
+    char   *hi = NULL;
+    size_t  losize = 0;
+    size_t  hisize = 0;
+    char    lo_found = 0;
+    char    hi_found = 0;
+    short   d;
+    short   j;
+
+    for (d = path->depth - 1; (d >= 0) && (!lo_found || !hi_found); d--) {
+      p = path->n[d];
+      j = path->pos[d];
+      if (!lo_found && (j >= 1)) {
+        lo_found = (pfx_full(p, j, &lo, &losize) != NULL);
+      }
+      if (!hi_found && (j < p->keycnt)) {
+        hi_found = (pfx_full(p, j + 1, &hi, &hisize) != NULL);
+      }
+    }
+    *loptr = lo;
+    *hiptr = hi;
+}
+
+extern void pfx_fit_tree(BTREE_T *t, NODE_T *n, char *lo, char *hi) {
+    // pfx_fit() for a whole subtree
+    if (n) {
+      short   i;
+      char   *key = NULL;
+      char   *prev = NULL;
+      size_t  keysize = 0;
+      size_t  prevsize = 0;
+      char   *tmp;
+      size_t  tmpsize;
+
+      pfx_fit(t, n, lo, hi);
+      if (!_is_leaf(n)) {
+        for (i = 0; i <= n->keycnt; i++) {
+          if (i < n->keycnt) {
+            pfx_full(n, i + 1, &key, &keysize);
+          }
+          pfx_fit_tree(t, n->k[i].bigger,
+                       (i ? prev : lo), (i < n->keycnt ? key : hi));
+          // What is on the right becomes what is on the left
+          tmp = prev;
+          tmpsize = prevsize;
+          prev = key;
+          prevsize = keysize;
+          key = tmp;
+          keysize = tmpsize;
+        }
+      }
+      free(key);
+      free(prev);
+    }
+}
@@ -13,47 +13,375 @@
 #include "btree.h"
 #include "debug.h"
 
-static void find_key_loc(NODE_T *n, char *key, KEYLOC_T *locptr, short lvl) {
-    short     i = 1;
-    int       cmp = -1;
+static void find_key_loc(BTREE_T *t, NODE_T *n, char *key,
+                         KEYLOC_T *locptr, short lvl) {
+    short     i;
+    int       cmp;
 
-    // Find the leaf node where the key should be stored
     if (n && key && locptr) {
-      debug(lvl, "searching node %hd", n->id);
-      while ((i <= n->keycnt)
-             && ((cmp = btree_keycmp(key, n->k[i].key)) > 0)) {
-        i++;
-      }
+      n = node_descend(t, n, key, &i, &cmp, &lvl, NULL);
       if (cmp == 0) {
         // We've found it in the tree
         debug(lvl, "** found at position %hd", i);
         locptr->n = n;
         locptr->pos = i;
-        return;
+      }
+    }
+}
+
+extern NODE_T *latched_descend(BTREE_T *t, char *key, short *posptr,
+                               int *cmpptr) {
+    // Concurrent trees: latch coupling from the root to the
+    // node that holds the key (*cmpptr is then 0) or the leaf
+    // where it would be, returned latched with the position
+    // in *posptr (see node_search()). NULL if the tree is
+    // empty. Nothing changes the structure of the tree, one
+    // latch is released as soon as the next one is held.
+    NODE_T *n;
+    NODE_T *c;
+    short   pos;
+    int     cmp;
+
+    tree_wrlock(t);
+    if ((n = btree_root(t)) == NULL) {
+      tree_wrunlock(t);
+      return NULL;
+    }
+    node_wrlock(t, n);
+    tree_wrunlock(t);
+    while (1) {
+      pos = node_search(t, n, key, &cmp);
+      if (_is_leaf(n) || ((cmp == 0) && !btree_plus(t))) {
+        break;
+      }
+      c = n->k[cmp ? pos - 1 : pos].bigger;
+      node_wrlock(t, c);
+      node_wrunlock(t, n);
+      n = c;
+    }
+    *posptr = pos;
+    *cmpptr = cmp;
+    return n;
+}
+
+// Optimistic reads of a concurrent tree (see btree_latch.c).
+// What is read in a node may be half changed, and is only
+// used once the version of the node has been checked; the
+// caller must be between epoch_enter() and epoch_exit().
+
+extern NODE_T *optimistic_root(BTREE_T *t, uint32_t *vptr) {
+    // Returns the root, with its version in *vptr,
+    // NULL if the tree is empty
+    uint32_t  rv;
+    NODE_T   *n;
+
+    while (1) {
+      if (latch_version(btree_rootlatch(t), &rv) == 0) {
+        n = btree_root(t);
+        if (n == NULL) {
+          if (latch_check(btree_rootlatch(t), rv) == 0) {
+            return NULL;
+          }
+        } else if ((latch_check(btree_rootlatch(t), rv) == 0)
+                   && (latch_version(&(n->latch), vptr) == 0)
+                   && (latch_check(btree_rootlatch(t), rv) == 0)) {
+          return n;
+        }
+      }
+    }
+}
+
+extern int optimistic_child(NODE_T *n, uint32_t v, NODE_T *c,
+                            uint32_t *vptr) {
+    // Goes from n, read at version v, to c that was read in
+    // it, and notes the version of c in *vptr. Returns 0,
+    // -1 if n has changed (c may be anything) and the
+    // search must start again.
+    if ((latch_check(&(n->latch), v) == 0)
+        && (latch_version(&(c->latch), vptr) == 0)
+        && (latch_check(&(n->latch), v) == 0)) {
+      return 0;
+    }
+    return -1;
+}
+
+extern short optimistic_search(BTREE_T *t, NODE_T *n, char *key,
+                               int *cmpptr) {
+    // node_search() for a node that may be changing: returns
+    // -1 if a slot that references a key is found empty.
+    // Numeric keys are always somewhere in the node.
+    short  lo = 1;
+    short  hi;
+    short  mid;
+    int    cmp = 1;
+    char  *k;
+
+    if (btree_keysize(t)) {
+      return node_search(t, n, key, cmpptr);
+    }
+    hi = n->keycnt;
+    if ((hi < 0) || (hi > btree_maxkeys(t))) {
+      return -1;
+    }
+    // First key greater than or equal to key in [lo, hi+1]
+    hi++;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if ((k = n->k[mid].key) == NULL) {
+        return -1;
+      }
+      if (btree_keycmp(t, k, key) < 0) {
+        lo = mid + 1;
       } else {
-        if (cmp > 0) { // Key searched is bigger than
-                       // last key in the node
-          find_key_loc(n->k[n->keycnt].bigger, key, locptr, lvl+2);
-        } else {
-          find_key_loc(n->k[i-1].bigger, key, locptr, lvl+2);
+        hi = mid;
+      }
+    }
+    if (lo <= n->keycnt) {
+      if ((k = n->k[lo].key) == NULL) {
+        return -1;
+      }
+      cmp = (btree_keycmp(t, k, key) == 0 ? 0 : -1);
+    }
+    *cmpptr = cmp;
+    return lo;
+}
+
+static int optimistic_get(BTREE_T *t, char *key, void **valptr) {
+    // btree_get() for a concurrent tree, that writes nothing
+    // that other threads read
+    NODE_T   *n;
+    NODE_T   *c;
+    uint32_t  v;
+    uint32_t  cv;
+    short     pos;
+    int       cmp;
+    void     *value;
+    int       ret = 1;
+
+    epoch_enter();
+    while (ret > 0) {
+      if ((n = optimistic_root(t, &v)) == NULL) {
+        ret = -1;
+        break;
+      }
+      while (1) {
+        if ((pos = optimistic_search(t, n, key, &cmp)) < 0) {
+          break;
+        }
+        if ((cmp == 0) && (_is_leaf(n) || !btree_plus(t))) {
+          value = n->k[pos].value;
+          if (latch_check(&(n->latch), v) == 0) {
+            if (valptr) {
+              *valptr = value;
+            }
+            ret = 0;
+          }
+          break;
         }
+        if (_is_leaf(n)) {
+          if (latch_check(&(n->latch), v) == 0) {
+            ret = -1;
+          }
+          break;
+        }
+        c = n->k[cmp ? pos - 1 : pos].bigger;
+        if (optimistic_child(n, v, c, &cv)) {
+          break;
+        }
+        n = c;
+        v = cv;
       }
     }
+    epoch_exit();
+    return ret;
 }
 
-extern KEYLOC_T btree_find_key(char *key) {
+extern KEYLOC_T btree_find_key(BTREE_T *t, char *key) {
     KEYLOC_T  loc = {NULL, 0};
     debug(0, "looking for key location");
-    find_key_loc(btree_root(), key, &loc, 0);
+    find_key_loc(t, btree_root(t), key, &loc, 0);
     return loc;
 }
 
+extern int key_get(BTREE_T *t, char *k, void **valptr) {
+    // btree_get() for a parsed key
+    KEYLOC_T  loc = {NULL, 0};
+
+    if (btree_concurrent(t)) {
+      return optimistic_get(t, k, valptr);
+    }
+    find_key_loc(t, btree_root(t), k, &loc, 0);
+    if (loc.n == NULL) {
+      return -1;
+    }
+    if (valptr) {
+      *valptr = loc.n->k[loc.pos].value;
+    }
+    return 0;
+}
+
+extern int btree_get(BTREE_T *t, char *key, void **valptr) {
+    // Retrieves in *valptr the value associated with the key.
+    // Returns 0 if found, -1 if not.
+    KEYBUF_T  val;
+    char     *k;
+
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      return -1;
+    }
+    return key_get(t, k, valptr);
+}
+
+// Lookups in a group advance one step at a time in turn: the
+// node or the slot that a lookup needs next is prefetched, and
+// read when its turn comes again, after the others have moved
+#define MGET_GROUP  16
+#define MGET_LINE   64   // Bytes in a cache line
+
+typedef struct mget_t {
+          int         idx;      // Of the key in the caller's arrays
+          char       *key;      // Parsed
+          KEYBUF_T    keybuf;   // Numeric key
+          NODE_T     *n;        // Node to search next, or
+          REDIRECT_T *slot;     // slot to read next: the child
+          char        hit;      // to go down to, or the value
+         } MGET_T;
+
+static void node_prefetch(BTREE_T *t, NODE_T *n) {
+    // Asks for the cache lines that node_search() reads:
+    // the header and the numeric keys that follow the
+    // slots, or the slots that reference other keys
+    char   *p = (char *)(n + 1);
+    size_t  len = (1 + btree_maxkeys(t)) * sizeof(REDIRECT_T);
+    size_t  off;
+
+    __builtin_prefetch(n);
+    if (btree_keysize(t)) {
+      p += len;
+      len = (1 + btree_maxkeys(t)) * btree_keysize(t);
+    }
+    for (off = 0; off < len; off += MGET_LINE) {
+      __builtin_prefetch(p + off);
+    }
+}
+
+static int mget_start(BTREE_T *t, MGET_T *m, char **keys,
+                      int idx, void **values, char *found) {
+    // Starts the lookup of keys[idx] from the root,
+    // -1 if the key is invalid
+    m->idx = idx;
+    m->n = btree_root(t);
+    m->slot = NULL;
+    m->hit = 0;
+    if ((m->key = key_parse(t, keys[idx], &(m->keybuf))) == NULL) {
+      values[idx] = NULL;
+      if (found) {
+        found[idx] = 0;
+      }
+      return -1;
+    }
+    return 0;
+}
+
+extern int btree_get_many(BTREE_T *t, int cnt, char **keys,
+                          void **values, char *found) {
+    // btree_get() for the cnt keys of an array: values[i]
+    // receives the value of keys[i], NULL if the key isn't
+    // in the tree, and found[i] (if found isn't NULL) says
+    // whether it is. Up to MGET_GROUP lookups are interleaved,
+    // so that while the node that one of them needs is on its
+    // way from memory, the others progress.
+    // Returns the number of keys found.
+    MGET_T   g[MGET_GROUP];
+    MGET_T  *m;
+    int      active = 0;
+    int      next = 0;
+    int      hits = 0;
+    int      i;
+    short    pos;
+    int      cmp;
+    char     done;
+
+    if (btree_concurrent(t) || (btree_root(t) == NULL)) {
+      // Reads of a concurrent tree may have to start again
+      for (i = 0; i < cnt; i++) {
+        values[i] = NULL;
+        cmp = btree_get(t, keys[i], &(values[i]));
+        if (found) {
+          found[i] = (cmp == 0);
+        }
+        hits += (cmp == 0);
+      }
+      return hits;
+    }
+    debug(0, "interleaved lookup of %d keys", cnt);
+    node_prefetch(t, btree_root(t));
+    while ((active < MGET_GROUP) && (next < cnt)) {
+      if (mget_start(t, &(g[active]), keys, next++, values, found) == 0) {
+        active++;
+      }
+    }
+    i = 0;
+    while (active) {
+      m = &(g[i]);
+      done = 0;
+      if (m->n) {
+        pos = node_search(t, m->n, m->key, &cmp);
+        if ((cmp == 0) && (_is_leaf(m->n) || !btree_plus(t))) {
+          m->slot = &(m->n->k[pos]);
+          m->hit = 1;
+        } else if (_is_leaf(m->n)) {
+          done = 1;
+        } else {
+          m->slot = &(m->n->k[cmp ? pos - 1 : pos]);
+        }
+        m->n = NULL;
+        if (!done) {
+          __builtin_prefetch(m->slot);
+        }
+      } else if (m->hit) {
+        done = 1;
+      } else {
+        m->n = m->slot->bigger;
+        node_prefetch(t, m->n);
+      }
+      if (done) {
+        values[m->idx] = (m->hit ? m->slot->value : NULL);
+        if (found) {
+          found[m->idx] = m->hit;
+        }
+        hits += m->hit;
+        // The next key takes the place
+        done = 0;
+        while (!done && (next < cnt)) {
+          done = (mget_start(t, m, keys, next++, values, found) == 0);
+        }
+        if (!done) {
+          // None left, the last lookup moves here
+          *m = g[--active];
+          if (btree_keysize(t)) {
+            m->key = (char *)&(m->keybuf);
+          }
+          if (i >= active) {
+            i = 0;
+          }
+          continue;
+        }
+      }
+      if (++i >= active) {
+        i = 0;
+      }
+    }
+    return hits;
+}
+
 // The following function is merely to display the search path
-static char search_tree(char *key, NODE_T *t, short lvl) {
+static char search_tree(BTREE_T *tree, char *key, NODE_T *t, short lvl) {
    // Returns 1 if found, 0 if not
    char ret = 0;
    int  i;
    int  cmp = -1;
+   char buf[KEY_TEXTLEN];
 
    if (key && t) {
      for (i = 0; i < lvl; i++) {
@@ -61,23 +389,23 @@ static char search_tree(char *key, NODE_T *t, short lvl) {
      }
      i = 1;
      while ((i <= t->keycnt)
-            && ((cmp = btree_keycmp(key, t->k[i].key)) > 0)) {
-       if (i) {
+            && ((cmp = btree_keycmp(tree, key, key_at(tree, t, i))) > 0)) {
+       if (i > 1) {
          putchar(',');
        }
-       if (btree_numeric()) {
-         printf("%d", (int)(t->k[i].key));
-       } else {
-         printf("%s", t->k[i].key);
-       }
+       printf("%s", key_text(tree, key_at(tree, t, i), buf));
        i++;
      }
-     if (cmp == 0) {
+     if ((cmp == 0) && btree_plus(tree) && !_is_leaf(t)) {
+       // Only a separator, the key is on its right
+       printf(" (separator)\n");
+       return search_tree(tree, key, t->k[i].bigger, lvl+2);
+     } else if (cmp == 0) {
        printf(" *** found\n");
        ret = 1;
      } else {
        putchar('\n');
-       return search_tree(key, t->k[i-1].bigger, lvl+2);
+       return search_tree(tree, key, t->k[i-1].bigger, lvl+2);
      }
    } else {
      printf("*** NOT FOUND ***\n");
@@ -85,17 +413,17 @@ static char search_tree(char *key, NODE_T *t, short lvl) {
    return ret;
 }
 
-extern void   btree_search(char *key) {
-  int     numkey;
-  NODE_T *root = btree_root();
+extern void   btree_search(BTREE_T *t, char *key) {
+  KEYBUF_T  val;
+  char     *k;
+  NODE_T   *root = btree_root(t);
 
   if (key) {
     printf("Search path:\n");
-    if (btree_numeric()) {
-      numkey = atoi(key);
-      (void)search_tree((char *)&numkey, root, 0);
+    if ((k = key_parse(t, key, &val)) == NULL) {
+      printf("*** NOT FOUND ***\n");
     } else {
-      (void)search_tree(key, root, 0);
+      (void)search_tree(t, k, root, 0);
     }
   }
 }
@@ -0,0 +1,586 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_serve.c
+ *
+ *  Serving a tree to other processes over a Unix domain socket.
+ *
+ *  btree_serve() listens on a socket and answers the requests of
+ *  any number of clients from a single thread: an epoll() loop
+ *  tells which connections can be read or written, so that no
+ *  client waits for another. A request is a line of text, a
+ *  keyword (the same as in the command loop) and its arguments:
+ *
+ *    INS <key>                   OK, NO if it's already there
+ *    DEL <key>                   OK, NO if it isn't there
+ *    FIND <key>                  OK, NO if it isn't there
+ *    RANGE <lo> <hi> [<limit>]   OK <n> then the n keys between
+ *                                lo and hi, one per line
+ *    SYNC                        OK, NO if it failed
+ *    QUIT                        OK, then the connection is closed
+ *    STOP                        OK, then the server stops
+ *
+ *  and an invalid request gets ERR followed by the reason. A
+ *  reply is a line as well (RANGE excepted), and replies come in
+ *  the order of the requests.
+ *
+ *  Clients needn't wait for a reply before sending the next
+ *  request: all the requests received from a connection in one
+ *  read are answered in one write. A run of FIND requests is
+ *  looked up with btree_get_many(), whose lookups overlap. A
+ *  client that doesn't read its replies stops being read once a
+ *  megabyte of them is waiting.
+ *
+ *  Changes go through btree_insert() and btree_delete(), and are
+ *  therefore logged (-j) or made in a file (-w) as from the
+ *  command loop; OK doesn't mean that they are on disk before
+ *  the log has been flushed or SYNC has been answered. Values
+ *  aren't served.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "bt.h"
+#include "debug.h"
+
+#define SERVE_LINEMAX   65536           // Longest request
+#define SERVE_READ      65536           // Read at once
+#define SERVE_OUTMAX    (1024 * 1024)   // Replies waiting
+#define SERVE_GROUP     64              // FIND looked up together
+#define SERVE_EVENTS    64
+
+typedef struct client_t {
+          int       fd;
+          char     *in;
+          size_t    insize;
+          size_t    inlen;
+          char     *out;
+          size_t    outsize;
+          size_t    outlen;
+          size_t    outoff;     // Written
+          uint32_t  events;     // Waited for
+          char      eof;        // Nothing more to read
+          char      quit;       // Closed once replies are written
+          char      err;        // Closed now
+          struct client_t *prev;
+          struct client_t *next;
+         } CLIENT_T;
+
+typedef struct serve_t {
+          BTREE_T   *t;
+          int        ep;
+          CLIENT_T  *clients;
+          long       requests;
+          char       stop;
+          // Run of FIND requests
+          int        nfind;
+          char      *find[SERVE_GROUP];
+          size_t     findoff[SERVE_GROUP];  // Into aux, bytes keys
+          void      *vals[SERVE_GROUP];
+          char       found[SERVE_GROUP];
+          char      *aux;
+          size_t     auxsize;
+          size_t     auxlen;
+          // Bytes keys of other requests
+          char      *lo;
+          char      *hi;
+         } SERVE_T;
+
+static volatile sig_atomic_t G_stop = 0;
+
+static void serve_signal(int sig) {
+    (void)sig;
+    G_stop = 1;
+}
+
+static void out_add(CLIENT_T *c, const char *s, size_t len) {
+    if (c->outlen + len > c->outsize) {
+      while (c->outlen + len > c->outsize) {
+        c->outsize = (c->outsize ? 2 * c->outsize : 4096);
+      }
+      c->out = (char *)realloc(c->out, c->outsize);
+      assert(c->out);
+    }
+    memcpy(c->out + c->outlen, s, len);
+    c->outlen += len;
+}
+
+static void reply(CLIENT_T *c, const char *s) {
+    out_add(c, s, strlen(s));
+    out_add(c, "\n", 1);
+}
+
+static char *serve_key(SERVE_T *s, char *text, char *buf) {
+    // A key as btree_insert() and friends expect it,
+    // NULL if it isn't valid
+    KEYBUF_T  val;
+    size_t    len;
+
+    switch (btree_keytype(s->t)) {
+      case BTREE_BYTES:
+        if ((len = strlen(text)) > UINT16_MAX) {
+          return NULL;
+        }
+        return key_frombytes(buf, text, (uint16_t)len);
+      case BTREE_STRING:
+        return text;
+      default:
+        return (key_parse(s->t, text, &val) ? text : NULL);
+    }
+}
+
+static void find_flush(SERVE_T *s, CLIENT_T *c) {
+    // Answers the FIND requests of the run
+    int i;
+
+    if (s->nfind) {
+      if (btree_keytype(s->t) == BTREE_BYTES) {
+        // aux may have moved while the run grew
+        for (i = 0; i < s->nfind; i++) {
+          s->find[i] = s->aux + s->findoff[i];
+        }
+      }
+      (void)btree_get_many(s->t, s->nfind, s->find, s->vals, s->found);
+      for (i = 0; i < s->nfind; i++) {
+        reply(c, (s->found[i] ? "OK" : "NO"));
+      }
+      s->nfind = 0;
+      s->auxlen = 0;
+    }
+}
+
+static void find_add(SERVE_T *s, CLIENT_T *c, char *text) {
+    size_t len;
+
+    if (btree_keytype(s->t) == BTREE_BYTES) {
+      len = strlen(text);
+      if (len > UINT16_MAX) {
+        find_flush(s, c);
+        reply(c, "ERR invalid key");
+        return;
+      }
+      if (s->auxlen + sizeof(uint16_t) + len + 1 > s->auxsize) {
+        s->auxsize = 2 * (s->auxlen + sizeof(uint16_t) + len + 1);
+        s->aux = (char *)realloc(s->aux, s->auxsize);
+        assert(s->aux);
+      }
+      s->findoff[s->nfind] = s->auxlen;
+      (void)key_frombytes(s->aux + s->auxlen, text, (uint16_t)len);
+      // Next length aligned
+      s->auxlen += (sizeof(uint16_t) + len + 1) & ~(size_t)1;
+    } else {
+      if (serve_key(s, text, NULL) == NULL) {
+        find_flush(s, c);
+        reply(c, "ERR invalid key");
+        return;
+      }
+      s->find[s->nfind] = text;
+    }
+    if (++(s->nfind) == SERVE_GROUP) {
+      find_flush(s, c);
+    }
+}
+
+static void range(SERVE_T *s, CLIENT_T *c, char *args) {
+    // The reply starts with the number of keys, known at
+    // the end: keys are added first, then moved after it
+    CURSOR_T  cur;
+    KEYBUF_T  val;
+    char     *lo;
+    char     *hi;
+    char     *k;
+    char     *save;
+    long      limit = -1;
+    long      cnt = 0;
+    size_t    start = c->outlen;
+    size_t    len;
+    char      buf[KEY_TEXTLEN];
+    char      hdr[32];
+
+    lo = strtok_r(args, " \t", &save);
+    hi = strtok_r(NULL, " \t", &save);
+    if ((k = strtok_r(NULL, " \t", &save)) != NULL) {
+      limit = strtol(k, NULL, 10);
+    }
+    if ((lo == NULL) || (hi == NULL)) {
+      reply(c, "ERR usage: RANGE <lo> <hi> [<limit>]");
+      return;
+    }
+    if (((lo = serve_key(s, lo, s->lo)) == NULL)
+        || ((hi = serve_key(s, hi, s->hi)) == NULL)
+        || ((hi = key_parse(s->t, hi, &val)) == NULL)) {
+      reply(c, "ERR invalid key");
+      return;
+    }
+    if (btree_seek(s->t, lo, &cur) == 0) {
+      while (((limit < 0) || (cnt < limit))
+             && !cursor_end(&cur)
+             && (btree_keycmp(s->t, cursor_key(&cur), hi) <= 0)) {
+        k = cursor_key(&cur);
+        if (btree_keytype(s->t) == BTREE_BYTES) {
+          // As they were sent: key_text() shortens them
+          out_add(c, BYTES_DATA(k), BYTES_LEN(k));
+          out_add(c, "\n", 1);
+        } else {
+          reply(c, key_text(s->t, k, buf));
+        }
+        cnt++;
+        (void)cursor_next(&cur);
+      }
+      cursor_close(&cur);
+    }
+    len = (size_t)snprintf(hdr, sizeof(hdr), "OK %ld\n", cnt);
+    out_add(c, hdr, len);   // Room for it
+    memmove(c->out + start + len, c->out + start, c->outlen - len - start);
+    memcpy(c->out + start, hdr, len);
+}
+
+static void request(SERVE_T *s, CLIENT_T *c, char *line) {
+    char *args;
+    char *k;
+    int   kw;
+
+    while (isspace((unsigned char)*line)) {
+      line++;
+    }
+    if (*line == '\0') {
+      return;
+    }
+    s->requests++;
+    args = line;
+    while (*args && !isspace((unsigned char)*args)) {
+      args++;
+    }
+    if (*args) {
+      *args++ = '\0';
+      while (isspace((unsigned char)*args)) {
+        args++;
+      }
+    }
+    kw = bt_search(line);
+    if ((kw == BT_FIND) || (kw == BT_SEARCH) || (kw == BT_GET)) {
+      if (*args) {
+        find_add(s, c, args);
+      } else {
+        find_flush(s, c);
+        reply(c, "ERR usage: FIND <key>");
+      }
+      return;
+    }
+    find_flush(s, c);
+    switch (kw) {
+      case BT_INS:
+      case BT_ADD:
+      case BT_DEL:
+      case BT_REM:
+        if (*args == '\0') {
+          reply(c, "ERR missing key");
+        } else if ((k = serve_key(s, args, s->lo)) == NULL) {
+          reply(c, "ERR invalid key");
+        } else if ((kw == BT_INS) || (kw == BT_ADD)) {
+          reply(c, (btree_insert(s->t, k) == 0 ? "OK" : "NO"));
+        } else {
+          reply(c, (btree_delete(s->t, k) == 0 ? "OK" : "NO"));
+        }
+        break;
+      case BT_RANGE:
+        range(s, c, args);
+        break;
+      case BT_SYNC:
+        reply(c, (btree_sync(s->t) == 0 ? "OK" : "NO"));
+        break;
+      case BT_BYE:
+      case BT_QUIT:
+        reply(c, "OK");
+        c->quit = 1;
+        break;
+      case BT_STOP:
+        reply(c, "OK");
+        s->stop = 1;
+        break;
+      default:
+        reply(c, "ERR unknown request");
+        break;
+    }
+}
+
+static char client_pending(CLIENT_T *c) {
+    // Whether a request is waiting to be answered
+    return (memchr(c->in, '\n', c->inlen) != NULL)
+           || (c->eof && c->inlen);
+}
+
+static void client_serve(SERVE_T *s, CLIENT_T *c) {
+    // Answers the requests received, as long as there
+    // isn't too much waiting to be written
+    char   *p = c->in;
+    char   *end = c->in + c->inlen;
+    char   *nl;
+
+    while (!c->quit && !s->stop && (c->outlen - c->outoff < SERVE_OUTMAX)
+           && (p < end)) {
+      if ((nl = (char *)memchr(p, '\n', (size_t)(end - p))) == NULL) {
+        if (!c->eof) {
+          break;
+        }
+        nl = end;   // Last request without a newline
+      }
+      *nl = '\0';
+      request(s, c, p);
+      p = (nl < end ? nl + 1 : end);
+    }
+    find_flush(s, c);
+    c->inlen = (size_t)(end - p);
+    memmove(c->in, p, c->inlen);
+    if ((c->inlen >= SERVE_LINEMAX) && !client_pending(c)) {
+      reply(c, "ERR request too long");
+      c->quit = 1;
+    }
+}
+
+static void client_read(CLIENT_T *c) {
+    ssize_t got;
+
+    if (c->insize - c->inlen < SERVE_READ + 1) {
+      // One more for the end of a request without a newline
+      c->insize = c->inlen + SERVE_READ + 1;
+      c->in = (char *)realloc(c->in, c->insize);
+      assert(c->in);
+    }
+    if ((got = read(c->fd, c->in + c->inlen, SERVE_READ)) > 0) {
+      c->inlen += (size_t)got;
+    } else if (got == 0) {
+      c->eof = 1;
+    } else if ((errno != EAGAIN) && (errno != EINTR)) {
+      c->err = 1;
+    }
+}
+
+static void client_write(CLIENT_T *c) {
+    ssize_t got;
+
+    while (c->outoff < c->outlen) {
+      got = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+                 MSG_NOSIGNAL);
+      if (got < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN) {
+          c->err = 1;
+        }
+        break;
+      }
+      c->outoff += (size_t)got;
+    }
+    if (c->outoff == c->outlen) {
+      c->outoff = 0;
+      c->outlen = 0;
+    }
+}
+
+static void client_close(SERVE_T *s, CLIENT_T *c) {
+    if (c->prev) {
+      c->prev->next = c->next;
+    } else {
+      s->clients = c->next;
+    }
+    if (c->next) {
+      c->next->prev = c->prev;
+    }
+    close(c->fd);   // Also out of the epoll set
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void client_run(SERVE_T *s, CLIENT_T *c, uint32_t events) {
+    // Reads, answers and writes what can be, then waits
+    // for what comes next - or closes the connection
+    struct epoll_event ev;
+
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->eof && !c->quit) {
+      client_read(c);
+    }
+    do {
+      client_serve(s, c);
+      client_write(c);
+    } while (!c->err && !c->quit && !s->stop
+             && (c->outlen == 0) && client_pending(c));
+    if (c->err
+        || ((c->outlen == 0)
+            && (c->quit || (c->eof && !client_pending(c))))) {
+      client_close(s, c);
+      return;
+    }
+    ev.events = 0;
+    if (c->outlen) {
+      ev.events |= EPOLLOUT;
+    }
+    if (!c->eof && !c->quit && (c->outlen < SERVE_OUTMAX)) {
+      ev.events |= EPOLLIN;
+    }
+    if (ev.events != c->events) {
+      ev.data.ptr = c;
+      if (epoll_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev)) {
+        perror("epoll_ctl");
+        client_close(s, c);
+        return;
+      }
+      c->events = ev.events;
+    }
+}
+
+static void client_new(SERVE_T *s, int fd) {
+    struct epoll_event  ev;
+    CLIENT_T           *c;
+
+    if ((c = (CLIENT_T *)malloc(sizeof(CLIENT_T))) == NULL) {
+      close(fd);
+      return;
+    }
+    memset(c, 0, sizeof(CLIENT_T));
+    (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    c->fd = fd;
+    c->events = EPOLLIN;
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev)) {
+      perror("epoll_ctl");
+      close(fd);
+      free(c);
+      return;
+    }
+    c->next = s->clients;
+    if (c->next) {
+      c->next->prev = c;
+    }
+    s->clients = c;
+    debug(0, "client %d connected", fd);
+}
+
+static int serve_listen(const char *path) {
+    // Listening socket at path, replacing a socket left
+    // there; -1 if it fails
+    struct sockaddr_un  addr;
+    struct stat         st;
+    int                 fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "%s: socket path too long\n", path);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+      (void)unlink(path);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) < 0) {
+      perror("socket");
+      return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(fd, SOMAXCONN)) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    return fd;
+}
+
+extern long btree_serve(BTREE_T *t, const char *path) {
+    // Answers requests on a Unix domain socket created at
+    // path, until a STOP request, SIGINT or SIGTERM.
+    // Returns the number of requests served, -1 if the
+    // socket can't be set up.
+    struct epoll_event  ev[SERVE_EVENTS];
+    struct sigaction    act;
+    struct sigaction    oldint;
+    struct sigaction    oldterm;
+    SERVE_T             s;
+    CLIENT_T           *c;
+    int                 lfd;
+    int                 fd;
+    int                 n;
+    int                 i;
+
+    assert(t && path);
+    if ((lfd = serve_listen(path)) < 0) {
+      return -1;
+    }
+    memset(&s, 0, sizeof(s));
+    s.t = t;
+    if ((s.ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      perror("epoll_create1");
+      close(lfd);
+      unlink(path);
+      return -1;
+    }
+    ev[0].events = EPOLLIN;
+    ev[0].data.ptr = NULL;   // The listening socket
+    (void)epoll_ctl(s.ep, EPOLL_CTL_ADD, lfd, &(ev[0]));
+    s.lo = (char *)malloc(sizeof(uint16_t) + SERVE_LINEMAX);
+    s.hi = (char *)malloc(sizeof(uint16_t) + SERVE_LINEMAX);
+    assert(s.lo && s.hi);
+    // Interrupts epoll_wait() rather than restarting it
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = serve_signal;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, &oldint);
+    sigaction(SIGTERM, &act, &oldterm);
+    G_stop = 0;
+    debug(0, "serving on %s", path);
+    while (!s.stop && !G_stop) {
+      if ((n = epoll_wait(s.ep, ev, SERVE_EVENTS, -1)) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("epoll_wait");
+        break;
+      }
+      for (i = 0; (i < n) && !s.stop; i++) {
+        if (ev[i].data.ptr == NULL) {
+          while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+            client_new(&s, fd);
+          }
+          if ((errno != EAGAIN) && (errno != EINTR)
+              && (errno != ECONNABORTED)) {
+            perror("accept");
+          }
+        } else {
+          client_run(&s, (CLIENT_T *)ev[i].data.ptr, ev[i].events);
+        }
+      }
+    }
+    // Replies already made are sent if they can be
+    while ((c = s.clients) != NULL) {
+      client_write(c);
+      client_close(&s, c);
+    }
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGTERM, &oldterm, NULL);
+    close(s.ep);
+    close(lfd);
+    unlink(path);
+    free(s.lo);
+    free(s.hi);
+    free(s.aux);
+    debug(0, "%ld requests served", s.requests);
+    return s.requests;
+}
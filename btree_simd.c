@@ -0,0 +1,174 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_simd.c
+ *
+ *  Vector kernels for searching inline integer keys in a node.
+ *
+ *  Keys in a node are sorted, so the position of a key is given
+ *  by the number of keys that are smaller. Comparing a whole
+ *  register of keys at once and counting the bits of the resulting
+ *  mask gives that number in a handful of instructions.
+ *  The best kernel for the CPU is chosen at the first call; the
+ *  scalar versions are used everywhere else.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+static short scalar_count_less32(int32_t *keys, short cnt, int32_t key) {
+    short i = 0;
+
+    while ((i < cnt) && (keys[i] < key)) {
+      i++;
+    }
+    return i;
+}
+
+static short scalar_count_less64(int64_t *keys, short cnt, int64_t key) {
+    short i = 0;
+
+    while ((i < cnt) && (keys[i] < key)) {
+      i++;
+    }
+    return i;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2")))
+static short avx2_count_less32(int32_t *keys, short cnt, int32_t key) {
+    short   i = 0;
+    int     mask;
+    __m256i k = _mm256_set1_epi32(key);
+
+    while (i + 8 <= cnt) {
+      // Lanes where key > keys[i..i+7]
+      mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+               _mm256_cmpgt_epi32(k,
+                 _mm256_loadu_si256((__m256i *)(keys + i)))));
+      if (mask != 0xff) {
+        return i + __builtin_popcount(mask);
+      }
+      i += 8;
+    }
+    return i + scalar_count_less32(keys + i, cnt - i, key);
+}
+
+__attribute__((target("avx2")))
+static short avx2_count_less64(int64_t *keys, short cnt, int64_t key) {
+    short   i = 0;
+    int     mask;
+    __m256i k = _mm256_set1_epi64x(key);
+
+    while (i + 4 <= cnt) {
+      mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+               _mm256_cmpgt_epi64(k,
+                 _mm256_loadu_si256((__m256i *)(keys + i)))));
+      if (mask != 0xf) {
+        return i + __builtin_popcount(mask);
+      }
+      i += 4;
+    }
+    return i + scalar_count_less64(keys + i, cnt - i, key);
+}
+
+__attribute__((target("sse4.2")))
+static short sse_count_less32(int32_t *keys, short cnt, int32_t key) {
+    short   i = 0;
+    int     mask;
+    __m128i k = _mm_set1_epi32(key);
+
+    while (i + 4 <= cnt) {
+      mask = _mm_movemask_ps(_mm_castsi128_ps(
+               _mm_cmpgt_epi32(k,
+                 _mm_loadu_si128((__m128i *)(keys + i)))));
+      if (mask != 0xf) {
+        return i + __builtin_popcount(mask);
+      }
+      i += 4;
+    }
+    return i + scalar_count_less32(keys + i, cnt - i, key);
+}
+
+__attribute__((target("sse4.2")))
+static short sse_count_less64(int64_t *keys, short cnt, int64_t key) {
+    short   i = 0;
+    int     mask;
+    __m128i k = _mm_set1_epi64x(key);
+
+    while (i + 2 <= cnt) {
+      mask = _mm_movemask_pd(_mm_castsi128_pd(
+               _mm_cmpgt_epi64(k,
+                 _mm_loadu_si128((__m128i *)(keys + i)))));
+      if (mask != 0x3) {
+        return i + __builtin_popcount(mask);
+      }
+      i += 2;
+    }
+    return i + scalar_count_less64(keys + i, cnt - i, key);
+}
+#endif
+
+static short simd_init_less32(int32_t *keys, short cnt, int32_t key);
+static short simd_init_less64(int64_t *keys, short cnt, int64_t key);
+
+// Start with a function that picks the right kernels
+static short (*G_less32)(int32_t *, short, int32_t) = simd_init_less32;
+static short (*G_less64)(int64_t *, short, int64_t) = simd_init_less64;
+static const char *G_simd = NULL;
+
+static void simd_init(void) {
+    G_less32 = scalar_count_less32;
+    G_less64 = scalar_count_less64;
+    G_simd = "scalar";
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (getenv("BTREE_NOSIMD") == NULL) {
+      if (__builtin_cpu_supports("avx2")) {
+        G_less32 = avx2_count_less32;
+        G_less64 = avx2_count_less64;
+        G_simd = "avx2";
+      } else if (__builtin_cpu_supports("sse4.2")) {
+        G_less32 = sse_count_less32;
+        G_less64 = sse_count_less64;
+        G_simd = "sse4.2";
+      }
+    }
+#endif
+    debug(0, "node search kernels: %s", G_simd);
+}
+
+static short simd_init_less32(int32_t *keys, short cnt, int32_t key) {
+    simd_init();
+    return G_less32(keys, cnt, key);
+}
+
+static short simd_init_less64(int64_t *keys, short cnt, int64_t key) {
+    simd_init();
+    return G_less64(keys, cnt, key);
+}
+
+extern short simd_count_less32(int32_t *keys, short cnt, int32_t key) {
+    // Number of keys (sorted) smaller than key
+    return G_less32(keys, cnt, key);
+}
+
+extern short simd_count_less64(int64_t *keys, short cnt, int64_t key) {
+    return G_less64(keys, cnt, key);
+}
+
+extern const char *simd_kernels(void) {
+    // Name of the kernels in use
+    if (G_simd == NULL) {
+      simd_init();
+    }
+    return G_simd;
+}
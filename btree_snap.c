@@ -0,0 +1,466 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         btree_snap.c
+ *
+ *  Snapshots of a tree.
+ *
+ *  Rebuilding a tree from its keys means inserting them again,
+ *  splits included. btree_save() writes instead the tree as it
+ *  is: a header, the nodes one after the other from the root
+ *  down, level by level, then all the keys that aren't stored
+ *  inline, packed. A node only takes what it holds (not the
+ *  empty slots), and references its children by their rank in
+ *  the file and its keys by their place among the packed keys.
+ *
+ *  btree_restore() maps the file, copies the packed keys at once
+ *  into a block of the key arena (they are laid out as the arena
+ *  lays them out), then takes one node from the node arena for
+ *  each node of the file and turns ranks and places back into
+ *  addresses. Nothing is compared, nothing is split: restoring
+ *  a tree costs about what reading the file does. Because nodes
+ *  are saved level by level, leaves come one after the other in
+ *  key order, and the chain of the leaves of a B+tree is rebuilt
+ *  from it.
+ *
+ *  A checksum (CRC-32C) of the nodes and keys is kept in the
+ *  header, and what the file says is checked before it is used:
+ *  each node but the root must be the child of exactly one node
+ *  before it, in the order btree_save() gives ranks, and keys
+ *  must end within the packed keys. A damaged file is refused.
+ *
+ *  Values belong to the program and aren't saved. A tree that
+ *  has a log (btree_log.c) is saved as of all the changes logged,
+ *  and its log is emptied: restoring the snapshot then replaying
+ *  the log gives the tree back.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "btree.h"
+#include "debug.h"
+
+#define SNAP_MAGIC    "BTREESN2"
+#define SNAP_BUFSIZE  (1024 * 1024)
+#define SNAP_ALIGN    8   // Of node records
+
+typedef struct snap_hdr_t {
+          char      magic[8];
+          char      keytype;
+          char      unique;
+          char      plus;
+          char      prefix;
+          char      topdown;
+          char      pad;
+          short     maxkeys;
+          uint64_t  nodes;      // Root first
+          uint64_t  keys;       // In the tree
+          uint64_t  nodebytes;  // Node records
+          uint64_t  keybytes;   // Packed keys, after the nodes
+          uint32_t  crc;        // CRC-32C of nodes and keys
+          uint32_t  pad2;
+         } SNAP_HDR_T;
+
+// A node, followed by its keycnt + 1 slots then, with
+// numeric keys, by its keys (from slot 1)
+typedef struct snap_node_t {
+          short     keycnt;
+          short     pfxlen;
+          uint32_t  pad;
+          uint64_t  pfx;        // Place + 1 among packed keys
+         } SNAP_NODE_T;
+
+typedef struct snap_slot_t {
+          uint64_t  key;        // Place + 1 among packed keys
+          uint64_t  bigger;     // Rank of the child, 0 if none
+         } SNAP_SLOT_T;
+
+typedef struct snap_keys_t {
+          char    *area;
+          size_t   used;
+          size_t   size;
+         } SNAP_KEYS_T;
+
+static uint64_t keys_add(SNAP_KEYS_T *sk, const char *data, size_t len) {
+    // Packs a key, and returns its place + 1
+    size_t  need = keyarena_packsize(len);
+    char   *k;
+
+    if (sk->used + need > sk->size) {
+      sk->size = 2 * sk->size + need;
+      sk->area = (char *)realloc(sk->area, sk->size);
+      assert(sk->area);
+    }
+    k = keyarena_pack(sk->area + sk->used, data, len);
+    sk->used += need;
+    return (uint64_t)(k - sk->area) + 1;
+}
+
+static int snap_write(FILE *fp, const void *data, size_t len,
+                      uint32_t *crc) {
+    // What follows the header, in the checksum
+    *crc = crc32c(*crc, (const char *)data, len);
+    return (fwrite(data, 1, len, fp) == len);
+}
+
+static char *snap_key(char *keys, uint64_t keybytes, uint64_t place,
+                      uint32_t *lenptr) {
+    // The packed key at place + 1, NULL if it doesn't end
+    // within the keys
+    uint64_t off = place - 1;
+    uint32_t len;
+
+    if ((off < sizeof(len)) || (off % sizeof(len)) || (off > keybytes)) {
+      return NULL;
+    }
+    memcpy(&len, keys + off - sizeof(len), sizeof(len));
+    if (len > keybytes - off) {
+      return NULL;
+    }
+    *lenptr = len;
+    return keys + off;
+}
+
+static size_t numeric_bytes(BTREE_T *t, short keycnt) {
+    // Inline keys of a node record, padded
+    return (keycnt * btree_keysize(t) + SNAP_ALIGN - 1)
+           & ~(size_t)(SNAP_ALIGN - 1);
+}
+
+extern int btree_save(BTREE_T *t, const char *path) {
+    // Writes a snapshot of the tree to path, replaced only
+    // once the new one is complete. The tree must not change
+    // meanwhile. Returns the number of keys saved, -1 if the
+    // file couldn't be written.
+    char         *tmp;
+    FILE         *fp;
+    SNAP_HDR_T    hdr;
+    SNAP_NODE_T   sn;
+    SNAP_SLOT_T   ss;
+    SNAP_KEYS_T   sk = {NULL, 0, 0};
+    NODE_T      **q = NULL;
+    size_t        qcnt = 0;
+    size_t        qmax = 0;
+    size_t        i;
+    NODE_T       *n;
+    char         *key;
+    char          zeros[SNAP_ALIGN];
+    short         j;
+    uint32_t      crc = 0xFFFFFFFF;
+    int           ok;
+
+    assert(t && path);
+    tmp = (char *)malloc(strlen(path) + 5);
+    assert(tmp);
+    sprintf(tmp, "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+      perror(tmp);
+      free(tmp);
+      return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAP_BUFSIZE);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.keytype = btree_keytype(t);
+    hdr.unique = btree_unique(t);
+    hdr.plus = btree_plus(t);
+    hdr.prefix = btree_prefix(t);
+    hdr.topdown = btree_topdown(t);
+    hdr.maxkeys = btree_maxkeys(t);
+    memset(zeros, 0, sizeof(zeros));
+    ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+    if (btree_root(t)) {
+      qmax = 1024;
+      q = (NODE_T **)malloc(qmax * sizeof(NODE_T *));
+      assert(q);
+      q[qcnt++] = btree_root(t);
+    }
+    // Level by level: the children of a node get their
+    // rank when it's written
+    for (i = 0; ok && (i < qcnt); i++) {
+      n = q[i];
+      memset(&sn, 0, sizeof(sn));
+      sn.keycnt = n->keycnt;
+      if (n->pfxlen) {
+        sn.pfxlen = n->pfxlen;
+        sn.pfx = keys_add(&sk, n->pfx, (size_t)n->pfxlen);
+      }
+      ok = snap_write(fp, &sn, sizeof(sn), &crc);
+      for (j = 0; ok && (j <= n->keycnt); j++) {
+        ss.key = 0;
+        ss.bigger = 0;
+        if ((key = n->k[j].key) != NULL) {
+          ss.key = keys_add(&sk, key, (btree_keytype(t) == BTREE_BYTES ?
+                                       BYTES_SIZE(key) : strlen(key) + 1));
+        }
+        if (n->k[j].bigger) {
+          if (qcnt == qmax) {
+            qmax *= 2;
+            q = (NODE_T **)realloc(q, qmax * sizeof(NODE_T *));
+            assert(q);
+          }
+          ss.bigger = qcnt;
+          q[qcnt++] = n->k[j].bigger;
+        }
+        ok = snap_write(fp, &ss, sizeof(ss), &crc);
+      }
+      if (ok && btree_keysize(t) && n->keycnt) {
+        ok = snap_write(fp, n->nk + btree_keysize(t),
+                        n->keycnt * btree_keysize(t), &crc)
+             && snap_write(fp, zeros, numeric_bytes(t, n->keycnt)
+                                      - n->keycnt * btree_keysize(t), &crc);
+      }
+      hdr.nodebytes += sizeof(sn) + (n->keycnt + 1) * sizeof(ss)
+                       + (btree_keysize(t) ? numeric_bytes(t, n->keycnt) : 0);
+      if (!btree_plus(t) || (n->k[0].bigger == NULL)) {
+        hdr.keys += n->keycnt;
+      }
+    }
+    hdr.nodes = qcnt;
+    hdr.keybytes = sk.used;
+    if (ok && sk.used) {
+      ok = snap_write(fp, sk.area, sk.used, &crc);
+    }
+    hdr.crc = ~crc;
+    if (ok) {
+      rewind(fp);
+      ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1)
+           && (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    }
+    free(q);
+    free(sk.area);
+    if ((fclose(fp) != 0) || !ok || rename(tmp, path)) {
+      perror(path);
+      unlink(tmp);
+      free(tmp);
+      return -1;
+    }
+    free(tmp);
+    debug(0, "%s: %lu nodes, %lu bytes of keys", path,
+          (unsigned long)hdr.nodes, (unsigned long)hdr.keybytes);
+    if (btree_log(t)) {
+      // Everything logged is in the snapshot
+      log_reset(t);
+    }
+    return (int)hdr.keys;
+}
+
+static int snap_settings(BTREE_T *t, SNAP_HDR_T *hdr, const char *path) {
+    // The tree takes the settings of the snapshot, except
+    // a tree in a file whose settings must be the same
+    if (btree_file(t)) {
+      if ((hdr->keytype != btree_keytype(t))
+          || (hdr->maxkeys != btree_maxkeys(t))
+          || (hdr->plus != btree_plus(t))
+          || (hdr->prefix != btree_prefix(t))) {
+        fprintf(stderr, "%s: not saved with the settings of the file\n", path);
+        return -1;
+      }
+      return 0;
+    }
+    if ((btree_plus(t) && !hdr->plus) || (btree_prefix(t) && !hdr->prefix)) {
+      fprintf(stderr, "%s: saved without %s\n", path,
+              ((btree_plus(t) && !hdr->plus) ? "B+tree mode" : "compressed keys"));
+      return -1;
+    }
+    if (hdr->prefix && btree_concurrent(t)) {
+      fprintf(stderr, "%s: compressed keys can't be shared by threads\n", path);
+      return -1;
+    }
+    btree_setkeytype(t, hdr->keytype);
+    btree_setmaxkeys(t, hdr->maxkeys);
+    if (hdr->plus) {
+      btree_setplus(t);
+    }
+    if (hdr->prefix) {
+      btree_setprefix(t);
+    }
+    if (hdr->unique) {
+      btree_setunique(t);
+    }
+    if (hdr->topdown) {
+      btree_settopdown(t);
+    }
+    return 0;
+}
+
+extern int btree_restore(BTREE_T *t, const char *path) {
+    // Gives back to an empty tree, that has no log yet,
+    // what was saved in path, with its settings. Returns
+    // the number of keys, -1 if the file can't be used.
+    SNAP_HDR_T    hdr;
+    SNAP_NODE_T   sn;
+    SNAP_SLOT_T   ss;
+    struct stat   st;
+    char         *map;
+    char         *p;
+    char         *end;
+    char         *keys = NULL;
+    NODE_T      **nodes = NULL;
+    NODE_T       *n;
+    NODE_T       *leaf = NULL;
+    uint64_t      i;
+    uint64_t      next = 1;   // Rank of the next child
+    uint64_t      cnt = 0;
+    uint32_t      len;
+    short         j;
+    int           fd;
+    int           ok = 1;
+
+    assert(t && path);
+    if (btree_root(t) || btree_log(t)) {
+      fprintf(stderr, "%s: the tree must be empty, without a log\n", path);
+      return -1;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0) {
+      perror(path);
+      return -1;
+    }
+    if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(hdr))) {
+      fprintf(stderr, "%s: not a snapshot\n", path);
+      close(fd);
+      return -1;
+    }
+    map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      perror(path);
+      return -1;
+    }
+    (void)madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic))
+        || (hdr.nodebytes > (uint64_t)st.st_size)
+        || (hdr.keybytes > (uint64_t)st.st_size)
+        || (sizeof(hdr) + hdr.nodebytes + hdr.keybytes
+            != (uint64_t)st.st_size)
+        || (hdr.keytype < BTREE_STRING) || (hdr.keytype > BTREE_BYTES)
+        || (hdr.maxkeys < 3)
+        // A node takes at least a record and a slot
+        || (hdr.nodes > hdr.nodebytes
+                        / (sizeof(SNAP_NODE_T) + sizeof(SNAP_SLOT_T)))) {
+      fprintf(stderr, "%s: not a snapshot\n", path);
+      munmap(map, (size_t)st.st_size);
+      return -1;
+    }
+    if (~crc32c(0xFFFFFFFF, map + sizeof(hdr), hdr.nodebytes + hdr.keybytes)
+        != hdr.crc) {
+      fprintf(stderr, "%s: damaged snapshot\n", path);
+      munmap(map, (size_t)st.st_size);
+      return -1;
+    }
+    if (snap_settings(t, &hdr, path)) {
+      munmap(map, (size_t)st.st_size);
+      return -1;
+    }
+    page_touch(t);
+    if (hdr.nodes) {
+      if (hdr.keybytes) {
+        // In one go, as they were packed
+        keys = key_space(t, hdr.keybytes);
+        memcpy(keys, map + sizeof(hdr) + hdr.nodebytes, hdr.keybytes);
+      }
+      nodes = (NODE_T **)malloc(hdr.nodes * sizeof(NODE_T *));
+      assert(nodes);
+      for (i = 0; i < hdr.nodes; i++) {
+        nodes[i] = new_node(t);
+      }
+      btree_setroot(t, nodes[0]);
+    }
+    p = map + sizeof(hdr);
+    end = p + hdr.nodebytes;
+    for (i = 0; ok && (i < hdr.nodes); i++) {
+      n = nodes[i];
+      if ((p + sizeof(sn) > end) || ((i > 0) && (i >= next))) {
+        // Not the child of a node before it
+        ok = 0;
+        break;
+      }
+      memcpy(&sn, p, sizeof(sn));
+      p += sizeof(sn);
+      if ((sn.keycnt < 0) || (sn.keycnt > btree_maxkeys(t))
+          || (p + (sn.keycnt + 1) * sizeof(ss)
+                + (btree_keysize(t) ? numeric_bytes(t, sn.keycnt) : 0) > end)
+          || (sn.pfxlen < 0)) {
+        ok = 0;
+        break;
+      }
+      n->keycnt = sn.keycnt;
+      if (sn.pfx) {
+        if (((n->pfx = snap_key(keys, hdr.keybytes, sn.pfx, &len)) == NULL)
+            || (sn.pfxlen > (int64_t)len)) {
+          ok = 0;
+          break;
+        }
+        n->pfxlen = sn.pfxlen;
+      }
+      for (j = 0; j <= n->keycnt; j++) {
+        memcpy(&ss, p, sizeof(ss));
+        p += sizeof(ss);
+        n->k[j].key = NULL;
+        if (ss.key) {
+          if ((btree_keysize(t) != 0)
+              || ((n->k[j].key = snap_key(keys, hdr.keybytes, ss.key, &len))
+                  == NULL)
+              || ((btree_keytype(t) == BTREE_BYTES) ?
+                  ((len < sizeof(uint16_t)) || (BYTES_SIZE(n->k[j].key) > len))
+                  : ((len == 0) || (n->k[j].key[len - 1] != '\0')))) {
+            ok = 0;
+            break;
+          }
+        } else if ((j > 0) && (btree_keysize(t) == 0)) {
+          ok = 0;
+          break;
+        }
+        // Children get their ranks in the order of the file,
+        // each one once; a node has all its children or none
+        if ((ss.bigger && (ss.bigger != next))
+            || ((j > 0) && (!ss.bigger != !n->k[0].bigger))
+            || (ss.bigger >= hdr.nodes)) {
+          ok = 0;
+          break;
+        }
+        if (ss.bigger) {
+          n->k[j].bigger = nodes[next++];
+        } else {
+          n->k[j].bigger = NULL;
+        }
+      }
+      if (ok && btree_keysize(t)) {
+        memcpy(n->nk + btree_keysize(t), p, n->keycnt * btree_keysize(t));
+        p += numeric_bytes(t, n->keycnt);
+      }
+      if (!btree_plus(t) || (n->k[0].bigger == NULL)) {
+        cnt += n->keycnt;
+      }
+      if (ok && btree_plus(t) && (n->k[0].bigger == NULL)) {
+        // Leaves come in key order
+        n->prev = leaf;
+        if (leaf) {
+          leaf->next = n;
+        }
+        leaf = n;
+      }
+    }
+    free(nodes);
+    munmap(map, (size_t)st.st_size);
+    if (!ok || (p != end) || (hdr.nodes && (next != hdr.nodes))
+        || (cnt != hdr.keys) || (cnt > INT_MAX)) {
+      fprintf(stderr, "%s: damaged snapshot\n", path);
+      // Not walked: nodes may be incomplete, and hold no values
+      btree_setroot(t, NULL);
+      btree_clear(t);
+      return -1;
+    }
+    debug(0, "%s: %lu nodes restored", path, (unsigned long)hdr.nodes);
+    return (int)hdr.keys;
+}